@@ -24,6 +24,7 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <thread>
 #include "config.h"
 #include "point.h"
 #include "cogo.h"
@@ -248,9 +249,9 @@ void maketin_i(string args)
       break;
     default:
       cout<<"Successfully made TIN."<<endl;
-      doc.pl[1].makegrad(0.15);
+      doc.pl[1].solvegrad(0.15,1e-12,200,thread::hardware_concurrency());
       doc.pl[1].maketriangles();
-      doc.pl[1].setgradient(false);
+      doc.pl[1].setgradient(false,thread::hardware_concurrency());
       doc.pl[1].makeqindex();
   }
 }
@@ -333,9 +334,9 @@ void contourdraw_i(string args)
   if (conterval>5e-6 && conterval<1e5)
     if (doc.pl.size()>1 && doc.pl[1].edges.size())
     {
-      doc.pl[1].findcriticalpts();
+      doc.pl[1].findcriticalpts(thread::hardware_concurrency());
       doc.pl[1].addperimeter();
-      roughcontours(doc.pl[1],conterval);
+      roughcontours(doc.pl[1],conterval,thread::hardware_concurrency());
       doc.pl[1].removeperimeter();
       smoothcontours(doc.pl[1],conterval,true,true);
       w=doc.pl[1].dirbound(degtobin(0));
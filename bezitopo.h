@@ -65,6 +65,7 @@
 #include <bezitopo/pointlist.h>
 #include <bezitopo/ps.h>
 #include <bezitopo/contour.h>
+#include <bezitopo/crosssection.h>
 #include <bezitopo/pnezd.h>
 #include <bezitopo/penwidth.h>
 #include <bezitopo/layer.h>
@@ -80,4 +81,6 @@
 #include <bezitopo/csv.h>
 #include <bezitopo/cogospiral.h>
 #include <bezitopo/boundrect.h>
+#include <bezitopo/volume.h>
+#include <bezitopo/overlay.h>
 #endif
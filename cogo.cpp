@@ -264,6 +264,17 @@ double pldist(xy a,xy b,xy c)
   return area3(a,b,c)/dist(b,c)*2;
 }
 
+double psdist(xy a,xy b,xy c)
+/* Distance from a to the segment bc. */
+{
+  double along=dot(a-b,c-b);
+  if (along<=0 || b==c)
+    return dist(a,b);
+  if (along>=sqr(dist(b,c)))
+    return dist(a,c);
+  return fabs(pldist(a,b,c));
+}
+
 xy rand2p(xy a,xy b)
 /* A random point in the circle with diameter ab. */
 {
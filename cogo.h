@@ -72,6 +72,8 @@ double polyPartArea(std::vector<point *> poly,int first,int last);
 bool isInside(xy pnt,std::vector<point *> poly);
 double pldist(xy a,xy b,xy c);
 // Signed distance from a to the line bc.
+double psdist(xy a,xy b,xy c);
+// Distance from a to the segment bc.
 bool delaunay(xy a,xy c,xy b,xy d);
 //Returns true if ac satisfies the criterion in the quadrilateral abcd.
 //If false, the edge should be flipped to bd.
@@ -23,6 +23,7 @@
  */
 #include <cfloat>
 #include <iostream>
+#include <algorithm>
 #include "ldecimal.h"
 #include "cogospiral.h"
 #include "manysum.h"
@@ -436,6 +437,111 @@ vector<array<alosta,2> > intersections(segment *a,segment *b,bool extend)
   return ret;
 }
 
+vector<PieceCrossing> allIntersections(vector<segment *> pieces,int nthreads)
+/* Finds all the crossings among many segments, arcs, and spiralarcs.
+ * The bounding circles of the pieces are put in a uniform grid, and
+ * intersections is called only on pairs whose circles overlap. A pair is
+ * checked in only one cell, the one containing the lower left corner of the
+ * overlap of their circles' boxes. Pieces that share an end, like consecutive
+ * pieces of a contour, are reported as crossing there.
+ */
+{
+  vector<PieceCrossing> ret;
+  vector<vector<PieceCrossing> > found;
+  vector<bcir> circles;
+  vector<array<int,2> > candidates;
+  vector<pair<long long,int> > cellPieces;
+  array<int,2> pair1;
+  int i,j,k,m,xcells,ycells,xlo,xhi,ylo,yhi;
+  double minx=INFINITY,miny=INFINITY,maxx=-INFINITY,maxy=-INFINITY,totdiam=0,cellsize;
+  for (i=0;i<pieces.size();i++)
+  {
+    circles.push_back(pieces[i]->boundCircle());
+    if (std::isfinite(circles[i].radius) && circles[i].center.isfinite())
+    {
+      minx=fmin(minx,circles[i].center.getx()-circles[i].radius);
+      miny=fmin(miny,circles[i].center.gety()-circles[i].radius);
+      maxx=fmax(maxx,circles[i].center.getx()+circles[i].radius);
+      maxy=fmax(maxy,circles[i].center.gety()+circles[i].radius);
+      totdiam+=2*circles[i].radius;
+    }
+  }
+  if (minx<=maxx)
+  {
+    cellsize=fmax(totdiam/pieces.size(),fmax(maxx-minx,maxy-miny)/(2*sqrt(pieces.size())+1));
+    if (cellsize==0)
+      cellsize=1;
+    xcells=floor((maxx-minx)/cellsize)+1;
+    ycells=floor((maxy-miny)/cellsize)+1;
+    auto cellOf=[cellsize](double x,int ncells)
+    {
+      int ret=floor(x/cellsize);
+      return min(max(ret,0),ncells-1);
+    };
+    for (i=0;i<pieces.size();i++)
+      if (std::isfinite(circles[i].radius) && circles[i].center.isfinite())
+      {
+	xlo=cellOf(circles[i].center.getx()-circles[i].radius-minx,xcells);
+	xhi=cellOf(circles[i].center.getx()+circles[i].radius-minx,xcells);
+	ylo=cellOf(circles[i].center.gety()-circles[i].radius-miny,ycells);
+	yhi=cellOf(circles[i].center.gety()+circles[i].radius-miny,ycells);
+	for (j=ylo;j<=yhi;j++)
+	  for (k=xlo;k<=xhi;k++)
+	    cellPieces.push_back(make_pair((long long)j*xcells+k,i));
+      }
+    sort(cellPieces.begin(),cellPieces.end());
+    for (i=0;i<cellPieces.size();i=j)
+    {
+      for (j=i;j<cellPieces.size() && cellPieces[j].first==cellPieces[i].first;j++);
+      for (k=i;k<j;k++)
+	for (m=k+1;m<j;m++)
+	{
+	  bcir &a=circles[cellPieces[k].second],&b=circles[cellPieces[m].second];
+	  if (dist(a.center,b.center)>a.radius+b.radius)
+	    continue;
+	  xlo=cellOf(fmax(a.center.getx()-a.radius,b.center.getx()-b.radius)-minx,xcells);
+	  ylo=cellOf(fmax(a.center.gety()-a.radius,b.center.gety()-b.radius)-miny,ycells);
+	  if ((long long)ylo*xcells+xlo==cellPieces[i].first)
+	  {
+	    pair1[0]=cellPieces[k].second;
+	    pair1[1]=cellPieces[m].second;
+	    candidates.push_back(pair1);
+	  }
+	}
+    }
+  }
+  found.resize(candidates.size());
+  parallelRanges(candidates.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    size_t n;
+    int l;
+    vector<array<alosta,2> > inters;
+    PieceCrossing crossing;
+    for (n=begin;n<end;n++)
+    {
+      crossing.a=candidates[n][0];
+      crossing.b=candidates[n][1];
+      inters=intersections(pieces[crossing.a],pieces[crossing.b]);
+      for (l=0;l<inters.size();l++)
+      {
+	crossing.cept=inters[l];
+	found[n].push_back(crossing);
+      }
+    }
+  });
+  for (i=0;i<found.size();i++)
+    ret.insert(ret.end(),found[i].begin(),found[i].end());
+  sort(ret.begin(),ret.end(),[](const PieceCrossing &l,const PieceCrossing &r)
+  {
+    if (l.a!=r.a)
+      return l.a<r.a;
+    if (l.b!=r.b)
+      return l.b<r.b;
+    return l.cept[0].along<r.cept[0].along;
+  });
+  return ret;
+}
+
 double meanSquareDistance(segment *a,segment *b)
 /* All points on a should have a closest point on b, without going off the ends
  * of b. In other words, a should be part of the approximation to b.
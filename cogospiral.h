@@ -77,6 +77,15 @@ struct alosta
 std::vector<alosta> intersection1(segment *a,double a1,double a2,segment *b,double b1,double b2,bool extend=false);
 std::vector<alosta> intersection1(segment *a,double a1,segment *b,double b1,bool extend=false);
 std::vector<std::array<alosta,2> > intersections(segment *a,segment *b,bool extend=false);
+
+struct PieceCrossing
+// A crossing of pieces a and b, which are indices into the vector of pieces.
+{
+  int a,b;
+  std::array<alosta,2> cept;
+};
+
+std::vector<PieceCrossing> allIntersections(std::vector<segment *> pieces,int nthreads=1);
 double meanSquareDistance(segment *a,segment *b);
 std::array<double,4> weightedDistance(segment *a,segment *b);
 std::array<double,2> besidement(Circle a,Circle b);
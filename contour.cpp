@@ -34,9 +34,13 @@
  */
 #include <iostream>
 #include <cassert>
+#include <thread>
+#include <algorithm>
+#include <queue>
 #include "pointlist.h"
 #include "contour.h"
-#include "relprime.h"
+#include "gapvector.h"
+#include "cogospiral.h"
 #include "ldecimal.h"
 using namespace std;
 
@@ -175,48 +179,179 @@ float splitpoint(double leftclamp,double rightclamp,double tolerance)
   return sp;
 }
 
-vector<uintptr_t> contstarts(pointlist &pts,double elev)
+ContourEngine::ContourEngine(pointlist &p):pl(p)
+{
+  int i,j;
+  double lo,hi,e;
+  array<double,4> tlohi;
+  vector<double> tlow,thigh;
+  map<int,edge>::iterator ei;
+  map<int,triangle>::iterator ti;
+  for (ei=pl.edges.begin();ei!=pl.edges.end();++ei)
+  {
+    ei->second.num=edgeList.size();
+    edgeList.push_back(&ei->second);
+  }
+  marks.resize(3*edgeList.size(),0);
+  epoch=0;
+  for (ti=pl.triangles.begin();ti!=pl.triangles.end();++ti)
+  {
+    triangle &tri=ti->second;
+    triList.push_back(&tri);
+    triEdges.push_back(array<int,3>{tri.a->edg(&tri)->num,
+				    tri.b->edg(&tri)->num,
+				    tri.c->edg(&tri)->num});
+    /* lohi() is the triangle's elevation range, but the tracing decides
+     * what crosses by the ends of the subdivision pieces, so widen it to
+     * include them in case they differ in the last bit.
+     */
+    tlohi=tri.lohi();
+    lo=tlohi[0];
+    hi=tlohi[3];
+    for (j=0;j<tri.subdiv.size();j++)
+    {
+      e=tri.subdiv[j].getstart().elev();
+      lo=fmin(lo,e);
+      hi=fmax(hi,e);
+      e=tri.subdiv[j].getend().elev();
+      lo=fmin(lo,e);
+      hi=fmax(hi,e);
+    }
+    if (!(lo<=hi))
+    {
+      lo=-INFINITY;
+      hi=INFINITY;
+    }
+    tlow.push_back(lo);
+    thigh.push_back(hi);
+  }
+  for (i=0;i<triList.size();i++)
+    byLow.push_back(i);
+  sort(byLow.begin(),byLow.end(),[&tlow](int a,int b){return tlow[a]<tlow[b];});
+  for (i=0;i<byLow.size();i++)
+  {
+    low.push_back(tlow[byLow[i]]);
+    high.push_back(thigh[byLow[i]]);
+  }
+  maxHigh.resize(byLow.size());
+  setMaxHigh(0,byLow.size());
+  triLow=tlow;
+  triHigh=thigh;
+  sweepElev=NAN;
+  sweepNext=0;
+}
+
+double ContourEngine::setMaxHigh(int begin,int end)
+/* The interval tree is implicit: the root of the range [begin,end) is
+ * its middle element, and maxHigh is the highest high in the range.
+ */
+{
+  int mid=(begin+end)/2;
+  if (begin>=end)
+    return -INFINITY;
+  maxHigh[mid]=fmax(high[mid],fmax(setMaxHigh(begin,mid),setMaxHigh(mid+1,end)));
+  return maxHigh[mid];
+}
+
+void ContourEngine::crossing(int begin,int end,double elev,vector<int> &result)
+{
+  int mid=(begin+end)/2;
+  if (begin<end && maxHigh[mid]>=elev)
+  {
+    crossing(begin,mid,elev,result);
+    if (low[mid]<=elev)
+    {
+      if (high[mid]>=elev)
+	result.push_back(byLow[mid]);
+      crossing(mid+1,end,elev,result);
+    }
+  }
+}
+
+vector<int> ContourEngine::crossingTriangles(double elev)
+/* Returns the numbers, in order, of the triangles whose elevation range
+ * includes elev. Only these can have a contour at elev.
+ */
+{
+  int i,j,nold;
+  if (elev>=sweepElev)
+  {
+    for (i=j=0;i<active.size();i++)
+      if (triHigh[active[i]]>=elev)
+	active[j++]=active[i];
+    active.resize(j);
+    nold=j;
+    for (;sweepNext<byLow.size() && low[sweepNext]<=elev;sweepNext++)
+      if (high[sweepNext]>=elev)
+	active.push_back(byLow[sweepNext]);
+    sort(active.begin()+nold,active.end());
+    inplace_merge(active.begin(),active.begin()+nold,active.end());
+  }
+  else
+  {
+    active.clear();
+    crossing(0,byLow.size(),elev,active);
+    sort(active.begin(),active.end());
+    sweepNext=upper_bound(low.begin(),low.end(),elev)-low.begin();
+  }
+  sweepElev=elev;
+  return active;
+}
+
+int ContourEngine::partId(uintptr_t ep)
+{
+  return 3*((edge *)(ep&-4))->num+(ep&3);
+}
+
+void ContourEngine::mark(uintptr_t ep)
+{
+  marks[partId(ep)]=epoch;
+}
+
+bool ContourEngine::ismarked(uintptr_t ep)
+{
+  return marks[partId(ep)]==epoch;
+}
+
+vector<uintptr_t> ContourEngine::contstarts(vector<int> &tris,double elev)
+/* Returns the edge parts at which to start tracing contours, exterior
+ * edges first, then interior edges, each in order of edge number.
+ */
 {
   vector<uintptr_t> ret;
+  vector<int> edges;
   uintptr_t ep;
   int sd,io;
+  edge *edg;
   triangle *tri;
   int i,j;
-  //cout<<"Exterior edges:";
+  for (i=0;i<tris.size();i++)
+    for (j=0;j<3;j++)
+      edges.push_back(triEdges[tris[i]][j]);
+  sort(edges.begin(),edges.end());
+  edges.erase(unique(edges.begin(),edges.end()),edges.end());
   for (io=0;io<2;io++)
-    for (i=0;i<pts.edges.size();i++)
-      if (io==pts.edges[i].isinterior())
+    for (i=0;i<edges.size();i++)
+    {
+      edg=edgeList[edges[i]];
+      if (io==edg->isinterior())
       {
-	tri=pts.edges[i].tria;
+	tri=edg->tria;
 	if (!tri)
-	  tri=pts.edges[i].trib;
+	  tri=edg->trib;
 	assert(tri);
-	//cout<<' '<<i;
 	for (j=0;j<3;j++)
 	{
-	  ep=j+(uintptr_t)&pts.edges[i];
+	  ep=j+(uintptr_t)edg;
 	  sd=tri->subdir(ep);
 	  if (tri->crosses(sd,elev) && (io || tri->upleft(sd)))
-	  {
-	    //cout<<(char)(j+'a');
 	    ret.push_back(ep);
-	  }
 	}
       }
-  //cout<<endl;
+    }
   return ret;
 }
 
-void mark(uintptr_t ep)
-{
-  ((edge *)(ep&-4))->mark(ep&3);
-}
-
-bool ismarked(uintptr_t ep)
-{
-  return ((edge *)(ep&-4))->ismarked(ep&3);
-}
-
 polyline intrace(triangle *tri,double elev)
 /* Returns the contour that is inside the triangle, if any. The contour is an elliptic curve.
  * If a contour is wholly inside a triangle, there is at most one contour partly in it.
@@ -253,110 +388,111 @@ polyline intrace(triangle *tri,double elev)
   return ret;
 }
 
-polyline trace(uintptr_t edgep,double elev)
+ContourFragment ContourEngine::fragment(triangle *tri,uintptr_t entry,double elev)
+/* Follows the contour across tri from the edge part where it enters to the
+ * edge part where it leaves. The exit is 0 if tracing stops inside.
+ */
 {
-  polyline ret(elev);
+  ContourFragment ret;
   int subedge,subnext,i;
-  uintptr_t prevedgep;
-  bool wasmarked;
-  xy lastcept,thiscept,firstcept;
+  xy thiscept;
+  ret.tri=tri;
+  ret.entry=entry;
+  subedge=tri->subdir(entry);
+  ret.entryCept=tri->contourcept(subedge,elev);
+  i=0;
+  do
+  {
+    subnext=tri->proceed(subedge,elev);
+    if (subnext>=0)
+    {
+      if (subnext==subedge)
+	cerr<<"proceed failed! "<<ret.inner.size()<<endl;
+      subedge=subnext;
+      thiscept=tri->contourcept(subedge,elev);
+      if (thiscept.isfinite())
+	ret.inner.push_back(thiscept);
+      else
+	cerr<<"NaN contourcept"<<endl;
+    }
+  } while (subnext>=0 && ++i<256);
+  ret.exit=tri->edgepart(subedge);
+  if (ret.exit==entry)
+    cout<<"Edge didn't change"<<endl;
+  if (ret.exit==0)
+    cout<<"Tracing stopped in middle of a triangle "<<ret.inner.size()<<endl;
+  else
+    ret.exitCept=tri->contourcept(tri->subdir(ret.exit),elev);
+  return ret;
+}
+
+const ContourFragment *ContourEngine::fragmentAt(triangle *tri,uintptr_t entry,double elev)
+/* Returns the fragment found by the sweep in roughcontours, if there is one
+ * entering tri at entry, else traces it now.
+ */
+{
+  unordered_map<uintptr_t,const ContourFragment *>::iterator i;
+  i=levelFragments.find(entry);
+  if (i!=levelFragments.end() && i->second->tri==tri)
+    return i->second;
+  scratch=fragment(tri,entry,elev);
+  return &scratch;
+}
+
+polyline ContourEngine::trace(uintptr_t edgep,double elev)
+{
+  polyline ret(elev);
+  int i;
+  bool wasmarked=false;
+  xy lastcept,firstcept;
   triangle *tri,*ntri;
+  const ContourFragment *frag;
   tri=((edge *)(edgep&-4))->tria;
   ntri=((edge *)(edgep&-4))->trib;
   if (tri==nullptr || !tri->upleft(tri->subdir(edgep)))
     tri=ntri;
   mark(edgep);
-  firstcept=lastcept=tri->contourcept(tri->subdir(edgep),elev);
+  frag=fragmentAt(tri,edgep,elev);
+  firstcept=lastcept=frag->entryCept;
   if (firstcept.isnan())
   {
     cerr<<"Tracing STARTS on Nan"<<endl;
     return ret;
   }
-  //if (fabs(elev-0.21)<0.0000001) // debugging in testcontour
-    //cout<<"Starting "<<ldecimal(firstcept.getx())<<' '<<ldecimal(firstcept.gety())<<endl;
   ret.insert(firstcept);
-  do
+  while (true)
   {
-    prevedgep=edgep;
-    subedge=tri->subdir(edgep);
-    i=0;
-    do
+    for (i=0;i<frag->inner.size();i++)
     {
-      subnext=tri->proceed(subedge,elev);
-      if (subnext>=0)
-      {
-	if (subnext==subedge)
-	  cerr<<"proceed failed! "<<ret.size()<<endl;
-	subedge=subnext;
-	thiscept=tri->contourcept(subedge,elev);
-	if (thiscept.isfinite())
-	{
-	  if (thiscept!=lastcept)
-          {
-            //if (fabs(elev-0.21)<0.0000001) // debugging in testcontour
-              //cout<<"Interior "<<ldecimal(thiscept.getx())<<' '<<ldecimal(thiscept.gety())<<endl;
-	    ret.insert(thiscept);
-          }
-	  //else
-	    //cerr<<"Repeated contourcept: "<<edgep<<' '<<ret.size()<<endl;
-          /* "Repeated contourcept" was originally put in to look for contour
-           * tracing bugs. After fixing these bugs, I ran bezitopo on home.asc
-           * and got this message. It turned out to be caused by tracing the
-           * contour with elevation 0 through point 1, whose elevation is 0.
-           * Tracing it through a triangle where point 1 is a local maximum
-           * produced two (or more) consecutive occurrences of (0,0), thus
-           * triggering the message. The contour is traced correctly; it's
-           * not a bug.
-           */
-	  lastcept=thiscept;
-	}
-	else
-	  cerr<<"NaN contourcept"<<endl;
-      }
-    } while (subnext>=0 && ++i<256);
-    //cout<<"after loop "<<subedge<<' '<<subnext<<endl;
-    edgep=tri->edgepart(subedge);
-    //cout<<"Next edgep "<<edgep<<endl;
-    if (edgep==prevedgep)
-    {
-      cout<<"Edge didn't change"<<endl;
-      subedge=tri->subdir(edgep);
-      subnext=tri->proceed(subedge,elev);
-      if (subnext>=0)
-      {
-	if (subnext==subedge)
-	  cout<<"proceed failed!"<<endl;
-	subedge=subnext;
-	//ret.insert(tri->contourcept(subedge,elev));
-      }
+      if (frag->inner[i]!=lastcept)
+	ret.insert(frag->inner[i]);
+      /* A repeated contourcept is not a bug. Tracing the contour with
+       * elevation 0 through point 1 of home.asc, whose elevation is 0,
+       * through a triangle where point 1 is a local maximum produces two
+       * (or more) consecutive occurrences of (0,0).
+       */
+      lastcept=frag->inner[i];
     }
+    edgep=frag->exit;
     if (edgep==0)
-    {
       ntri=nullptr;
-      cout<<"Tracing stopped in middle of a triangle "<<ret.size()<<endl;
-      subedge=tri->subdir(prevedgep);
-      subnext=tri->proceed(subedge,elev);
-    }
     else
     {
       wasmarked=ismarked(edgep);
       if (!wasmarked)
       {
-	thiscept=tri->contourcept(tri->subdir(edgep),elev);
-	if (thiscept!=lastcept && thiscept!=firstcept && thiscept.isfinite())
-        {
-          //if (fabs(elev-0.21)<0.0000001) // debugging in testcontour
-            //cout<<"Exterior "<<ldecimal(thiscept.getx())<<' '<<ldecimal(thiscept.gety())<<endl;
-	  ret.insert(thiscept);
-        }
-	lastcept=thiscept;
+	if (frag->exitCept!=lastcept && frag->exitCept!=firstcept && frag->exitCept.isfinite())
+	  ret.insert(frag->exitCept);
+	lastcept=frag->exitCept;
       }
       mark(edgep);
       ntri=((edge *)(edgep&-4))->othertri(tri);
     }
-    if (ntri)
-      tri=ntri;
-  } while (ntri && !wasmarked);
+    if (!ntri || wasmarked)
+      break;
+    tri=ntri;
+    frag=fragmentAt(tri,edgep,elev);
+  }
   if (!ntri)
     ret.open();
   return ret;
@@ -387,13 +523,15 @@ void checkedgediscrepancies(pointlist &pl)
   }
 }
 
-void rough1contour(pointlist &pl,double elev)
+void ContourEngine::rough1contour(double elev)
 {
   vector<uintptr_t> cstarts;
+  vector<int> tris;
   polyline ctour;
   int j;
-  cstarts=contstarts(pl,elev);
-  pl.clearmarks();
+  nextEpoch();
+  tris=crossingTriangles(elev);
+  cstarts=contstarts(tris,elev);
   for (j=0;j<cstarts.size();j++)
     if (!ismarked(cstarts[j]))
     {
@@ -401,9 +539,9 @@ void rough1contour(pointlist &pl,double elev)
       ctour.dedup();
       pl.contours.push_back(ctour);
     }
-  for (j=0;j<pl.triangles.size();j++)
+  for (j=0;j<tris.size();j++)
   {
-    ctour=intrace(&pl.triangles[j],elev);
+    ctour=intrace(triList[tris[j]],elev);
     if (ctour.size())
     {
       ctour.setlengths();
@@ -412,34 +550,189 @@ void rough1contour(pointlist &pl,double elev)
   }
 }
 
-void roughcontours(pointlist &pl,double conterval)
+void ContourEngine::nextEpoch()
+{
+  if (++epoch==0)
+  {
+    fill(marks.begin(),marks.end(),0);
+    epoch=1;
+  }
+}
+
+void ContourEngine::roughcontours(double conterval,int nthreads)
+{
+  array<double,2> tinlohi;
+  int lo,hi,lev,i,j;
+  double elev;
+  uintptr_t ep;
+  vector<vector<ContourFragment> > triFragments(triList.size());
+  vector<vector<polyline> > triInside(triList.size());
+  vector<vector<const ContourFragment *> > byLevel;
+  vector<vector<polyline *> > insideByLevel;
+  vector<pair<int,uintptr_t> > starts;
+  polyline ctour;
+  pl.contours.clear();
+  tinlohi=pl.lohi();
+  lo=floor(tinlohi[0]/conterval);
+  hi=ceil(tinlohi[1]/conterval);
+  if (hi<lo)
+    return;
+  parallelRanges(triList.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    size_t t;
+    int lev,levlo,levhi,j,k,sd;
+    double elev;
+    uintptr_t ep;
+    triangle *tri;
+    ContourFragment frag;
+    polyline ctour;
+    for (t=begin;t<end;t++)
+    {
+      tri=triList[t];
+      levlo=max((double)lo,floor(triLow[t]/conterval));
+      levhi=min((double)hi,ceil(triHigh[t]/conterval));
+      for (lev=levlo;lev<=levhi;lev++)
+      {
+	elev=lev*conterval;
+	if (elev<triLow[t] || elev>triHigh[t])
+	  continue;
+	for (j=0;j<3;j++)
+	  for (k=0;k<3;k++)
+	  {
+	    ep=k+(uintptr_t)edgeList[triEdges[t][j]];
+	    sd=tri->subdir(ep);
+	    if (tri->crosses(sd,elev) && tri->upleft(sd))
+	    {
+	      frag=fragment(tri,ep,elev);
+	      frag.level=lev;
+	      triFragments[t].push_back(frag);
+	    }
+	  }
+	ctour=intrace(tri,elev);
+	if (ctour.size())
+	{
+	  ctour.setlengths();
+	  triInside[t].push_back(ctour);
+	}
+      }
+    }
+  });
+  byLevel.resize(hi-lo+1);
+  insideByLevel.resize(hi-lo+1);
+  for (i=0;i<triList.size();i++)
+  {
+    for (j=0;j<triFragments[i].size();j++)
+      byLevel[triFragments[i][j].level-lo].push_back(&triFragments[i][j]);
+    for (j=0;j<triInside[i].size();j++)
+      insideByLevel[rint(triInside[i][j].getElevation()/conterval)-lo].push_back(&triInside[i][j]);
+  }
+  for (lev=lo;lev<=hi;lev++)
+  {
+    elev=lev*conterval;
+    nextEpoch();
+    levelFragments.clear();
+    starts.clear();
+    for (j=0;j<byLevel[lev-lo].size();j++)
+    {
+      ep=byLevel[lev-lo][j]->entry;
+      levelFragments[ep]=byLevel[lev-lo][j];
+      // Exterior edges first, as in contstarts
+      starts.push_back(make_pair(((edge *)(ep&-4))->isinterior()*3*edgeList.size()+partId(ep),ep));
+    }
+    sort(starts.begin(),starts.end());
+    for (j=0;j<starts.size();j++)
+      if (!ismarked(starts[j].second))
+      {
+	ctour=trace(starts[j].second,elev);
+	ctour.dedup();
+	pl.contours.push_back(ctour);
+      }
+    for (j=0;j<insideByLevel[lev-lo].size();j++)
+      pl.contours.push_back(*insideByLevel[lev-lo][j]);
+    byLevel[lev-lo].clear();
+    byLevel[lev-lo].shrink_to_fit();
+  }
+  levelFragments.clear();
+}
+
+void rough1contour(pointlist &pl,double elev)
+{
+  ContourEngine engine(pl);
+  engine.rough1contour(elev);
+}
+
+void roughcontours(pointlist &pl,double conterval,int nthreads)
 /* Draws contours consisting of line segments.
  * The perimeter must be present in the triangles.
  * Do not attempt to draw contours in the Mariana Trench with conterval
  * less than 5 µm or of Chomolungma with conterval less than 4 µm. It will fail.
  */
 {
-  array<double,2> tinlohi;
-  int i;
-  pl.contours.clear();
-  tinlohi=pl.lohi();
-  for (i=floor(tinlohi[0]/conterval);i<=ceil(tinlohi[1]/conterval);i++)
-    rough1contour(pl,i*conterval);
+  ContourEngine engine(pl);
+  engine.roughcontours(conterval,nthreads);
+}
+
+struct SmoothSplit
+{
+  double error; // estimated elevation error, used as priority
+  int seg;
+  float sp;
+  spiralarc sarc;
+  bool operator<(const SmoothSplit &b) const
+  {
+    return error<b.error;
+  }
+};
+
+struct SmoothSeg
+/* What smooth1contour keeps for each segment of the contour. It is in a
+ * gapvector, like the contour's own arrays, so that inserting is cheap
+ * when a round's splits are made from the end toward the start.
+ */
+{
+  triangle *hint; // the triangle the midpoint was last found in
+  bool taken; // being split in this round
+};
+
+double elevationNear(pointlist &pl,triangle *hint,xy pnt)
+// Like pl.elevation, but starts looking for the triangle at hint.
+{
+  if (hint)
+    hint=hint->findt(pnt);
+  else
+    hint=pl.qinx.findt(pnt);
+  return hint?hint->elevation(pnt):NAN;
 }
 
-void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript &ps,
+int smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript &ps,
                     double we,double ea,double so,double no)
+/* Splits segments of the contour until each is within tolerance. Segments
+ * needing a split go into a priority queue by estimated error. Each round
+ * splits the worst segments, skipping any next to one already being split
+ * in that round, since splitting changes the spiralarcs next to it. After a
+ * split only the segments around the new point are checked again; the list
+ * of them is made from the splits, not by scanning the contour. Each
+ * segment remembers the triangle its midpoint is in, to start looking there
+ * next time.
+ *
+ * Returns the number of segment checks, which is a few times the number
+ * of points added.
+ */
 {
-  static int n=0;
-  int j,k,sz,origsz,whichParts;
-  double sp,wide,thisElev;
-  xy spt;
+  int j,k,n,sz,origsz,whichParts,nchecked=0;
+  double sp,wide,thisElev,lerr,rerr;
+  xy spt,mid;
   spiralarc sarc;
-  bool nanseg,allin;
+  bool nanseg,allin,closed;
   bool flatTriangles=true;
   xyz lpt,rpt,newpt;
   segment splitseg,part0,part1,part2,parta;
   vector<double> vex;
+  vector<int> dirty,inserted;
+  gapvector<SmoothSeg> segs;
+  priority_queue<SmoothSplit> queue;
+  vector<SmoothSplit> splits;
+  SmoothSplit split;
   triangle *midptri;
   thisElev=pl.contours[i].getElevation();
   sarc=pl.contours[i].getspiralarc(0);
@@ -460,123 +753,337 @@ void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript
     if (k && spiral)
       pl.contours[i].smooth();
     origsz=sz=pl.contours[i].size();
-    for (j=0;j<=sz;j++)
+    closed=!pl.contours[i].isopen();
+    segs.clear();
+    segs.resize(sz);
+    dirty.clear();
+    for (n=0;n<sz;n++)
+      dirty.push_back(n);
+    while (dirty.size() && sz<3*origsz)
     {
-      n=(n+relprime(sz))%sz;
       wide=((sz>2*(origsz+27))?(sz/(origsz+27.0)-1):1.)/(k?(flatTriangles?3:10):2);
-      sarc=pl.contours[i].getspiralarc(n);
-      nanseg=!sarc.valid();
-      allin=true;
-      if (nanseg)
-        sarc.setdelta(0,0);
-      lpt=sarc.station(sarc.length()*CCHALONG);
-      rpt=sarc.station(sarc.length()*(1-CCHALONG));
-      if (lpt.isfinite() && rpt.isfinite())
+      for (j=0;j<dirty.size();j++)
       {
-        midptri=pl.qinx.findt((sarc.getstart()+sarc.getend())/2);
-        if (midptri)
-          if (allin=(midptri->in(sarc.getstart()) && midptri->in(sarc.getend()) &&
-            !(midptri->in(lpt) && midptri->in(rpt))))
-            sp=splitpoint(lpt.elev()-pl.elevation(lpt),rpt.elev()-pl.elevation(rpt),0);
-          else
-            sp=splitpoint(lpt.elev()-midptri->elevation(lpt),rpt.elev()-midptri->elevation(rpt),conterval*wide);
-        else
+        n=dirty[j];
+        nchecked++;
+        sarc=pl.contours[i].getspiralarc(n);
+        nanseg=!sarc.valid();
+        allin=true;
+        if (nanseg)
+          sarc.setdelta(0,0);
+        lpt=sarc.station(sarc.length()*CCHALONG);
+        rpt=sarc.station(sarc.length()*(1-CCHALONG));
+        if (lpt.isfinite() && rpt.isfinite())
         {
-          sp=0.5;
-          cerr<<"can't happen: midptri is null"<<endl;
-        }
-        if (sp==0 && (nanseg || !allin))
-          sp=0.5; // if the segment is NaN, it must be split, to produce non-NaN segments
-        if (sp && sarc.length()>conterval)
-        {
-          //cout<<"segment "<<n<<" of "<<sz<<" of contour "<<i<<" needs splitting at "<<sp<<endl;
-          spt=sarc.getstart()+sp*(sarc.getend()-sarc.getstart());
-          splitseg=pl.qinx.findt(spt,true)->dirclip(spt,dir(xy(sarc.getend()),xy(sarc.getstart()))+DEG90);
-          if (splitseg.getstart().elev()<splitseg.getend().elev()
-              || splitseg.startslope()>0 || splitseg.endslope()>0)
-          {
-            /* This is the foldcontour bug. If the contour is folded, a splitseg
-              * can intersect the contour twice. In that case, depending on the
-              * slopes and elevations, contourcept may pick the wrong intersection,
-              * and part of the contour is traced three or more times. Since the
-              * contour is always traced with the high side on the left, splitseg
-              * should always be pointing downhill. If it isn't, it must have
-              * an extremum. Split it there, and keep the downhill part.
-              */
-            vex=splitseg.vextrema(false);
-            if (vex.size()==1)
+          mid=(sarc.getstart()+sarc.getend())/2;
+          midptri=segs[n].hint?segs[n].hint->findt(mid):nullptr;
+          if (!midptri)
+            midptri=pl.qinx.findt(mid);
+          segs[n].hint=midptri;
+          lerr=rerr=NAN;
+          if (midptri)
+            if (allin=(midptri->in(sarc.getstart()) && midptri->in(sarc.getend()) &&
+              !(midptri->in(lpt) && midptri->in(rpt))))
             {
-              //cout<<"splitseg backward"<<endl;
-              splitseg.split(vex[0],part0,part1);
-              if (part1.getstart().elev()>part1.getend().elev())
-                splitseg=part1;
-              else
-                splitseg=part0;
+              lerr=lpt.elev()-elevationNear(pl,midptri,lpt);
+              rerr=rpt.elev()-elevationNear(pl,midptri,rpt);
+              sp=splitpoint(lerr,rerr,0);
             }
-            if (vex.size()==2)
+            else
             {
-              //cout<<"splitseg three parts - contour elevation "<<pl.contours[i].getElevation();
-              //cout<<'\n'<<splitseg.getstart().elev()<<' '<<splitseg.getend().elev()<<endl;
-              splitseg.split(vex[1],parta,part2);
-              parta.split(vex[0],part0,part1);
-              whichParts=0;
-              if (part0.getstart().elev()>thisElev && part0.getend().elev()<thisElev)
-                whichParts+=1;
-              if (part1.getstart().elev()>thisElev && part1.getend().elev()<thisElev)
-                whichParts+=2;
-              if (part2.getstart().elev()>thisElev && part2.getend().elev()<thisElev)
-                whichParts+=4;
-              switch (whichParts)
-              {
-                case 0:
-                  cerr<<"splitseg doesn't cross contour elevation downward"<<endl;
-                  break;
-                case 1:
-                  splitseg=part0;
-                  break;
-                case 2:
-                  splitseg=part1;
-                  break;
-                case 4:
-                  splitseg=part2;
-                  break;
-                case 5:
-                  cerr<<"splitseg crosses contour elevation twice downward"<<endl;
-                  break;
-                default:
-                  cerr<<"impossible value of whichParts"<<endl;
-              }
+              lerr=lpt.elev()-midptri->elevation(lpt);
+              rerr=rpt.elev()-midptri->elevation(rpt);
+              sp=splitpoint(lerr,rerr,conterval*wide);
             }
+          else
+          {
+            sp=0.5;
+            cerr<<"can't happen: midptri is null"<<endl;
           }
-          newpt=splitseg.station(splitseg.contourcept(pl.contours[i].getElevation()));
-          if (newpt.isfinite())
+          if (sp==0 && (nanseg || !allin))
+            sp=0.5; // if the segment is NaN, it must be split, to produce non-NaN segments
+          if (sp && sarc.length()>conterval)
+          {
+            split.error=fmax(fabs(lerr),fabs(rerr));
+            if (nanseg || std::isnan(split.error))
+              split.error=INFINITY;
+            split.seg=n;
+            split.sp=sp;
+            split.sarc=sarc;
+            queue.push(split);
+          }
+        }
+      }
+      dirty.clear();
+      splits.clear();
+      for (;queue.size();queue.pop())
+      {
+        n=queue.top().seg;
+        if (sz>1 && (segs[(n+1)%sz].taken || segs[(n+sz-1)%sz].taken))
+          dirty.push_back(n); // check again after its neighbor is split
+        else
+        {
+          segs[n].taken=true;
+          splits.push_back(queue.top());
+        }
+      }
+      sort(splits.begin(),splits.end(),[](const SmoothSplit &a,const SmoothSplit &b){return a.seg>b.seg;});
+      inserted.clear();
+      for (j=0;j<splits.size();j++)
+      {
+        n=splits[j].seg;
+        segs[n].taken=false;
+        sarc=splits[j].sarc;
+        //cout<<"segment "<<n<<" of "<<sz<<" of contour "<<i<<" needs splitting at "<<splits[j].sp<<endl;
+        spt=sarc.getstart()+splits[j].sp*(sarc.getend()-sarc.getstart());
+        splitseg=pl.qinx.findt(spt,true)->dirclip(spt,dir(xy(sarc.getend()),xy(sarc.getstart()))+DEG90);
+        if (splitseg.getstart().elev()<splitseg.getend().elev()
+            || splitseg.startslope()>0 || splitseg.endslope()>0)
+        {
+          /* This is the foldcontour bug. If the contour is folded, a splitseg
+            * can intersect the contour twice. In that case, depending on the
+            * slopes and elevations, contourcept may pick the wrong intersection,
+            * and part of the contour is traced three or more times. Since the
+            * contour is always traced with the high side on the left, splitseg
+            * should always be pointing downhill. If it isn't, it must have
+            * an extremum. Split it there, and keep the downhill part.
+            */
+          vex=splitseg.vextrema(false);
+          if (vex.size()==1)
           {
-            pl.contours[i].insert(newpt,n+1);
-            sz++;
-            if (sz<3*origsz)
-              j=0;
+            //cout<<"splitseg backward"<<endl;
+            splitseg.split(vex[0],part0,part1);
+            if (part1.getstart().elev()>part1.getend().elev())
+              splitseg=part1;
+            else
+              splitseg=part0;
           }
-          if (ps.isOpen())
+          if (vex.size()==2)
           {
-            ps.startpage();
-            ps.setscale(we,so,ea,no,0);
-            ps.setcolor(0,0,0);
-            ps.comment("Elevation "+ldecimal(pl.contours[i].getElevation())+" Contour #"+to_string(i));
-            sarc=pl.contours[i].getspiralarc(0);
-            ps.comment("Starting point "+ldecimal(sarc.getstart().getx())
-                        +','+ldecimal(sarc.getstart().gety()));
-            ps.spline(pl.contours[i].approx3d(0.1));
-            ps.setcolor(0,0,1);
-            ps.spline(splitseg.approx3d(0.1));
-            ps.endpage();
+            //cout<<"splitseg three parts - contour elevation "<<pl.contours[i].getElevation();
+            //cout<<'\n'<<splitseg.getstart().elev()<<' '<<splitseg.getend().elev()<<endl;
+            splitseg.split(vex[1],parta,part2);
+            parta.split(vex[0],part0,part1);
+            whichParts=0;
+            if (part0.getstart().elev()>thisElev && part0.getend().elev()<thisElev)
+              whichParts+=1;
+            if (part1.getstart().elev()>thisElev && part1.getend().elev()<thisElev)
+              whichParts+=2;
+            if (part2.getstart().elev()>thisElev && part2.getend().elev()<thisElev)
+              whichParts+=4;
+            switch (whichParts)
+            {
+              case 0:
+                cerr<<"splitseg doesn't cross contour elevation downward"<<endl;
+                break;
+              case 1:
+                splitseg=part0;
+                break;
+              case 2:
+                splitseg=part1;
+                break;
+              case 4:
+                splitseg=part2;
+                break;
+              case 5:
+                cerr<<"splitseg crosses contour elevation twice downward"<<endl;
+                break;
+              default:
+                cerr<<"impossible value of whichParts"<<endl;
+            }
           }
         }
+        newpt=splitseg.station(splitseg.contourcept(pl.contours[i].getElevation()));
+        if (newpt.isfinite())
+        {
+          pl.contours[i].insert(newpt,n+1);
+          segs.insert(n+1,segs[n]);
+          inserted.push_back(n);
+        }
+        if (ps.isOpen())
+        {
+          ps.startpage();
+          ps.setscale(we,so,ea,no,0);
+          ps.setcolor(0,0,0);
+          ps.comment("Elevation "+ldecimal(pl.contours[i].getElevation())+" Contour #"+to_string(i));
+          sarc=pl.contours[i].getspiralarc(0);
+          ps.comment("Starting point "+ldecimal(sarc.getstart().getx())
+                      +','+ldecimal(sarc.getstart().gety()));
+          ps.spline(pl.contours[i].approx3d(0.1));
+          ps.setcolor(0,0,1);
+          ps.spline(splitseg.approx3d(0.1));
+          ps.endpage();
+        }
       }
+      /* The segments waiting and those around each new point are to be
+       * checked next round. Their numbers are before this round's
+       * insertions; each moves up by the number of splits before it.
+       */
+      reverse(inserted.begin(),inserted.end());
+      for (j=0;j<inserted.size();j++)
+      {
+        n=inserted[j];
+        dirty.push_back(n);
+        if (n>0 || closed)
+          dirty.push_back((n+sz-1)%sz);
+        if (n+1<sz || closed)
+          dirty.push_back((n+1)%sz);
+      }
+      for (j=0;j<dirty.size();j++)
+        dirty[j]+=lower_bound(inserted.begin(),inserted.end(),dirty[j])-inserted.begin();
+      for (j=0;j<inserted.size();j++)
+        dirty.push_back(inserted[j]+j+1); // the new segment
+      sz+=inserted.size();
+      sort(dirty.begin(),dirty.end());
+      dirty.erase(unique(dirty.begin(),dirty.end()),dirty.end());
     }
   }
   pl.contours[i].setlengths();
+  return nchecked;
+}
+
+
+int contourBearing(polyspiral &contour,double along)
+// Bearing of the contour at along, which may be beyond the end if closed.
+{
+  int seg;
+  if (along>contour.length())
+    along-=contour.length();
+  seg=contour.stationSegment(along);
+  if (seg>=contour.size())
+    seg=contour.size()-1;
+  return contour.getspiralarc(seg).bearing(along-contour.getCumLength(seg));
+}
+
+polyspiral contourPiece(polyspiral &contour,double start,double end)
+/* Returns the part of contour from start to end, keeping the bearings
+ * at the points, so that each spiralarc is part of the original one.
+ */
+{
+  int i,nvert=contour.size()+contour.isopen();
+  double len=contour.length(),along;
+  polyspiral ret(contour.getElevation());
+  vector<double> alongs;
+  vector<int> bears;
+  alongs.push_back(start);
+  for (i=0;i<2*nvert;i++)
+  {
+    along=contour.getCumLength(i%nvert)+(i>=nvert)*len;
+    if (along>start && along<end && (i<nvert || !contour.isopen()))
+      alongs.push_back(along);
+  }
+  alongs.push_back(end);
+  for (i=0;i<alongs.size();i++)
+  {
+    ret.insert(contour.station((alongs[i]>len)?alongs[i]-len:alongs[i]));
+    bears.push_back(contourBearing(contour,alongs[i]));
+    if (i)
+      bears[i]=bears[i-1]+foldangle(bears[i]-bears[i-1]);
+  }
+  ret.open();
+  ret.smooth();
+  for (i=0;i<alongs.size();i++)
+    ret.setbear(i,bears[i]);
+  for (i=0;i<ret.size();i++)
+    ret.setspiral(i);
+  ret.setlengths();
+  return ret;
+}
+
+vector<polyspiral> clip1contour(polyspiral &contour,polyline &boundary)
+/* Returns the parts of contour inside boundary. The crossings are found
+ * by intersecting each piece of the contour with the pieces of the boundary
+ * whose circles overlap its circle. The parts between crossings are kept
+ * if their middle is inside. boundary.updateBoundTree must have been called
+ * if this is run in several threads at once.
+ */
+{
+  vector<polyspiral> ret;
+  vector<double> cuts;
+  vector<int> near;
+  vector<array<alosta,2> > inters;
+  spiralarc sarc,bpiece,before,after;
+  bcir circ;
+  int i,j,k;
+  double len=contour.length(),start,end,alo;
+  for (i=0;i<contour.size();i++)
+  {
+    sarc=contour.getspiralarc(i);
+    circ=sarc.boundCircle();
+    near=boundary.overlappingPieces(circ);
+    for (j=0;j<near.size();j++)
+    {
+      /* A boundary piece is usually much longer than a contour piece.
+       * Intersect only the part of it near the contour piece.
+       */
+      bpiece=boundary.getPiece(near[j]);
+      alo=bpiece.closest(circ.center);
+      if (std::isfinite(alo) && dist(bpiece.station(alo),circ.center)>circ.radius)
+	continue;
+      end=alo+2*circ.radius;
+      start=alo-2*circ.radius;
+      if (!std::isfinite(alo))
+	start=end=NAN; // closest failed; intersect the whole piece
+      if (end<bpiece.length())
+      {
+	bpiece.split(end,before,after);
+	bpiece=before;
+      }
+      if (start>0)
+      {
+	bpiece.split(start,before,after);
+	bpiece=after;
+      }
+      inters=intersections(&sarc,&bpiece);
+      for (k=0;k<inters.size();k++)
+	cuts.push_back(contour.getCumLength(i)+inters[k][0].along);
+    }
+  }
+  sort(cuts.begin(),cuts.end());
+  if (cuts.size()==0)
+  {
+    if (contour.size() && fabs(boundary.in(contour.station(len/2)))>0.5)
+      ret.push_back(contour);
+  }
+  else
+  {
+    if (contour.isopen())
+    {
+      cuts.insert(cuts.begin(),0);
+      cuts.push_back(len);
+    }
+    else
+      cuts.push_back(cuts[0]+len);
+    for (i=0;i<cuts.size()-1;i++)
+    {
+      start=cuts[i];
+      end=cuts[i+1];
+      if (end>start && fabs(boundary.in(contour.station(fmod((start+end)/2,len))))>0.5)
+	ret.push_back(contourPiece(contour,start,end));
+    }
+  }
+  return ret;
 }
 
+vector<polyspiral> clipcontours(pointlist &pl,polyline &boundary,int nthreads)
+/* Returns the parts of all the contours of pl inside boundary, which may be
+ * a polyline, polyarc, or polyspiral, clipping the contours in parallel.
+ */
+{
+  vector<vector<polyspiral> > clipped(pl.contours.size());
+  vector<polyspiral> ret;
+  int i;
+  boundary.updateBoundTree();
+  parallelRanges(pl.contours.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    size_t n;
+    for (n=begin;n<end;n++)
+      clipped[n]=clip1contour(pl.contours[n],boundary);
+  });
+  for (i=0;i<clipped.size();i++)
+    ret.insert(ret.end(),clipped[i].begin(),clipped[i].end());
+  return ret;
+}
 
 void smoothcontours(pointlist &pl,double conterval,bool spiral,bool log)
 {
@@ -596,6 +1103,7 @@ void smoothcontours(pointlist &pl,double conterval,bool spiral,bool log)
   {
     ps.open("smoothcontours.ps");
     ps.setpaper(papersizes["A4 portrait"],0);
+    ps.setThreads(thread::hardware_concurrency());
     ps.prolog();
   }
   for (i=0;i<pl.contours.size();i++)
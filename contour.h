@@ -25,6 +25,8 @@
 #ifndef CONTOUR_H
 #define CONTOUR_H
 #include <vector>
+#include <array>
+#include <unordered_map>
 #include "polyline.h"
 #include "measure.h"
 #include "ps.h"
@@ -33,6 +35,8 @@
 #define M_SQRT_10 3.16227766016837933199889354
 
 class pointlist;
+class edge;
+class triangle;
 
 class ContourInterval
 {
@@ -72,15 +76,78 @@ private:
   int fineRatio,coarseRatio;
 };
 
+struct ContourFragment
+/* The piece of a contour inside one triangle, from the edge part where it
+ * enters to the edge part where it leaves (0 if tracing stops inside).
+ */
+{
+  int level;
+  triangle *tri;
+  uintptr_t entry,exit;
+  xy entryCept,exitCept;
+  std::vector<xy> inner;
+};
+
+class ContourEngine
+/* Traces rough contours at many elevations on one TIN, which must not
+ * change while the engine exists. Parts of edges (an edge is split in up
+ * to three parts at its extrema) are numbered 3*edge+part, and are marked
+ * with the number of the current elevation, so that starting a new
+ * elevation takes no clearing pass. The edges are numbered in edge::num
+ * when the engine is made, so two engines on one TIN must not be made at
+ * the same time. The triangles are kept, sorted by lowest elevation, in an
+ * interval tree, so that each elevation looks only at the triangles whose
+ * elevation range includes it. When the elevations
+ * go upward, as in roughcontours, the crossing set is instead updated from
+ * the previous elevation's by sweeping: triangles whose lowest elevation has
+ * been passed are added, and those whose highest has been passed are dropped.
+ *
+ * roughcontours instead visits each triangle once, tracing the fragments
+ * of all contour levels in its range (in parallel), then for each level
+ * joins the fragments on their edge parts into contours.
+ */
+{
+public:
+  ContourEngine(pointlist &p);
+  void rough1contour(double elev);
+  void roughcontours(double conterval,int nthreads=1);
+  std::vector<int> crossingTriangles(double elev);
+private:
+  pointlist &pl;
+  std::vector<edge *> edgeList;
+  std::vector<triangle *> triList;
+  std::vector<std::array<int,3> > triEdges;
+  std::vector<unsigned> marks;
+  unsigned epoch;
+  std::vector<int> byLow; // triangle numbers
+  std::vector<double> low,high,maxHigh; // indexed like byLow
+  std::vector<double> triLow,triHigh; // indexed by triangle number
+  std::vector<int> active; // triangles crossing sweepElev, in order
+  double sweepElev;
+  int sweepNext; // index in byLow of the next triangle to add
+  double setMaxHigh(int begin,int end);
+  void crossing(int begin,int end,double elev,std::vector<int> &result);
+  int partId(uintptr_t ep);
+  void mark(uintptr_t ep);
+  bool ismarked(uintptr_t ep);
+  std::unordered_map<uintptr_t,const ContourFragment *> levelFragments;
+  ContourFragment scratch;
+  std::vector<uintptr_t> contstarts(std::vector<int> &tris,double elev);
+  ContourFragment fragment(triangle *tri,uintptr_t entry,double elev);
+  const ContourFragment *fragmentAt(triangle *tri,uintptr_t entry,double elev);
+  polyline trace(uintptr_t edgep,double elev);
+  void nextEpoch();
+};
+
 float splitpoint(double leftclamp,double rightclamp,double tolerance);
-std::vector<uintptr_t> contstarts(pointlist &pts,double elev);
-polyline trace(uintptr_t edgep,double elev);
 polyline intrace(triangle *tri,double elev);
-bool ismarked(uintptr_t ep);
 void rough1contour(pointlist &pl,double elev);
-void roughcontours(pointlist &pl,double conterval);
-void smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript &ps,
+void roughcontours(pointlist &pl,double conterval,int nthreads=1);
+int smooth1contour(pointlist &pl,double conterval,int i,bool spiral,PostScript &ps,
                     double we,double ea,double so,double no);
 void smoothcontours(pointlist &pl,double conterval,bool spiral=true,bool log=false);
+polyspiral contourPiece(polyspiral &contour,double start,double end);
+std::vector<polyspiral> clip1contour(polyspiral &contour,polyline &boundary);
+std::vector<polyspiral> clipcontours(pointlist &pl,polyline &boundary,int nthreads=1);
 void checkedgediscrepancies(pointlist &pl);
 #endif
@@ -21,6 +21,7 @@
  * and Lesser General Public License along with Bezitopo. If not, see
  * <http://www.gnu.org/licenses/>.
  */
+#include <cmath>
 #include "crosssection.h"
 using namespace std;
 
@@ -34,3 +35,181 @@ double BaseCrossSection::getVerticalOffset()
 {
   return verticalOffset;
 }
+
+TinCrossSection::TinCrossSection()
+{
+  verticalOffset=0;
+  direction=0;
+  midTriangle=nullptr;
+}
+
+vector<segment> TinCrossSection::walk(triangle *t,bool backward,double halfwidth)
+/* Walks from triangle t, which contains midpoint, across the neighboring
+ * triangles until it has gone halfwidth or come to the edge of the TIN.
+ * If backward, it walks toward negative offsets, and the pieces are
+ * reversed so that they go from more negative to less negative offsets.
+ * The line leaves a triangle across the side whose signed area with the
+ * point on the line first goes negative.
+ */
+{
+  vector<segment> ret;
+  xy u=cossin(direction+(backward?DEG180:0)),p,q,pt;
+  double oin=0,oout,area0,area1,ocross,z[4],ctrl[2];
+  point *corners[3];
+  triangle *next;
+  int i,side,nsteps=0;
+  while (t && oin<halfwidth && nsteps++<1048576)
+  {
+    corners[0]=t->a;
+    corners[1]=t->b;
+    corners[2]=t->c;
+    oout=halfwidth;
+    side=-1;
+    for (i=0;i<3;i++)
+    {
+      p=*corners[(i+1)%3];
+      q=*corners[(i+2)%3];
+      area0=area3(p,q,midpoint);
+      area1=area3(p,q,midpoint+u)-area0;
+      if (area1<0)
+      {
+	ocross=-area0/area1;
+	if (ocross<oout)
+	{
+	  oout=ocross;
+	  side=i;
+	}
+      }
+    }
+    if (oout<oin)
+      oout=oin;
+    if (oout>oin)
+    {
+      for (i=0;i<4;i++)
+      {
+	pt=midpoint+u*(oin+(oout-oin)*i/3);
+	z[i]=t->elevation(pt);
+      }
+      ctrl[0]=(-5*z[0]+18*z[1]-9*z[2]+2*z[3])/6;
+      ctrl[1]=(2*z[0]-9*z[1]+18*z[2]-5*z[3])/6;
+      if (backward)
+	ret.push_back(segment(xyz(-oout,0,z[3]),ctrl[1],ctrl[0],xyz(-oin,0,z[0])));
+      else
+	ret.push_back(segment(xyz(oin,0,z[0]),ctrl[0],ctrl[1],xyz(oout,0,z[3])));
+    }
+    oin=oout;
+    switch (side)
+    {
+      case 0:
+	next=t->aneigh;
+	break;
+      case 1:
+	next=t->bneigh;
+	break;
+      case 2:
+	next=t->cneigh;
+	break;
+      default:
+	next=nullptr;
+    }
+    t=next;
+  }
+  return ret;
+}
+
+TinCrossSection::TinCrossSection(pointlist &pl,xy mid,int dir,double halfwidth,triangle *hint)
+{
+  vector<segment> left,right;
+  verticalOffset=0;
+  direction=dir;
+  midpoint=mid;
+  if (hint)
+    midTriangle=hint->findt(mid);
+  else
+    midTriangle=pl.findt(mid);
+  if (midTriangle)
+  {
+    left=walk(midTriangle,true,halfwidth);
+    right=walk(midTriangle,false,halfwidth);
+  }
+  profile.insert(profile.end(),left.rbegin(),left.rend());
+  profile.insert(profile.end(),right.begin(),right.end());
+}
+
+double TinCrossSection::leftEnd()
+{
+  return profile.size()?profile[0].getstart().getx():NAN;
+}
+
+double TinCrossSection::rightEnd()
+{
+  return profile.size()?profile.back().getend().getx():NAN;
+}
+
+xy TinCrossSection::station(double o)
+{
+  return midpoint+cossin(direction)*o;
+}
+
+double TinCrossSection::elevation(double o)
+{
+  int lo=0,hi=profile.size(),mid;
+  double ret=NAN;
+  if (profile.size() && o>=leftEnd() && o<=rightEnd())
+  {
+    while (hi-lo>1)
+    {
+      mid=(lo+hi)/2;
+      if (profile[mid].getstart().getx()>o)
+	hi=mid;
+      else
+	lo=mid;
+    }
+    ret=profile[lo].elev(o-profile[lo].getstart().getx())+verticalOffset;
+  }
+  return ret;
+}
+
+double TinCrossSection::lowElevation(double o)
+// A TIN has no vertical faces, so the low and high elevations are the same.
+{
+  return elevation(o);
+}
+
+double TinCrossSection::highElevation(double o)
+{
+  return elevation(o);
+}
+
+vector<TinCrossSection> tinCrossSections(pointlist &pl,alignment &al,double from,double to,double step,double halfwidth,int nthreads)
+/* Takes cross sections of the TIN perpendicular to the alignment, step apart,
+ * with offsets positive to the right. Each thread walks its range of stations
+ * with an alignment cursor and starts looking for each station's triangle
+ * from the last one's. The cursor computes every ALIGN_RESYNC-th station
+ * exactly, counting from the first, and a thread starts at the one before
+ * its range, so the sections are the same for any number of threads.
+ */
+{
+  vector<TinCrossSection> ret;
+  size_t n=0;
+  if (step>0 && to>=from)
+    n=floor((to-from)/step+1e-9)+1;
+  ret.resize(n);
+  parallelRanges(n,nthreads,[&](size_t begin,size_t end)
+  {
+    AlignmentCursor cur(al);
+    triangle *hint=nullptr;
+    size_t i;
+    for (i=begin-begin%ALIGN_RESYNC;i<end;i++)
+    {
+      cur.seek(from+i*step,i%ALIGN_RESYNC==0);
+      if (i>=begin && cur.xyStation().isfinite())
+      {
+	ret[i]=TinCrossSection(pl,cur.xyStation(),cur.bearing()-DEG90,halfwidth,hint);
+	if (ret[i].midTriangle)
+	  hint=ret[i].midTriangle;
+      }
+    }
+  });
+  return ret;
+}
@@ -32,8 +32,13 @@
  * connect corresponding points of one cross section to the next.
  * elevation is relative to the alignment.
  */
+#ifndef CROSSSECTION_H
+#define CROSSSECTION_H
 #include <map>
+#include <vector>
 #include "xyz.h"
+#include "pointlist.h"
+#include "polyline.h"
 
 struct xsitem
 {
@@ -58,3 +63,29 @@ class DesignCrossSection: public BaseCrossSection
 {
   std::map<double,xsitem> data;
 };
+
+class TinCrossSection: public BaseCrossSection
+/* A cross section of a TIN along a line through midpoint in the direction
+ * direction. The profile has one cubic for each triangle the line crosses,
+ * from the most negative offset to the most positive. Each cubic runs from
+ * (offset,0,elevation) to (offset,0,elevation). The profile stops at the
+ * given half width or at the edge of the TIN, whichever is nearer.
+ */
+{
+public:
+  TinCrossSection();
+  TinCrossSection(pointlist &pl,xy mid,int dir,double halfwidth,triangle *hint=nullptr);
+  virtual double elevation(double o);
+  virtual double lowElevation(double o);
+  virtual double highElevation(double o);
+  double leftEnd();
+  double rightEnd();
+  xy station(double o);
+  std::vector<segment> profile;
+  triangle *midTriangle;
+private:
+  std::vector<segment> walk(triangle *t,bool backward,double halfwidth);
+};
+
+std::vector<TinCrossSection> tinCrossSections(pointlist &pl,alignment &al,double from,double to,double step,double halfwidth,int nthreads=1);
+#endif
@@ -23,12 +23,20 @@
  */
 
 #include <cstring>
+#include <cstdlib>
 #include "dxf.h"
 #include "binio.h"
 #include "textfile.h"
 #include "ldecimal.h"
 using namespace std;
 
+// Entity types recognized by DxfTriangles
+#define DXF_OTHER 0
+#define DXF_3DFACE 1
+#define DXF_POLYLINE 2
+#define DXF_VERTEX 3
+#define DXF_SEQEND 4
+
 TagRange tagTable[]=
 {
   {0,128}, // string
@@ -173,6 +181,63 @@ GroupCode& GroupCode::operator=(const GroupCode &b)
   return *this;
 }
 
+GroupCode::GroupCode(GroupCode &&b)
+/* Moving a group code steals its string instead of copying it. The string
+ * is usually short enough to fit in std::string's own buffer, but layer
+ * names and text can be long.
+ */
+{
+  tag=b.tag;
+  switch (tagFormat(tag))
+  {
+    case 1:
+      flag=b.flag;
+      break;
+    case 2:
+    case 4:
+    case 8:
+    case 132:
+      integer=b.integer;
+      break;
+    case 72:
+      real=b.real;
+      break;
+    case 128:
+    case 129:
+      new (&str) string(std::move(b.str));
+      break;
+  }
+}
+
+GroupCode& GroupCode::operator=(GroupCode &&b)
+{
+  if ((tagFormat(tag)&-2)==128 && (tagFormat(b.tag)&-2)!=128)
+    str.~string();
+  if ((tagFormat(tag)&-2)!=128 && (tagFormat(b.tag)&-2)==128)
+    new (&str) string();
+  tag=b.tag;
+  switch (tagFormat(tag))
+  {
+    case 1:
+      flag=b.flag;
+      break;
+    case 2:
+    case 4:
+    case 8:
+    case 132:
+      integer=b.integer;
+      break;
+    case 72:
+      real=b.real;
+      break;
+    case 128:
+    case 129:
+      str=std::move(b.str);
+      break;
+  }
+  return *this;
+}
+
 GroupCode::~GroupCode()
 {
   switch (tagFormat(tag))
@@ -277,7 +342,7 @@ GroupCode readDxfText(TextFile &file)
 	  ret.real=stod(datastr);
 	  break;
 	case 128:
-	  ret.str=datastr;
+	  ret.str=std::move(datastr);
 	  break;
 	case 129:
 	  ret.str=hexDecodeString(datastr);
@@ -334,7 +399,7 @@ GroupCode readDxfBinary(istream &file)
   return ret;
 }
 
-void writeDxfText(std::ostream &file,GroupCode code)
+void writeDxfText(std::ostream &file,const GroupCode &code)
 {
   string tagstr,datastr;
   tagstr=to_string(code.tag);
@@ -364,7 +429,7 @@ void writeDxfText(std::ostream &file,GroupCode code)
   file<<tagstr<<'\n'<<datastr<<'\n';
 }
 
-void writeDxfBinary(std::ostream &file,GroupCode code)
+void writeDxfBinary(std::ostream &file,const GroupCode &code)
 {
   writeleshort(file,code.tag);
   switch(tagFormat(code.tag))
@@ -418,15 +483,18 @@ void writeDxfMagic(ostream &file)
   file<<"AutoCAD Binary DXF\r\n\032"<<'\0';
 }
 
-vector<GroupCode> readDxfGroups(istream &file,bool mode)
-// mode is true for text.
+bool readDxfGroups(istream &file,DxfHandler &handler,bool mode)
+/* Reads group codes one at a time and passes them to handler.
+ * mode is true for text. Returns false if an unknown tag was read
+ * or the binary magic string is missing; groups before the bad one
+ * have already been passed to the handler.
+ */
 {
   GroupCode oneCode;
-  vector<GroupCode> ret;
-  bool cont=true;
+  bool cont=true,ret=true;
   TextFile tfile(file);
   if (!mode)
-    cont=readDxfMagic(file);
+    cont=ret=readDxfMagic(file);
   while (cont)
   {
     if (mode)
@@ -434,17 +502,31 @@ vector<GroupCode> readDxfGroups(istream &file,bool mode)
     else
       oneCode=readDxfBinary(file);
     if (tagFormat(oneCode.tag))
-      ret.push_back(oneCode);
+      handler.group(oneCode);
     else
     {
       cont=false;
       if (file.good() || oneCode.tag+1) // An unknown tag was read.
-	ret.clear();
+	ret=false;
     }
   }
   return ret;
 }
 
+void DxfGroupList::group(GroupCode &code)
+{
+  groups.push_back(std::move(code));
+}
+
+vector<GroupCode> readDxfGroups(istream &file,bool mode)
+// mode is true for text.
+{
+  DxfGroupList list;
+  if (!readDxfGroups(file,list,mode))
+    list.groups.clear();
+  return std::move(list.groups);
+}
+
 void writeDxfGroups(ostream &file,vector<GroupCode> &codes,bool mode)
 {
   int i;
@@ -471,44 +553,160 @@ vector<GroupCode> readDxfGroups(string filename)
   return ret;
 }
 
-vector<array<xyz,3> > extractTriangles(vector<GroupCode> dxfData)
-/* Scans dxfData looking for 3DFACE objects, extracting the first three
- * corners of each. The fourth corner is ignored. It should be the same as
- * one of the first three. If it isn't, the 3DFACE is a quadrilateral,
+DxfTriangles::DxfTriangles()
+{
+  entity=DXF_OTHER;
+  inPolyface=false;
+  flags=coordsSeen=0;
+}
+
+void DxfTriangles::face(const array<xyz,3> &tri)
+{
+  faces.push_back(tri);
+}
+
+void DxfTriangles::endEntity()
+/* Called when the next entity starts. A 3DFACE produces one triangle from
+ * its first three corners. The fourth corner is ignored. It should be the
+ * same as one of the first three. If it isn't, the 3DFACE is a quadrilateral,
  * which might should be turned into two triangles.
+ *
+ * A polyface mesh is a POLYLINE with flag 64, followed by VERTEXes with
+ * flags 192, which are the points, then VERTEXes with flag 128, which are
+ * the faces and give the 1-based indices of their corners in groups 71-74.
+ * An index is negative if the edge starting there is invisible.
+ */
+{
+  int i,n;
+  array<xyz,3> tri;
+  switch (entity)
+  {
+    case DXF_3DFACE:
+      if ((coordsSeen&0777)==0777)
+      {
+	for (i=0;i<3;i++)
+	  tri[i]=xyz(coords[i][0],coords[i][1],coords[i][2]);
+	face(tri);
+      }
+      break;
+    case DXF_POLYLINE:
+      inPolyface=(flags&64)!=0;
+      meshVertices.clear();
+      break;
+    case DXF_VERTEX:
+      if (inPolyface && (flags&192)==192)
+	meshVertices.push_back(xyz(coords[0][0],coords[0][1],coords[0][2]));
+      else if (inPolyface && (flags&192)==128)
+      {
+	for (i=0;i<4;i++)
+	  vertexIndex[i]=abs(vertexIndex[i]);
+	for (i=n=0;i<4;i++)
+	  if (vertexIndex[i]>0 && vertexIndex[i]<=meshVertices.size())
+	    n++;
+	  else
+	    break;
+	if (n>=3)
+	{
+	  for (i=0;i<3;i++)
+	    tri[i]=meshVertices[vertexIndex[i]-1];
+	  face(tri);
+	}
+	if (n==4)
+	{
+	  tri[1]=tri[2];
+	  tri[2]=meshVertices[vertexIndex[3]-1];
+	  face(tri);
+	}
+      }
+      break;
+    case DXF_SEQEND:
+      inPolyface=false;
+      meshVertices.clear();
+      meshVertices.shrink_to_fit();
+      break;
+  }
+}
+
+void DxfTriangles::group(GroupCode &code)
+{
+  int coord,ncorner;
+  if (code.tag==0)
+  {
+    endEntity();
+    if (code.str=="3DFACE")
+      entity=DXF_3DFACE;
+    else if (code.str=="POLYLINE")
+      entity=DXF_POLYLINE;
+    else if (code.str=="VERTEX")
+      entity=DXF_VERTEX;
+    else if (code.str=="SEQEND")
+      entity=DXF_SEQEND;
+    else
+      entity=DXF_OTHER;
+    flags=coordsSeen=0;
+    memset(coords,0,sizeof(coords));
+    memset(vertexIndex,0,sizeof(vertexIndex));
+  }
+  else if (entity!=DXF_OTHER)
+  {
+    if (code.tag>=10 && code.tag<40)
+    {
+      coord=code.tag/10-1;
+      ncorner=code.tag%10;
+      if (ncorner<4)
+      {
+	coords[ncorner][coord]=code.real;
+	coordsSeen|=1<<(ncorner*3+coord);
+      }
+    }
+    if (code.tag==70)
+      flags=code.integer;
+    if (code.tag>=71 && code.tag<=74)
+      vertexIndex[code.tag-71]=code.integer;
+  }
+}
+
+void DxfTriangles::finish()
+{
+  endEntity();
+  entity=DXF_OTHER;
+}
+
+vector<array<xyz,3> > extractTriangles(vector<GroupCode> dxfData)
+/* Scans dxfData looking for 3DFACE objects and polyface meshes.
  * 
  * This function ignores sections; if there's a 3DFACE in the BLOCKS section,
  * it will output it once, not every place the block is used.
  */
 {
-  int i,ncorner,coord;
-  array<xyz,3> face;
-  vector<array<xyz,3> > ret;
-  int ncoords=16;
+  int i;
+  DxfTriangles tri;
   for (i=0;i<dxfData.size();i++)
+    tri.group(dxfData[i]);
+  tri.finish();
+  return std::move(tri.faces);
+}
+
+vector<array<xyz,3> > readDxfTriangles(string filename)
+/* Like extractTriangles(readDxfGroups(filename)), but passes the groups
+ * straight from the file to the triangle extractor, so the memory used
+ * is proportional to the number of triangles, not the size of the file.
+ */
+{
+  int mode;
+  ifstream file;
+  DxfTriangles tri;
+  bool ok=false;
+  for (mode=0;mode<2 && !ok;mode++)
   {
-    if (dxfData[i].tag==0 && dxfData[i].str=="3DFACE")
-      ncoords=0;
-    if (ncoords<12 && dxfData[i].tag>=10 && dxfData[i].tag<40)
-    {
-      coord=dxfData[i].tag/10;
-      ncorner=dxfData[i].tag%10;
-      if (ncorner<3)
-	switch (coord)
-	{
-	  case 1:
-	    face[ncorner]=xyz(dxfData[i].real,face[ncorner].gety(),face[ncorner].getz());
-	    break;
-	  case 2:
-	    face[ncorner]=xyz(face[ncorner].getx(),dxfData[i].real,face[ncorner].getz());
-	    break;
-	  case 3:
-	    face[ncorner]=xyz(face[ncorner].getx(),face[ncorner].gety(),dxfData[i].real);
-	    break;
-	}
-      if (12==++ncoords)
-	ret.push_back(face);
-    }
+    tri=DxfTriangles();
+    file.open(filename,ios::binary);
+    ok=readDxfGroups(file,tri,mode);
+    file.close();
   }
-  return ret;
+  if (ok)
+    tri.finish();
+  else
+    tri.faces.clear();
+  return std::move(tri.faces);
 }
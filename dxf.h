@@ -54,8 +54,8 @@ public:
   GroupCode(int tag0);
   GroupCode(const GroupCode &b);
   GroupCode& operator=(const GroupCode &b);
-  GroupCode(GroupCode&&)=default;
-  GroupCode& operator=(GroupCode&&)=default;
+  GroupCode(GroupCode &&b);
+  GroupCode& operator=(GroupCode &&b);
   ~GroupCode();
   int tag; // short in binary file
   union
@@ -67,10 +67,53 @@ public:
   };
 };
 
+class DxfHandler
+/* Receives group codes one at a time as a DXF file is read, so that
+ * the whole file need not be held in memory. The handler may move the
+ * string out of the group code.
+ */
+{
+public:
+  virtual ~DxfHandler()
+  {
+  }
+  virtual void group(GroupCode &code)=0;
+};
+
+class DxfGroupList: public DxfHandler
+{
+public:
+  std::vector<GroupCode> groups;
+  virtual void group(GroupCode &code);
+};
+
+class DxfTriangles: public DxfHandler
+/* Picks 3DFACEs and polyface meshes out of a stream of group codes and
+ * passes each triangle to face(), which by default appends it to faces.
+ * Only the vertices of the polyface mesh currently being read are kept.
+ */
+{
+public:
+  DxfTriangles();
+  virtual void group(GroupCode &code);
+  virtual void face(const std::array<xyz,3> &tri);
+  void finish();
+  std::vector<std::array<xyz,3> > faces;
+private:
+  void endEntity();
+  int entity,flags,coordsSeen;
+  bool inPolyface;
+  double coords[4][3];
+  int vertexIndex[4];
+  std::vector<xyz> meshVertices;
+};
+
 GroupCode readDxfText(std::istream &file);
 GroupCode readDxfBinary(std::istream &file);
-void writeDxfText(std::ostream &file,GroupCode code);
-void writeDxfBinary(std::ostream &file,GroupCode code);
+void writeDxfText(std::ostream &file,const GroupCode &code);
+void writeDxfBinary(std::ostream &file,const GroupCode &code);
+bool readDxfGroups(std::istream &file,DxfHandler &handler,bool mode);
 std::vector<GroupCode> readDxfGroups(std::istream &file,bool mode);
 std::vector<GroupCode> readDxfGroups(std::string filename);
 std::vector<std::array<xyz,3> > extractTriangles(std::vector<GroupCode> dxfData);
+std::vector<std::array<xyz,3> > readDxfTriangles(std::string filename);
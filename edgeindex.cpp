@@ -0,0 +1,166 @@
+/******************************************************/
+/*                                                    */
+/* edgeindex.cpp - spatial index of TIN edges         */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <cmath>
+#include <algorithm>
+#include "pointlist.h"
+#include "cogo.h"
+using namespace std;
+
+unsigned long long mortonCode(unsigned x,unsigned y)
+// Interleaves the bits of x and y.
+{
+  unsigned long long ret=0;
+  int i;
+  for (i=0;i<32;i++)
+    ret|=((unsigned long long)((x>>i)&1)<<(2*i))|((unsigned long long)((y>>i)&1)<<(2*i+1));
+  return ret;
+}
+
+void EdgeIndex::clear()
+{
+  edges.clear();
+  starts.clear();
+  ends.clear();
+  nodes.clear();
+}
+
+void EdgeIndex::build(map<int,edge> &edgeMap)
+{
+  map<int,edge>::iterator i;
+  vector<pair<unsigned long long,edge *> > order;
+  double minx=INFINITY,miny=INFINITY,maxx=-INFINITY,maxy=-INFINITY,scale,len;
+  int j,k,levelStart,levelEnd;
+  xy mid;
+  EdgeIndexNode node;
+  clear();
+  for (i=edgeMap.begin();i!=edgeMap.end();++i)
+  {
+    mid=(xy(*i->second.a)+xy(*i->second.b))/2;
+    minx=fmin(minx,mid.getx());
+    miny=fmin(miny,mid.gety());
+    maxx=fmax(maxx,mid.getx());
+    maxy=fmax(maxy,mid.gety());
+  }
+  scale=4294967295./fmax(fmax(maxx-minx,maxy-miny),1e-300);
+  for (i=edgeMap.begin();i!=edgeMap.end();++i)
+  {
+    mid=(xy(*i->second.a)+xy(*i->second.b))/2;
+    order.push_back(make_pair(mortonCode(rint((mid.getx()-minx)*scale),rint((mid.gety()-miny)*scale)),&i->second));
+  }
+  sort(order.begin(),order.end());
+  for (j=0;j<order.size();j++)
+  {
+    edges.push_back(order[j].second);
+    starts.push_back(*order[j].second->a);
+    ends.push_back(*order[j].second->b);
+  }
+  for (j=0;j<edges.size();j+=EDGE_FANOUT)
+  {
+    node.leaf=true;
+    node.first=j;
+    node.count=min((int)edges.size()-j,EDGE_FANOUT);
+    node.minx=node.miny=INFINITY;
+    node.maxx=node.maxy=-INFINITY;
+    node.maxLength=-1;
+    for (k=j;k<j+node.count;k++)
+    {
+      node.minx=fmin(node.minx,fmin(starts[k].getx(),ends[k].getx()));
+      node.miny=fmin(node.miny,fmin(starts[k].gety(),ends[k].gety()));
+      node.maxx=fmax(node.maxx,fmax(starts[k].getx(),ends[k].getx()));
+      node.maxy=fmax(node.maxy,fmax(starts[k].gety(),ends[k].gety()));
+      len=dist(starts[k],ends[k]);
+      if (len>node.maxLength)
+      {
+	node.maxLength=len;
+	node.longest=k;
+      }
+    }
+    nodes.push_back(node);
+  }
+  levelStart=0;
+  levelEnd=nodes.size();
+  while (levelEnd-levelStart>1)
+  {
+    for (j=levelStart;j<levelEnd;j+=EDGE_FANOUT)
+    {
+      node.leaf=false;
+      node.first=j;
+      node.count=min(levelEnd-j,EDGE_FANOUT);
+      node.minx=node.miny=INFINITY;
+      node.maxx=node.maxy=-INFINITY;
+      node.maxLength=-1;
+      for (k=j;k<j+node.count;k++)
+      {
+	node.minx=fmin(node.minx,nodes[k].minx);
+	node.miny=fmin(node.miny,nodes[k].miny);
+	node.maxx=fmax(node.maxx,nodes[k].maxx);
+	node.maxy=fmax(node.maxy,nodes[k].maxy);
+	if (nodes[k].maxLength>node.maxLength)
+	{
+	  node.maxLength=nodes[k].maxLength;
+	  node.longest=nodes[k].longest;
+	}
+      }
+      nodes.push_back(node);
+    }
+    levelStart=levelEnd;
+    levelEnd=nodes.size();
+  }
+}
+
+void EdgeIndex::query(xy center,double radius,double pixelScale,vector<int> &result)
+/* Puts in result the indices of the edges longer than pixelScale that
+ * pass within radius of center, except that a cluster of edges too small
+ * to see is reduced to its longest edge.
+ */
+{
+  result.clear();
+  if (nodes.size())
+    query(nodes.size()-1,center,radius,pixelScale,result);
+}
+
+void EdgeIndex::query(int n,xy center,double radius,double pixelScale,vector<int> &result)
+{
+  EdgeIndexNode &node=nodes[n];
+  double dx,dy;
+  int i;
+  dx=fmax(fmax(node.minx-center.getx(),center.getx()-node.maxx),0);
+  dy=fmax(fmax(node.miny-center.gety(),center.gety()-node.maxy),0);
+  if (dx*dx+dy*dy>=radius*radius || node.maxLength<=pixelScale)
+    return;
+  if (fmax(node.maxx-node.minx,node.maxy-node.miny)<EDGE_DECIMATE*pixelScale)
+  {
+    if (psdist(center,starts[node.longest],ends[node.longest])<radius)
+      result.push_back(node.longest);
+  }
+  else if (node.leaf)
+  {
+    for (i=node.first;i<node.first+node.count;i++)
+      if (dist(starts[i],ends[i])>pixelScale && psdist(center,starts[i],ends[i])<radius)
+	result.push_back(i);
+  }
+  else
+    for (i=node.first;i<node.first+node.count;i++)
+      query(i,center,radius,pixelScale,result);
+}
@@ -0,0 +1,73 @@
+/******************************************************/
+/*                                                    */
+/* edgeindex.h - spatial index of TIN edges           */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef EDGEINDEX_H
+#define EDGEINDEX_H
+#include <vector>
+#include <map>
+#include "xyz.h"
+
+#define EDGE_FANOUT 16
+// Number of edges in a leaf, and children of an inner node
+#define EDGE_DECIMATE 2
+/* A node less than this many pixels across is drawn as its longest edge
+ * instead of all of its edges.
+ */
+
+class edge;
+
+struct EdgeIndexNode
+{
+  double minx,miny,maxx,maxy;
+  double maxLength; // of any edge below this node
+  int first,count; // children if inner, edges if leaf
+  int longest; // index of the longest edge below this node
+  bool leaf;
+};
+
+class EdgeIndex
+/* A packed R-tree of the edges of a TIN. The edges are sorted along a
+ * Morton curve and grouped EDGE_FANOUT to a leaf; the leaves are grouped
+ * the same way into inner nodes, up to the root, which is the last node.
+ * Each node knows the length of its longest edge, so a query skips
+ * subtrees whose edges are all shorter than a pixel, and when a node is
+ * smaller than EDGE_DECIMATE pixels only its longest edge is returned.
+ * The endpoints are copied into arrays, so the index must be rebuilt
+ * when edges are flipped.
+ */
+{
+public:
+  std::vector<edge *> edges;
+  std::vector<xy> starts,ends;
+  void build(std::map<int,edge> &edgeMap);
+  void clear();
+  size_t size()
+  {
+    return edges.size();
+  }
+  void query(xy center,double radius,double pixelScale,std::vector<int> &result);
+private:
+  std::vector<EdgeIndexNode> nodes;
+  void query(int n,xy center,double radius,double pixelScale,std::vector<int> &result);
+};
+#endif
@@ -0,0 +1,126 @@
+/******************************************************/
+/*                                                    */
+/* gapvector.h - vector with a movable gap            */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef GAPVECTOR_H
+#define GAPVECTOR_H
+#include <vector>
+#include <algorithm>
+
+template <typename T> class gapvector
+/* A gap buffer. The elements are stored in one vector with an unused gap,
+ * which is moved to wherever an element is inserted or erased. Inserting
+ * takes time proportional to the distance from the last insertion, so a run
+ * of insertions working through a polyline from end to start (as smoothing
+ * a contour does) takes linear time instead of quadratic.
+ */
+{
+private:
+  std::vector<T> buf;
+  size_t gapStart,gapEnd;
+  void moveGap(size_t pos)
+  {
+    if (pos<gapStart)
+    {
+      std::move_backward(buf.begin()+pos,buf.begin()+gapStart,buf.begin()+gapEnd);
+      gapEnd-=gapStart-pos;
+      gapStart=pos;
+    }
+    if (pos>gapStart)
+    {
+      std::move(buf.begin()+gapEnd,buf.begin()+gapEnd+(pos-gapStart),buf.begin()+gapStart);
+      gapEnd+=pos-gapStart;
+      gapStart=pos;
+    }
+  }
+  void grow()
+  // Called with the gap at the end. Doubles the capacity.
+  {
+    gapEnd=2*buf.size()+16;
+    buf.resize(gapEnd);
+  }
+public:
+  gapvector()
+  {
+    gapStart=gapEnd=0;
+  }
+  size_t size() const
+  {
+    return buf.size()-(gapEnd-gapStart);
+  }
+  bool empty() const
+  {
+    return size()==0;
+  }
+  T& operator[](size_t i)
+  {
+    return buf[(i<gapStart)?i:i+gapEnd-gapStart];
+  }
+  const T& operator[](size_t i) const
+  {
+    return buf[(i<gapStart)?i:i+gapEnd-gapStart];
+  }
+  T& back()
+  {
+    return (*this)[size()-1];
+  }
+  void insert(size_t pos,T val)
+  {
+    if (gapStart==gapEnd)
+    {
+      moveGap(size());
+      grow();
+    }
+    moveGap(pos);
+    buf[gapStart++]=val;
+  }
+  void erase(size_t pos)
+  {
+    moveGap(pos);
+    gapEnd++;
+  }
+  void push_back(T val)
+  {
+    insert(size(),val);
+  }
+  void resize(size_t n)
+  {
+    moveGap(size());
+    buf.resize(gapStart);
+    buf.resize(n);
+    gapStart=gapEnd=n;
+  }
+  void clear()
+  {
+    buf.clear();
+    gapStart=gapEnd=0;
+  }
+  T *data()
+  /* Closes the gap by moving it to the end, so that the elements are
+   * contiguous. For hashing.
+   */
+  {
+    moveGap(size());
+    return buf.data();
+  }
+};
+#endif
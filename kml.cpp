@@ -25,6 +25,11 @@
  * so that it can be seen on a map.
  */
 #include <climits>
+#include <cstring>
+#include "config.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "kml.h"
 #include "projection.h"
 #include "halton.h"
@@ -145,20 +150,26 @@ gboundary gbounds(cylinterval cyl)
  * the point is inside the polyarc.
  */
 
+string kmlHeader()
+{
+  return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+         "<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n"
+         "<Document>\n";
+}
+
 void openkml(ofstream &file,string filename)
 {
   file.open(filename);
-  file<<"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-      <<"<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n"
-      <<"<Document>\n";
+  file<<kmlHeader();
 }
 
-void kmlBoundary(ofstream &file,g1boundary g)
+void kmlBoundary(ostream &file,g1boundary g)
 {
   bool inner=g.isInner();
   int i;
   latlong ll;
   double lastlon=0;
+  string coords;
   file<<(inner?"<innerBoundaryIs>":"<outerBoundaryIs>")<<"<LinearRing><coordinates>\n";
   for (i=0;i<=g.size();i++)
   {
@@ -171,7 +182,12 @@ void kmlBoundary(ofstream &file,g1boundary g)
     while (ll.lon>lastlon+M_PI)
       ll.lon-=2*M_PI;
     lastlon=ll.lon;
-    file<<ldecimal(radtodeg(ll.lon),1/(EARTHRAD*cos(ll.lat)+1))<<','<<ldecimal(radtodeg(ll.lat),1/EARTHRAD)<<'\n';
+    coords.clear();
+    appendLdecimal(coords,radtodeg(ll.lon),1/(EARTHRAD*cos(ll.lat)+1));
+    coords+=',';
+    appendLdecimal(coords,radtodeg(ll.lat),1/EARTHRAD);
+    coords+='\n';
+    file<<coords;
   }
   file<<"</coordinates></LinearRing>"<<(inner?"</innerBoundaryIs>":"</outerBoundaryIs>")<<endl;
 }
@@ -189,7 +205,7 @@ void refine(g1boundary &g1)
     }
 }
 
-void kmlPolygon(ofstream &file,gboundary g)
+void kmlPolygon(ostream &file,gboundary g)
 {
   int i;
   g1boundary g1;
@@ -203,6 +219,400 @@ void kmlPolygon(ofstream &file,gboundary g)
   file<<"</Polygon></Placemark>"<<endl;
 }
 
+KmlBox kmlBox(gboundary &poly)
+/* Computes the latitude-longitude box of a polygon, which should already
+ * be refined. A boundary which goes all the way around in longitude
+ * surrounds a pole, so the box extends to the pole. If the box crosses the
+ * antimeridian, east is less than west. The longitudes of all boundaries
+ * are unwrapped starting near the first point of the outer boundary, so
+ * that a hole on the other side of the antimeridian stays in the box.
+ */
+{
+  int i,j;
+  g1boundary g1;
+  latlong ll;
+  double lon,lastlon,reflon=0,winding,sumlat;
+  KmlBox ret;
+  ret.north=-M_PI/2;
+  ret.south=M_PI/2;
+  ret.east=-INFINITY;
+  ret.west=INFINITY;
+  for (i=poly.size()-1;i>=0;i--)
+    if (poly[i].size() && !poly[i].isInner())
+      reflon=decodedir(poly[i][0]).latlon().lon;
+  for (i=0;i<poly.size();i++)
+  {
+    g1=poly[i];
+    winding=sumlat=0;
+    lastlon=reflon;
+    for (j=0;j<=g1.size();j++)
+    {
+      ll=decodedir(g1[j%g1.size()]).latlon();
+      lon=ll.lon;
+      while (lon<lastlon-M_PI)
+        lon+=2*M_PI;
+      while (lon>lastlon+M_PI)
+        lon-=2*M_PI;
+      if (j)
+        winding+=lon-lastlon;
+      lastlon=lon;
+      sumlat+=ll.lat;
+      if (ll.lat>ret.north)
+        ret.north=ll.lat;
+      if (ll.lat<ret.south)
+        ret.south=ll.lat;
+      if (lon>ret.east)
+        ret.east=lon;
+      if (lon<ret.west)
+        ret.west=lon;
+    }
+    if (fabs(winding)>M_PI)
+    {
+      if (sumlat>0)
+        ret.north=M_PI/2;
+      else
+        ret.south=-M_PI/2;
+      ret.west=-M_PI;
+      ret.east=M_PI;
+    }
+  }
+  if (ret.east-ret.west>=2*M_PI)
+  {
+    ret.west=-M_PI;
+    ret.east=M_PI;
+  }
+  while (ret.west<-M_PI)
+  {
+    ret.west+=2*M_PI;
+    ret.east+=2*M_PI;
+  }
+  while (ret.west>=M_PI)
+  {
+    ret.west-=2*M_PI;
+    ret.east-=2*M_PI;
+  }
+  if (ret.east>M_PI)
+    ret.east-=2*M_PI;
+  ret.north=radtodeg(ret.north);
+  ret.south=radtodeg(ret.south);
+  ret.east=radtodeg(ret.east);
+  ret.west=radtodeg(ret.west);
+  return ret;
+}
+
+double snapCoord(double coord,int level)
+{
+  return ldexp(rint(ldexp(coord,level)),-level);
+}
+
+g1boundary coarsen(g1boundary g1,int level)
+/* Snaps the vertices of g1 to the corners of quadtree squares at level,
+ * which on each face are 2^-level apart, and removes the segments that
+ * collapse. A boundary smaller than the squares disappears.
+ */
+{
+  int i;
+  vball v;
+  vector<vball> snapped;
+  g1boundary ret;
+  for (i=0;i<g1.size();i++)
+  {
+    v=g1[i];
+    v.x=snapCoord(v.x,level);
+    v.y=snapCoord(v.y,level);
+    if (snapped.size()==0 || !(snapped.back()==v))
+      snapped.push_back(v);
+  }
+  while (snapped.size()>1 && snapped[0]==snapped.back())
+    snapped.pop_back();
+  for (i=0;i<snapped.size();i++)
+    ret.push_back(snapped[i]);
+  if (ret.size()>2)
+    ret.deleteRetrace();
+  if (ret.size()<3)
+    ret.clear();
+  ret.setInner(g1.isInner());
+  return ret;
+}
+
+void kmlRegion(ostream &file,KmlBox box,int minPixels,int maxPixels)
+{
+  file<<"<Region><LatLonAltBox><north>"<<ldecimal(box.north,1e-7)
+      <<"</north><south>"<<ldecimal(box.south,1e-7)
+      <<"</south><east>"<<ldecimal(box.east,1e-7)
+      <<"</east><west>"<<ldecimal(box.west,1e-7)
+      <<"</west></LatLonAltBox><Lod><minLodPixels>"<<minPixels
+      <<"</minLodPixels><maxLodPixels>"<<maxPixels
+      <<"</maxLodPixels></Lod></Region>\n";
+}
+
+void writeLe(ostream &file,unsigned n,int nbytes)
+{
+  int i;
+  for (i=0;i<nbytes;i++,n>>=8)
+    file.put(n&255);
+}
+
+unsigned crc32Update(unsigned crc,const string &data)
+{
+#ifdef HAVE_ZLIB
+  return crc32(crc,(const Bytef *)data.data(),data.length());
+#else
+  static unsigned table[256];
+  int i,j;
+  unsigned c;
+  if (!table[1])
+    for (i=0;i<256;i++)
+    {
+      for (c=i,j=0;j<8;j++)
+        c=(c&1)?(c>>1)^0xedb88320:c>>1;
+      table[i]=c;
+    }
+  crc=~crc;
+  for (i=0;i<data.length();i++)
+    crc=table[(crc^(unsigned char)data[i])&255]^(crc>>8);
+  return ~crc;
+#endif
+}
+
+ZipEntry writeZipEntry(ostream &file,string name,const string &content)
+/* Writes one file of a zip archive, as needed for a KMZ, and returns what
+ * the central directory needs to know about it. The content is deflated
+ * if zlib is available, else stored.
+ */
+{
+  ZipEntry ret;
+  string data=content;
+#ifdef HAVE_ZLIB
+  z_stream strm;
+#endif
+  ret.name=name;
+  ret.crc=crc32Update(0,content);
+  ret.method=0;
+  ret.size=content.length();
+  ret.offset=file.tellp();
+#ifdef HAVE_ZLIB
+  memset(&strm,0,sizeof(strm));
+  if (deflateInit2(&strm,Z_BEST_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY)==Z_OK)
+  {
+    data.resize(deflateBound(&strm,content.length()));
+    strm.next_in=(Bytef *)content.data();
+    strm.avail_in=content.length();
+    strm.next_out=(Bytef *)&data[0];
+    strm.avail_out=data.length();
+    if (deflate(&strm,Z_FINISH)==Z_STREAM_END)
+    {
+      data.resize(strm.total_out);
+      ret.method=8;
+    }
+    else
+      data=content;
+    deflateEnd(&strm);
+  }
+#endif
+  ret.compressedSize=data.length();
+  writeLe(file,0x04034b50,4); // local file header
+  writeLe(file,20,2); // version needed to extract
+  writeLe(file,0,2); // flags
+  writeLe(file,ret.method,2);
+  writeLe(file,0,2); // time
+  writeLe(file,0x21,2); // date, 1980-01-01
+  writeLe(file,ret.crc,4);
+  writeLe(file,ret.compressedSize,4);
+  writeLe(file,ret.size,4);
+  writeLe(file,name.length(),2);
+  writeLe(file,0,2); // extra field length
+  file<<name<<data;
+  return ret;
+}
+
+void writeZipDirectory(ostream &file,const vector<ZipEntry> &entries)
+{
+  long long cdStart=file.tellp(),cdEnd;
+  int i;
+  for (i=0;i<entries.size();i++)
+  {
+    writeLe(file,0x02014b50,4); // central directory header
+    writeLe(file,20,2); // version made by
+    writeLe(file,20,2); // version needed to extract
+    writeLe(file,0,2); // flags
+    writeLe(file,entries[i].method,2);
+    writeLe(file,0,2); // time
+    writeLe(file,0x21,2); // date, 1980-01-01
+    writeLe(file,entries[i].crc,4);
+    writeLe(file,entries[i].compressedSize,4);
+    writeLe(file,entries[i].size,4);
+    writeLe(file,entries[i].name.length(),2);
+    writeLe(file,0,2); // extra field length
+    writeLe(file,0,2); // comment length
+    writeLe(file,0,2); // disk number
+    writeLe(file,0,2); // internal attributes
+    writeLe(file,0,4); // external attributes
+    writeLe(file,entries[i].offset,4);
+    file<<entries[i].name;
+  }
+  cdEnd=file.tellp();
+  writeLe(file,0x06054b50,4); // end of central directory
+  writeLe(file,0,2);
+  writeLe(file,0,2);
+  writeLe(file,entries.size(),2);
+  writeLe(file,entries.size(),2);
+  writeLe(file,cdEnd-cdStart,4);
+  writeLe(file,cdStart,4);
+  writeLe(file,0,2);
+}
+
+KmlWriter::KmlWriter()
+{
+  out=nullptr;
+  kmz=false;
+  count=0;
+}
+
+KmlWriter::~KmlWriter()
+{
+  if (out)
+    close();
+}
+
+bool KmlWriter::open(string filename)
+/* A KMZ starts with doc.kml, which is all that a viewer reads first, so it
+ * only links to index.kml, which is written last. A KML file is itself
+ * the index, and the detail files are written beside it.
+ */
+{
+  int i;
+  string ext;
+  size_t slash;
+  if (filename.length()>=4)
+    ext=filename.substr(filename.length()-4);
+  for (i=0;i<ext.length();i++)
+    ext[i]=tolower(ext[i]);
+  kmz=ext==".kmz";
+  file.open(filename,ios::binary);
+  if (!file.is_open())
+    return false;
+  zipEntries.clear();
+  index.str("");
+  count=0;
+  if (kmz)
+  {
+    detailHref="detail-";
+    zipEntries.push_back(writeZipEntry(file,"doc.kml",kmlHeader()+
+      "<NetworkLink><Link><href>index.kml</href></Link></NetworkLink>\n</Document></kml>\n"));
+    out=&index;
+  }
+  else
+  {
+    detailPrefix=(ext==".kml")?filename.substr(0,filename.length()-4):filename;
+    detailPrefix+='-';
+    slash=detailPrefix.find_last_of("/\\");
+    detailHref=(slash==string::npos)?detailPrefix:detailPrefix.substr(slash+1);
+    out=&file;
+  }
+  *out<<kmlHeader();
+  return true;
+}
+
+void KmlWriter::close()
+{
+  if (!out)
+    return;
+  *out<<"</Document></kml>\n";
+  if (kmz)
+  {
+    zipEntries.push_back(writeZipEntry(file,"index.kml",index.str()));
+    writeZipDirectory(file,zipEntries);
+  }
+  index.str("");
+  file.close();
+  out=nullptr;
+}
+
+void KmlWriter::detail(string suffix,const string &content)
+// Writes a detail file, whose name is detailHref or detailPrefix followed by suffix.
+{
+  ofstream detailFile;
+  if (kmz)
+    zipEntries.push_back(writeZipEntry(file,detailHref+suffix,content));
+  else
+  {
+    detailFile.open(detailPrefix+suffix,ios::binary);
+    detailFile<<content;
+  }
+}
+
+void KmlWriter::polygon(gboundary poly)
+/* If snapping the polygon to a coarser level of the quadtree makes it
+ * less than half as long, writes the coarse version to the index, shown
+ * while the polygon's region is smaller than KML_DETAIL_PIXELS, and the
+ * full detail to a separate file, which is linked to the index by a
+ * NetworkLink with a Region, so that the viewer loads it only when the
+ * region is that big. Otherwise writes the polygon to the index as it is.
+ * A side of a face is about 90° long.
+ */
+{
+  int i,level;
+  gboundary fine,coarse;
+  g1boundary g1;
+  KmlBox box;
+  double span;
+  bool changed=false,outerLeft=true;
+  string suffix;
+  ostringstream fineText,coarseText;
+  for (i=0;i<poly.size();i++)
+  {
+    g1=poly[i];
+    refine(g1);
+    fine.push_back(g1);
+  }
+  box=kmlBox(fine);
+  span=box.north-box.south;
+  if (box.east>=box.west && box.east-box.west>span)
+    span=box.east-box.west;
+  if (box.east<box.west && box.east-box.west+360>span)
+    span=box.east-box.west+360;
+  level=ceil(log2(90*KML_COARSE_CELLS/(span+1e-9)));
+  if (level<0)
+    level=0;
+  if (level>30)
+    level=30;
+  for (i=0;i<poly.size() && outerLeft;i++)
+  {
+    g1=coarsen(poly[i],level);
+    if (!(g1==poly[i]))
+      changed=true;
+    if (g1.size())
+      coarse.push_back(g1);
+    else if (!poly[i].isInner())
+      outerLeft=false;
+  }
+  count++;
+  for (i=0;i<fine.size();i++)
+    kmlBoundary(fineText,fine[i]);
+  if (changed && outerLeft)
+    for (i=0;i<coarse.size();i++)
+    {
+      g1=coarse[i];
+      refine(g1);
+      kmlBoundary(coarseText,g1);
+    }
+  if (changed && outerLeft && coarseText.str().length()*2<fineText.str().length())
+  {
+    suffix=to_string(count)+".kml";
+    *out<<"<Folder>\n<Placemark>\n";
+    kmlRegion(*out,box,0,KML_DETAIL_PIXELS);
+    *out<<"<Polygon>\n"<<coarseText.str()<<"</Polygon></Placemark>\n<NetworkLink>\n";
+    kmlRegion(*out,box,KML_DETAIL_PIXELS,-1);
+    *out<<"<Link><href>"<<detailHref<<suffix<<"</href><viewRefreshMode>onRegion</viewRefreshMode></Link>\n"
+        <<"</NetworkLink>\n</Folder>"<<endl;
+    detail(suffix,kmlHeader()+"<Placemark><Polygon>\n"+fineText.str()+
+           "</Polygon></Placemark>\n</Document></kml>\n");
+  }
+  else
+    *out<<"<Placemark><Polygon>\n"<<fineText.str()<<"</Polygon></Placemark>"<<endl;
+}
+
 void closekml(ofstream &file)
 {
   file<<"</Document></kml>\n";
@@ -333,13 +743,13 @@ gboundary extractRegion(gboundary &gb)
 
 void outKml(gboundary gb,string filename)
 {
-  ofstream file;
+  KmlWriter writer;
   gboundary poly;
-  openkml(file,filename);
+  writer.open(filename);
   while (gb.size())
   {
     poly=extractRegion(gb);
-    kmlPolygon(file,poly);
+    writer.polygon(poly);
   }
-  closekml(file);
+  writer.close();
 }
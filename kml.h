@@ -24,18 +24,73 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <map>
 #include "sourcegeoid.h"
 #include "polyline.h"
 
 #define MAXMIDORD 1e3
 // Maximum middle ordinate affects both loxodromes and geodesics.
+#define KML_DETAIL_PIXELS 512
+/* A polygon is drawn in full detail when its region is at least this many
+ * pixels across, and from a coarser level of the cube-face quadtree when
+ * it is smaller.
+ */
+#define KML_COARSE_CELLS 16
+// Number of coarse quadtree cells across the polygon's bounding box
 
 double middleOrdinate(latlong ll0,latlong ll1);
 std::vector<latlong> splitPoints(latlong ll0,latlong ll1);
 void openkml(std::ofstream &file,std::string filename);
 void closekml(std::ofstream &file);
 
+struct KmlBox
+{
+  double north,south,east,west; // degrees
+};
+
+struct ZipEntry
+{
+  std::string name;
+  unsigned crc,size,compressedSize;
+  int method;
+  long long offset;
+};
+
+class KmlWriter
+/* Writes polygons to a KML file as they are produced, instead of building
+ * the whole document first. A polygon that is simpler at a coarser level
+ * of the quadtree is written coarsely, and its full detail goes in its own
+ * file, behind a NetworkLink whose Region makes the viewer load it only
+ * when the polygon is big enough on the screen. If the filename ends in
+ * .kmz, the detail files go in the archive as they are made; otherwise
+ * they are written beside the KML file, named after it.
+ */
+{
+public:
+  KmlWriter();
+  ~KmlWriter();
+  bool open(std::string filename);
+  void polygon(gboundary poly);
+  void close();
+  int polygonCount()
+  {
+    return count;
+  }
+private:
+  std::ofstream file;
+  std::ostringstream index; // KMZ only; it's small, as the detail is elsewhere
+  std::ostream *out;
+  std::string detailPrefix,detailHref;
+  std::vector<ZipEntry> zipEntries;
+  bool kmz;
+  int count;
+  void detail(std::string suffix,const std::string &content);
+};
+
+KmlBox kmlBox(gboundary &poly);
+g1boundary coarsen(g1boundary g1,int level);
+
 class KmlRegionList
 {
   /* The bits in the key of regionMap tell which g1boundaries the region
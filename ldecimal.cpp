@@ -25,25 +25,397 @@
 #include <cstdio>
 #include <cfloat>
 #include <cstring>
+#include <cstdlib>
 #include <cmath>
 #include <cassert>
-#include <clocale>
+#include <cstdint>
+#include <vector>
 #include "ldecimal.h"
 using namespace std;
 
-string ldecimal(double x,double toler)
+const double tenPowers[]=
 {
-  double x2;
-  int h,i,iexp,chexp;
+  1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+  1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+};
+
+void layoutDecimal(string &ret,bool neg,string digits,int iexp)
+/* digits are the significant digits, the first of which is before the
+ * decimal point and is nonzero unless the number is 0. iexp is the
+ * power of ten of the first digit. Numbers between 1e-5 and 1e3 are
+ * written without an exponent, and a 0 before the decimal point is
+ * omitted, e.g. .05 and 150 but 1e3 and 1e-5.
+ */
+{
+  string m,antissa;
+  int chexp;
   size_t zpos;
-  char *dotpos,*epos,*pLcNumeric;
-  string ret,s,m,antissa,exponent,saveLcNumeric;
+  m=digits.substr(0,1);
+  antissa=digits.substr(1);
+  zpos=antissa.find_last_not_of('0');
+  antissa.erase(zpos+1);
+  if (iexp<0 && iexp>-5)
+  {
+    antissa=m+antissa;
+    m="";
+    iexp++;
+  }
+  if (iexp>0)
+  {
+    chexp=iexp;
+    if (chexp>antissa.length())
+      chexp=antissa.length();
+    m+=antissa.substr(0,chexp);
+    antissa.erase(0,chexp);
+    iexp-=chexp;
+  }
+  while (iexp>-5 && iexp<0 && m.length()==0)
+  {
+    antissa="0"+antissa;
+    iexp++;
+  }
+  while (iexp<3 && iexp>0 && antissa.length()==0)
+  {
+    m+='0';
+    iexp--;
+  }
+  if (neg)
+    ret+='-';
+  ret+=m;
+  if (antissa.length())
+    ret+='.'+antissa;
+  if (iexp)
+    ret+='e'+to_string(iexp);
+}
+
+bool tolerDecimal(string &ret,double x,double toler)
+/* Fast path for ldecimal with a tolerance, as used for PostScript
+ * coordinates. Rounds x to 2, 3, ... significant digits in floating point
+ * until it's within toler. Returns false, without writing anything, if x
+ * or the number of digits is out of the range where this is exact enough.
+ */
+{
+  int iexp,k,p;
+  double ax=fabs(x),pow10,x2=0;
+  long long n=0;
+  char digits[24];
+  if (!(toler>0) || !(ax>0) || !std::isfinite(ax) || ax/toler>=1e12)
+    return false;
+  iexp=floor(log10(ax));
+  if (iexp<-22 || iexp>22)
+    return false;
+  // log10 can be off by one near powers of ten.
+  if (iexp>=0 && ax<tenPowers[iexp])
+    iexp--;
+  if (iexp<0 && ax*tenPowers[-iexp]<1)
+    iexp--;
+  if (iexp>=0 && iexp<22 && ax>=tenPowers[iexp+1])
+    iexp++;
+  if (iexp<0 && ax*tenPowers[-iexp-1]>=1)
+    iexp++;
+  for (p=2;p<18;p++)
+  {
+    k=p-1-iexp; // number of digits after the decimal point
+    if (k>22 || k<-22)
+      return false;
+    pow10=tenPowers[abs(k)];
+    if (k>=0)
+    {
+      n=llrint(ax*pow10);
+      x2=n/pow10;
+    }
+    else
+    {
+      n=llrint(ax/pow10);
+      x2=n*pow10;
+    }
+    if (fabs(ax-x2)<=toler)
+      break;
+  }
+  if (p==18)
+    return false;
+  k=sprintf(digits,"%lld",n);
+  layoutDecimal(ret,x<0,string(digits,k),iexp+k-p);
+  return true;
+}
+
+/* Shortest round-trip formatting, following double-conversion
+ * (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", 2010).
+ */
+
+struct DiyFp
+{
+  uint64_t f;
+  int e;
+};
+
+struct CachedPower
+{
+  uint64_t f;
+  int e,dec;
+};
+
+DiyFp diyTimes(DiyFp x,DiyFp y)
+// Upper 64 bits of the product, rounded
+{
+  const uint64_t m32=0xffffffff;
+  uint64_t a=x.f>>32,b=x.f&m32,c=y.f>>32,d=y.f&m32;
+  uint64_t ac=a*c,bc=b*c,ad=a*d,bd=b*d,tmp;
+  DiyFp ret;
+  tmp=(bd>>32)+(ad&m32)+(bc&m32)+(1U<<31);
+  ret.f=ac+(ad>>32)+(bc>>32)+(tmp>>32);
+  ret.e=x.e+y.e+64;
+  return ret;
+}
+
+int bigBitLength(const vector<uint32_t> &big)
+{
+  int i=big.size()-1,ret=32*i;
+  uint32_t top=big[i];
+  while (top)
+  {
+    ret++;
+    top>>=1;
+  }
+  return ret;
+}
+
+bool bigBit(const vector<uint32_t> &big,int n)
+{
+  return n>=0 && (big[n/32]>>(n%32))&1;
+}
+
+CachedPower bigToCached(const vector<uint32_t> &big,int shift,int dec)
+/* big*2^shift is approximately 10^dec. Rounds big to 64 bits.
+ */
+{
+  CachedPower ret;
+  int len=bigBitLength(big),i;
+  ret.f=0;
+  for (i=len-1;i>=len-64;i--)
+    ret.f=(ret.f<<1)+bigBit(big,i);
+  ret.e=len-64+shift;
+  ret.dec=dec;
+  if (bigBit(big,len-65))
+  {
+    ret.f++;
+    if (ret.f==0)
+    {
+      ret.f=(uint64_t)1<<63;
+      ret.e++;
+    }
+  }
+  return ret;
+}
+
+vector<CachedPower> makeCachedPowers()
+/* Computes 10^k for k=-348,-340,...,340 as 64-bit significands rounded
+ * to nearest. Negative powers are 2^b/10^-k, divided by 10 repeatedly.
+ */
+{
+  vector<CachedPower> ret;
+  vector<uint32_t> big;
+  int k,i,j,b;
+  uint64_t acc;
+  for (k=-348;k<=340;k+=8)
+  {
+    if (k>=0)
+    {
+      big.assign(1,1);
+      for (i=0;i<k;i++)
+      {
+	for (acc=j=0;j<big.size();j++)
+	{
+	  acc+=(uint64_t)big[j]*10;
+	  big[j]=acc;
+	  acc>>=32;
+	}
+	if (acc)
+	  big.push_back(acc);
+      }
+      ret.push_back(bigToCached(big,0,k));
+    }
+    else
+    {
+      b=(-k*3322)/1000+128;
+      big.assign(b/32+1,0);
+      big.back()=1<<(b%32);
+      for (i=0;i<-k;i++)
+      {
+	for (acc=0,j=big.size()-1;j>=0;j--)
+	{
+	  acc=(acc<<32)+big[j];
+	  big[j]=acc/10;
+	  acc%=10;
+	}
+	while (big.back()==0)
+	  big.pop_back();
+      }
+      ret.push_back(bigToCached(big,-b,k));
+    }
+  }
+  return ret;
+}
+
+bool roundWeed(char *buffer,int length,uint64_t distanceTooHighW,uint64_t unsafeInterval,
+	       uint64_t rest,uint64_t tenKappa,uint64_t unit)
+/* Adjusts the last digit so that the number is as close as possible to
+ * the true value, and checks that the result is safe despite the
+ * imprecision of the cached power of ten.
+ */
+{
+  uint64_t smallDistance=distanceTooHighW-unit;
+  uint64_t bigDistance=distanceTooHighW+unit;
+  while (rest<smallDistance && unsafeInterval-rest>=tenKappa &&
+	 (rest+tenKappa<smallDistance || smallDistance-rest>=rest+tenKappa-smallDistance))
+  {
+    buffer[length-1]--;
+    rest+=tenKappa;
+  }
+  if (rest<bigDistance && unsafeInterval-rest>=tenKappa &&
+      (rest+tenKappa<bigDistance || bigDistance-rest>rest+tenKappa-bigDistance))
+    return false;
+  return 2*unit<=rest && rest<=unsafeInterval-4*unit;
+}
+
+bool grisu3(double v,char *buffer,int &length,int &decExp)
+/* Finds the shortest digit string which reads back as v, using Loitsch's
+ * Grisu3 algorithm. v must be positive and finite. decExp is the power of
+ * ten of the last digit. Returns false in the rare cases (about 0.5%) in
+ * which 64-bit arithmetic can't tell which digits are shortest or closest.
+ */
+{
+  static const vector<CachedPower> cachedPowers=makeCachedPowers();
+  uint64_t bits,unit=1,one,fractionals,rest;
+  uint32_t integrals,divisor;
+  int minExp,k,index,kappa,digit;
+  DiyFp w,mPlus,mMinus,tenMk,tooLow,tooHigh,unsafeInterval;
+  CachedPower cp;
+  memcpy(&bits,&v,8);
+  w.f=bits&0xfffffffffffffULL;
+  w.e=(bits>>52)&0x7ff;
+  if (w.e)
+  {
+    mMinus.f=(w.f==0 && w.e>1);
+    w.f+=(uint64_t)1<<52;
+    w.e-=1075;
+  }
+  else
+  {
+    mMinus.f=0;
+    w.e=-1074;
+  }
+  mPlus.f=(w.f<<1)+1;
+  mPlus.e=w.e-1;
+  while (!(mPlus.f>>63))
+  {
+    mPlus.f<<=1;
+    mPlus.e--;
+  }
+  if (mMinus.f) // lower boundary is closer
+  {
+    mMinus.f=(w.f<<2)-1;
+    mMinus.e=w.e-2;
+  }
+  else
+  {
+    mMinus.f=(w.f<<1)-1;
+    mMinus.e=w.e-1;
+  }
+  mMinus.f<<=mMinus.e-mPlus.e;
+  mMinus.e=mPlus.e;
+  while (!(w.f>>63))
+  {
+    w.f<<=1;
+    w.e--;
+  }
+  minExp=-60-(w.e+64);
+  k=ceil((minExp+63)*0.30102999566398114);
+  index=(348+k-1)/8+1;
+  cp=cachedPowers[index];
+  tenMk.f=cp.f;
+  tenMk.e=cp.e;
+  w=diyTimes(w,tenMk);
+  mMinus=diyTimes(mMinus,tenMk);
+  mPlus=diyTimes(mPlus,tenMk);
+  // Generate digits
+  tooLow=mMinus;
+  tooLow.f-=unit;
+  tooHigh=mPlus;
+  tooHigh.f+=unit;
+  unsafeInterval.f=tooHigh.f-tooLow.f;
+  one=(uint64_t)1<<-w.e;
+  integrals=tooHigh.f>>-w.e;
+  fractionals=tooHigh.f&(one-1);
+  for (divisor=1,kappa=0;integrals/divisor>=10;divisor*=10,kappa++);
+  if (integrals)
+    kappa++;
+  else
+    divisor=0;
+  length=0;
+  while (kappa>0)
+  {
+    digit=integrals/divisor;
+    buffer[length++]='0'+digit;
+    integrals%=divisor;
+    kappa--;
+    rest=((uint64_t)integrals<<-w.e)+fractionals;
+    if (rest<unsafeInterval.f)
+    {
+      decExp=kappa-cp.dec;
+      return roundWeed(buffer,length,tooHigh.f-w.f,unsafeInterval.f,rest,(uint64_t)divisor<<-w.e,unit);
+    }
+    divisor/=10;
+  }
+  while (true)
+  {
+    fractionals*=10;
+    unit*=10;
+    unsafeInterval.f*=10;
+    digit=fractionals>>-w.e;
+    buffer[length++]='0'+digit;
+    fractionals&=one-1;
+    kappa--;
+    if (fractionals<unsafeInterval.f)
+    {
+      decExp=kappa-cp.dec;
+      return roundWeed(buffer,length,(tooHigh.f-w.f)*unit,unsafeInterval.f,fractionals,one,unit);
+    }
+  }
+}
+
+bool shortestDecimal(string &ret,double x)
+/* Fast path for ldecimal with no tolerance. The slow path prints at least
+ * two significant digits, which for a subnormal number may differ from
+ * the shortest single digit (5e-324 comes out 4.9e-324), so that case is
+ * left to the slow path.
+ */
+{
+  char digits[24];
+  int len,decExp;
+  double ax=fabs(x);
+  if (x==0)
+  {
+    ret+=signbit(x)?"-0":"0";
+    return true;
+  }
+  if (!std::isfinite(ax) || !(ax>=1e-290) || !grisu3(ax,digits,len,decExp))
+    return false;
+  layoutDecimal(ret,x<0,string(digits,len),decExp+len-1);
+  return true;
+}
+
+void appendLdecimal(string &str,double x,double toler)
+{
+  double x2;
+  int h,i,iexp;
+  char *dotpos,*epos,*digpos;
+  string digits;
   char buffer[32],fmt[8];
   assert(toler>=0);
-  pLcNumeric=setlocale(LC_NUMERIC,nullptr);
-  if (pLcNumeric)
-    saveLcNumeric=pLcNumeric;
-  setlocale(LC_NUMERIC,"C");
+  if (toler>0 ? tolerDecimal(str,x,toler) : shortestDecimal(str,x))
+    return;
   if (toler>0 && x!=0)
   {
     iexp=floor(log10(fabs(x/toler))-1);
@@ -54,6 +426,10 @@ string ldecimal(double x,double toler)
     iexp=DBL_DIG-1;
   h=-1;
   i=iexp;
+  /* sprintf and atof both use the current locale, so the round trip works
+   * even if the decimal point is a comma. Calling setlocale here would
+   * not be thread-safe.
+   */
   while (true)
   {
     sprintf(fmt,"%%.%de",i);
@@ -66,63 +442,23 @@ string ldecimal(double x,double toler)
       h=1;
     i+=h;
   }
-  dotpos=strchr(buffer,'.');
+  digpos=buffer+(buffer[0]=='-');
   epos=strchr(buffer,'e');
-  if (epos && !dotpos) // e.g. 2e+00 becomes 2.e+00
-  {
-    memmove(epos+1,epos,buffer+31-epos);
-    dotpos=epos++;
-    *dotpos='.';
-  }
-  if (dotpos && epos)
+  if (epos && isdigit(*digpos))
   {
-    m=string(buffer,dotpos-buffer);
-    antissa=string(dotpos+1,epos-dotpos-1);
-    exponent=string(epos+1);
-    if (m.length()>1)
-    {
-      s=m.substr(0,1);
-      m.erase(0,1);
-    }
-    iexp=atoi(exponent.c_str());
-    zpos=antissa.find_last_not_of('0');
-    antissa.erase(zpos+1);
-    iexp=stoi(exponent);
-    if (iexp<0 && iexp>-5)
-    {
-      antissa=m+antissa;
-      m="";
-      iexp++;
-    }
-    if (iexp>0)
-    {
-      chexp=iexp;
-      if (chexp>antissa.length())
-	chexp=antissa.length();
-      m+=antissa.substr(0,chexp);
-      antissa.erase(0,chexp);
-      iexp-=chexp;
-    }
-    while (iexp>-5 && iexp<0 && m.length()==0)
-    {
-      antissa="0"+antissa;
-      iexp++;
-    }
-    while (iexp<3 && iexp>0 && antissa.length()==0)
-    {
-      m+='0';
-      iexp--;
-    }
-    sprintf(buffer,"%d",iexp);
-    exponent=buffer;
-    ret=s+m;
-    if (antissa.length())
-      ret+='.'+antissa;
-    if (iexp)
-      ret+='e'+exponent;
+    dotpos=digpos+1;
+    digits=*digpos;
+    if (dotpos<epos) // skip the decimal point, whatever character it is
+      digits+=string(dotpos+1,epos-dotpos-1);
+    layoutDecimal(str,buffer[0]=='-',digits,atoi(epos+1));
   }
   else
-    ret=buffer;
-  setlocale(LC_NUMERIC,saveLcNumeric.c_str());
+    str+=buffer;
+}
+
+string ldecimal(double x,double toler)
+{
+  string ret;
+  appendLdecimal(ret,x,toler);
   return ret;
 }
@@ -30,3 +30,5 @@ std::string ldecimal(double x,double toler=0);
  * If toler>0, returns the shortest representation of a number
  * that is within toler of x.
  */
+void appendLdecimal(std::string &str,double x,double toler=0);
+// Same as str+=ldecimal(x,toler), but without making a temporary string.
@@ -24,6 +24,8 @@
 #include <iostream>
 #include <cassert>
 #include <array>
+#include <map>
+#include <mutex>
 #include "manyarc.h"
 #include "rootfind.h"
 #include "manysum.h"
@@ -41,6 +43,11 @@
  * Method 3: Adjust the ends of the arcs along lines perpendicular to the
  * spiralarc so that the bearing at the end matches that of the spiralarc.
  */
+#define MANYARC_SHAPE_QUANTUM 4096
+/* Shapes in the cache are rounded to this fraction of a unit of curvature
+ * times length and clothance times length squared.
+ */
+#define MANYARC_CACHE_MAX 65536
 
 using namespace std;
 
@@ -348,16 +355,49 @@ array<int,2> ends(polyarc apx)
   return ret;
 }
 
-double meanSquareDistance(polyarc apx,spiralarc a)
+void quadratureSamples(polyarc &apx,spiralarc &a,vector<xy> &apxsta,vector<double> &balong,vector<xyz> &bsta,vector<double> &weight)
+/* Gathers the four Gaussian quadrature points of every arc of apx, the
+ * closest points to them on a, and the weights, which include the length
+ * of the arc. The stations of each arc, and those of the spiralarc, are
+ * computed in one batch.
+ */
 {
-  int i;
-  vector<double> acc;
+  int i,j;
   arc oneArc;
+  double alen;
+  const double gaussp[4]={GAUSSQ4P0P,GAUSSQ4P1P,1-GAUSSQ4P1P,1-GAUSSQ4P0P};
+  const double gaussw[4]={GAUSSQ4P0W,GAUSSQ4P1W,GAUSSQ4P1W,GAUSSQ4P0W};
+  vector<double> alongs(4);
+  vector<xyz> stas;
+  apxsta.clear();
+  balong.clear();
+  weight.clear();
   for (i=0;i<apx.size();i++)
   {
     oneArc=apx.getarc(i);
-    acc.push_back(meanSquareDistance(&oneArc,&a)*oneArc.length());
+    alen=oneArc.length();
+    for (j=0;j<4;j++)
+      alongs[j]=gaussp[j]*alen;
+    stas=oneArc.stations(alongs);
+    for (j=0;j<4;j++)
+    {
+      apxsta.push_back(stas[j]);
+      balong.push_back(a.closest(stas[j]));
+      weight.push_back(gaussw[j]*alen);
+    }
   }
+  bsta=a.stations(balong);
+}
+
+double meanSquareDistance(polyarc apx,spiralarc a)
+{
+  int i;
+  vector<double> acc,balong,weight;
+  vector<xy> apxsta;
+  vector<xyz> bsta;
+  quadratureSamples(apx,a,apxsta,balong,bsta,weight);
+  for (i=0;i<apxsta.size();i++)
+    acc.push_back(sqr(dist(apxsta[i],(xy)bsta[i]))*weight[i]);
   return pairwisesum(acc)/apx.length();
 }
 
@@ -366,17 +406,13 @@ vector<double> weightedDistance(polyarc apx,spiralarc a)
  * the result is meanSquareDistance times the total length of apx.
  */
 {
-  int i,j;
-  vector<double> ret;
-  array<double,4> wd1;
-  arc oneArc;
-  for (i=0;i<apx.size();i++)
-  {
-    oneArc=apx.getarc(i);
-    wd1=weightedDistance(&oneArc,&a);
-    for (j=0;j<4;j++)
-      ret.push_back(wd1[j]);
-  }
+  int i;
+  vector<double> ret,balong,weight;
+  vector<xy> apxsta;
+  vector<xyz> bsta;
+  quadratureSamples(apx,a,apxsta,balong,bsta,weight);
+  for (i=0;i<apxsta.size();i++)
+    ret.push_back(distanceInDirection(apxsta[i],bsta[i],a.bearing(balong[i])+DEG90)*sqrt(weight[i]));
   return ret;
 }
 
@@ -667,7 +703,88 @@ polyarc adjustManyArc2(polyarc apx,spiralarc a)
   return apx;
 }
 
-polyarc manyArc(spiralarc a,int narcs)
+/* Contours and alignments exported to formats that have only arcs contain
+ * thousands of spiralarcs, many of them of nearly the same shape. The shape
+ * of a spiralarc, apart from its size and position, is given by its
+ * curvature times its length and its clothance times the square of its
+ * length, and the adjusted offsets scale with the length.
+ */
+typedef array<long long,3> ManyArcKey;
+
+ManyArcKey manyArcKey(spiralarc &a,int narcs)
+{
+  ManyArcKey ret;
+  double len=a.length();
+  ret[0]=llrint(a.curvature(len/2)*len*MANYARC_SHAPE_QUANTUM);
+  ret[1]=llrint(a.clothance()*sqr(len)*MANYARC_SHAPE_QUANTUM);
+  ret[2]=narcs;
+  return ret;
+}
+
+size_t ManyArcCache::size()
+{
+  lock_guard<mutex> lock(mtx);
+  return offsets.size();
+}
+
+void ManyArcCache::clear()
+{
+  lock_guard<mutex> lock(mtx);
+  offsets.clear();
+}
+
+bool ManyArcCache::find(ManyArcKey key,vector<double> &offs)
+{
+  map<ManyArcKey,vector<double> >::iterator j;
+  lock_guard<mutex> lock(mtx);
+  j=offsets.find(key);
+  if (j!=offsets.end())
+    offs=j->second;
+  return j!=offsets.end();
+}
+
+void ManyArcCache::store(ManyArcKey key,const vector<double> &offs)
+{
+  lock_guard<mutex> lock(mtx);
+  if (offsets.size()>=MANYARC_CACHE_MAX)
+    offsets.clear();
+  offsets[key]=offs;
+}
+
+vector<double> warmOffsets(ManyArcCache &cache,spiralarc &a,vector<Circle> &lines,vector<double> offs)
+/* If the cache has offsets for a spiralarc of this shape, and they come
+ * closer to matching the end bearing than offs, returns them scaled to a.
+ */
+{
+  int i;
+  double len=a.length();
+  vector<double> warm;
+  if (cache.find(manyArcKey(a,lines.size()-1),warm) && warm.size()==offs.size() && std::isfinite(len))
+  {
+    for (i=0;i<warm.size();i++)
+      warm[i]*=len;
+    if (abs(endDirectionError(a,pointSeq(lines,warm)))<abs(endDirectionError(a,pointSeq(lines,offs))))
+      offs=warm;
+  }
+  return offs;
+}
+
+void cacheOffsets(ManyArcCache &cache,spiralarc &a,vector<double> offs)
+{
+  int i;
+  double len=a.length();
+  if (len>0 && std::isfinite(len))
+  {
+    for (i=0;i<offs.size();i++)
+      offs[i]/=len;
+    cache.store(manyArcKey(a,offs.size()-1),offs);
+  }
+}
+
+polyarc manyArc(spiralarc a,int narcs,ManyArcCache *cache)
+/* If cache is given, starts from the offsets of a spiralarc of nearly the
+ * same shape approximated before with it, and stores the offsets there.
+ */
 {
 #if METHOD==1
   polyarc ret;
@@ -690,7 +807,11 @@ polyarc manyArc(spiralarc a,int narcs)
   vector<segment> quads=manyQuad(cubic,narcs);
   vector<Circle> lines=crossLines(a,quads);
   vector<double> offs=offsets(cubic,quads);
+  if (cache)
+    offs=warmOffsets(*cache,a,lines,offs);
   offs=adjustManyArc3(a,lines,offs);
+  if (cache)
+    cacheOffsets(*cache,a,offs);
   ret=manyArcApprox3(a,lines,offs);
 #endif
   return ret;
@@ -21,9 +21,33 @@
  * and Lesser General Public License along with Bezitopo. If not, see
  * <http://www.gnu.org/licenses/>.
  */
-
+#ifndef MANYARC_H
+#define MANYARC_H
+#include <map>
+#include <array>
+#include <mutex>
 #include "polyline.h"
 
+class ManyArcCache
+/* Offsets of spiralarcs already approximated, divided by their lengths and
+ * keyed by rounded shape and number of arcs, used as a warm start for the
+ * next spiralarc of nearly the same shape. A warm start can end at a
+ * slightly different approximation than a cold one, so a cache is used only
+ * when the caller passes one to manyArc, as when exporting thousands of
+ * spiralarcs at once; the result then depends on what else was approximated
+ * with the same cache.
+ */
+{
+public:
+  size_t size();
+  void clear();
+  bool find(std::array<long long,3> key,std::vector<double> &offs);
+  void store(std::array<long long,3> key,const std::vector<double> &offs);
+private:
+  std::map<std::array<long long,3>,std::vector<double> > offsets;
+  std::mutex mtx;
+};
+
 segment spiralToCubic(spiralarc a);
 double manyArcTrimFunc(double p,double n);
 double manyArcTrimDeriv(double p,double n);
@@ -33,5 +57,6 @@ double maxErrorCubic(int narcs);
 double meanSquareDistance(polyarc apx,spiralarc a);
 std::vector<double> weightedDistance(polyarc apx,spiralarc a);
 polyarc manyArcUnadjusted(spiralarc a,int narcs);
-polyarc manyArc(spiralarc a,int narcs);
+polyarc manyArc(spiralarc a,int narcs,ManyArcCache *cache=nullptr);
 double maxError(polyarc apx,spiralarc a);
+#endif
@@ -0,0 +1,406 @@
+/******************************************************/
+/*                                                    */
+/* overlay.cpp - overlay of two TINs                  */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <cmath>
+#include <array>
+#include <set>
+#include <algorithm>
+#include "overlay.h"
+#include "cogo.h"
+using namespace std;
+
+/* The overlay walks the triangles of the existing surface. For each one,
+ * it finds the design triangles that touch it by looking up its corners
+ * in the design's quad index and spreading to neighbors, and clips each
+ * pair of triangles to a convex polygon, which is cut into triangles. The
+ * difference of two Bézier triangles is a cubic in the plane, so it is
+ * represented exactly on each small triangle by taking its values on the
+ * ten points of the cubic lattice and converting them to control points.
+ *
+ * A point where an existing edge crosses a design edge is computed with
+ * the ends of both edges in a fixed order, so the triangles on both sides
+ * of an edge, in whatever tile or thread, get the same point to the last
+ * bit. makeBareTriangles then merges them, stitching the tiles together.
+ */
+
+struct OverlayPiece
+{
+  array<xyz,3> corners;
+  array<double,7> ctrl;
+};
+
+bool lessxy(const xy &a,const xy &b)
+{
+  return a.getx()<b.getx() || (a.getx()==b.getx() && a.gety()<b.gety());
+}
+
+bool inTriangle(triangle *t,xy pnt)
+// A point on an edge or corner is in.
+{
+  return area3(*t->a,*t->b,pnt)>=0 && area3(*t->b,*t->c,pnt)>=0 && area3(*t->c,*t->a,pnt)>=0;
+}
+
+void edgeCrossing(vector<xy> &poly,xy a,xy b,xy c,xy d)
+/* If edge ab of the existing triangle crosses edge cd of the design
+ * triangle in the midst of both, adds the crossing to poly.
+ */
+{
+  if (lessxy(b,a))
+    swap(a,b);
+  if (lessxy(d,c))
+    swap(c,d);
+  if (intersection_type(a,b,c,d)==ACXBD)
+    poly.push_back(intersection(a,b,c,d));
+}
+
+vector<xy> triangleIntersection(triangle *ta,triangle *tb)
+/* Returns the corners of the intersection of two triangles, counterclockwise.
+ * It may have fewer than three corners if they only touch.
+ */
+{
+  vector<xy> poly,ca,cb;
+  vector<double> angles;
+  vector<int> order;
+  xy cen(0,0);
+  int i,j;
+  ca.push_back(*ta->a);
+  ca.push_back(*ta->b);
+  ca.push_back(*ta->c);
+  cb.push_back(*tb->a);
+  cb.push_back(*tb->b);
+  cb.push_back(*tb->c);
+  for (i=0;i<3;i++)
+  {
+    if (inTriangle(tb,ca[i]))
+      poly.push_back(ca[i]);
+    if (inTriangle(ta,cb[i]))
+      poly.push_back(cb[i]);
+  }
+  for (i=0;i<3;i++)
+    for (j=0;j<3;j++)
+      edgeCrossing(poly,ca[i],ca[(i+1)%3],cb[j],cb[(j+1)%3]);
+  sort(poly.begin(),poly.end(),lessxy);
+  poly.erase(unique(poly.begin(),poly.end()),poly.end());
+  if (poly.size()>3)
+  {
+    for (i=0;i<poly.size();i++)
+      cen+=poly[i];
+    cen/=poly.size();
+    for (i=0;i<poly.size();i++)
+    {
+      angles.push_back(atan2(poly[i].gety()-cen.gety(),poly[i].getx()-cen.getx()));
+      order.push_back(i);
+    }
+    sort(order.begin(),order.end(),[&](int l,int r){return angles[l]<angles[r];});
+    ca.clear();
+    for (i=0;i<order.size();i++)
+      ca.push_back(poly[order[i]]);
+    poly=ca;
+  }
+  else if (poly.size()==3 && area3(poly[0],poly[1],poly[2])<0)
+    swap(poly[1],poly[2]);
+  return poly;
+}
+
+array<double,4> triangleBox(triangle *t)
+// Returns west, south, east, and north of the triangle.
+{
+  array<double,4> ret;
+  ret[0]=fmin(fmin(t->a->getx(),t->b->getx()),t->c->getx());
+  ret[1]=fmin(fmin(t->a->gety(),t->b->gety()),t->c->gety());
+  ret[2]=fmax(fmax(t->a->getx(),t->b->getx()),t->c->getx());
+  ret[3]=fmax(fmax(t->a->gety(),t->b->gety()),t->c->gety());
+  return ret;
+}
+
+bool boxesOverlap(const array<double,4> &l,const array<double,4> &r)
+{
+  return l[0]<=r[2] && r[0]<=l[2] && l[1]<=r[3] && r[1]<=l[3];
+}
+
+struct HullIndex
+/* The design's boundary triangles, sorted into a grid of cells over the
+ * design's bounding rectangle. Each cell lists the triangles whose boxes
+ * overlap it, so that a triangle of the existing surface is tested only
+ * against the boundary triangles near it.
+ */
+{
+  vector<triangle *> tris;
+  vector<array<double,4> > boxes;
+  vector<vector<int> > cells;
+  array<double,4> bound;
+  int side;
+  void build(pointlist &design);
+  void cellRange(const array<double,4> &box,int &w,int &s,int &e,int &n);
+  vector<int> near(const array<double,4> &box);
+};
+
+void HullIndex::build(pointlist &design)
+{
+  map<int,triangle>::iterator k;
+  int i,x,y,w,s,e,n;
+  bound={INFINITY,INFINITY,-INFINITY,-INFINITY};
+  for (k=design.triangles.begin();k!=design.triangles.end();++k)
+    if (!k->second.aneigh || !k->second.bneigh || !k->second.cneigh)
+    {
+      tris.push_back(&k->second);
+      boxes.push_back(triangleBox(&k->second));
+      // Every extreme point of the design is a corner of a boundary triangle.
+      bound[0]=fmin(bound[0],boxes.back()[0]);
+      bound[1]=fmin(bound[1],boxes.back()[1]);
+      bound[2]=fmax(bound[2],boxes.back()[2]);
+      bound[3]=fmax(bound[3],boxes.back()[3]);
+    }
+  side=ceil(sqrt(tris.size()));
+  if (side<1)
+    side=1;
+  cells.resize(side*side);
+  for (i=0;i<tris.size();i++)
+  {
+    cellRange(boxes[i],w,s,e,n);
+    for (y=s;y<=n;y++)
+      for (x=w;x<=e;x++)
+	cells[y*side+x].push_back(i);
+  }
+}
+
+void HullIndex::cellRange(const array<double,4> &box,int &w,int &s,int &e,int &n)
+{
+  auto cellOf=[&](double c,double lo,double hi)
+  {
+    int ret=(hi>lo)?floor((c-lo)/(hi-lo)*side):0;
+    if (ret<0)
+      ret=0;
+    if (ret>=side)
+      ret=side-1;
+    return ret;
+  };
+  w=cellOf(box[0],bound[0],bound[2]);
+  e=cellOf(box[2],bound[0],bound[2]);
+  s=cellOf(box[1],bound[1],bound[3]);
+  n=cellOf(box[3],bound[1],bound[3]);
+}
+
+vector<int> HullIndex::near(const array<double,4> &box)
+/* Returns, in order, the boundary triangles whose boxes overlap box.
+ * They are in order so that the pieces come out the same whatever cells
+ * they are found in.
+ */
+{
+  vector<int> ret;
+  int i,x,y,w,s,e,n;
+  if (!boxesOverlap(box,bound))
+    return ret;
+  cellRange(box,w,s,e,n);
+  for (y=s;y<=n;y++)
+    for (x=w;x<=e;x++)
+      for (i=0;i<cells[y*side+x].size();i++)
+	if (boxesOverlap(box,boxes[cells[y*side+x][i]]))
+	  ret.push_back(cells[y*side+x][i]);
+  sort(ret.begin(),ret.end());
+  ret.erase(unique(ret.begin(),ret.end()),ret.end());
+  return ret;
+}
+
+OverlayPiece differencePiece(triangle *ta,triangle *tb,xy p,xy q,xy r)
+/* Makes the Bézier triangle pqr whose elevation is tb's minus ta's.
+ * The control points are numbered as in triangle::elevation.
+ */
+{
+  OverlayPiece ret;
+  double fp,fq,fr,fcen;
+  array<double,2> pq,pr,qr; // values at the lattice points along the edges
+  auto diff=[&](xy pnt){return tb->elevation(pnt)-ta->elevation(pnt);};
+  fp=diff(p);
+  fq=diff(q);
+  fr=diff(r);
+  pq[0]=diff((2*p+q)/3);
+  pq[1]=diff((p+2*q)/3);
+  pr[0]=diff((2*p+r)/3);
+  pr[1]=diff((p+2*r)/3);
+  qr[0]=diff((2*q+r)/3);
+  qr[1]=diff((q+2*r)/3);
+  fcen=diff((p+q+r)/3);
+  ret.corners[0]=xyz(p,fp);
+  ret.corners[1]=xyz(q,fq);
+  ret.corners[2]=xyz(r,fr);
+  ret.ctrl[0]=(-5*fp+18*pq[0]-9*pq[1]+2*fq)/6;
+  ret.ctrl[2]=(2*fp-9*pq[0]+18*pq[1]-5*fq)/6;
+  ret.ctrl[1]=(-5*fp+18*pr[0]-9*pr[1]+2*fr)/6;
+  ret.ctrl[4]=(2*fp-9*pr[0]+18*pr[1]-5*fr)/6;
+  ret.ctrl[5]=(-5*fq+18*qr[0]-9*qr[1]+2*fr)/6;
+  ret.ctrl[6]=(2*fq-9*qr[0]+18*qr[1]-5*fr)/6;
+  ret.ctrl[3]=(27*fcen-(fp+fq+fr)-3*(ret.ctrl[0]+ret.ctrl[1]+ret.ctrl[2]+
+	       ret.ctrl[4]+ret.ctrl[5]+ret.ctrl[6]))/6;
+  return ret;
+}
+
+void overlayTriangle(pointlist &design,HullIndex &hull,triangle *ta,vector<OverlayPiece> &pieces)
+/* Finds the design triangles that touch ta and adds the pieces of their
+ * intersections with it. If a corner of ta is outside the design, or the
+ * spread reaches an edge of the design's boundary that crosses ta, the
+ * design may come into ta again in a place not connected to those found
+ * by its corners (a non-convex design can do this even with all three
+ * corners inside), so the design's boundary triangles near ta are checked
+ * too.
+ */
+{
+  vector<triangle *> queue;
+  set<triangle *> seen;
+  vector<xy> poly;
+  triangle *tb,*neigh[3];
+  xy corners[3]={*ta->a,*ta->b,*ta->c};
+  xy ends[3];
+  bool outside=false,hullAdded=false;
+  int i,j;
+  auto addHull=[&]()
+  {
+    int h;
+    vector<int> near=hull.near(triangleBox(ta));
+    hullAdded=true;
+    for (h=0;h<near.size();h++)
+    {
+      tb=hull.tris[near[h]];
+      if (!seen.count(tb) && triangleIntersection(ta,tb).size())
+      {
+	seen.insert(tb);
+	queue.push_back(tb);
+      }
+    }
+  };
+  for (i=0;i<4;i++)
+  {
+    tb=design.findt((i<3)?corners[i]:(corners[0]+corners[1]+corners[2])/3);
+    if (tb && !seen.count(tb))
+    {
+      seen.insert(tb);
+      queue.push_back(tb);
+    }
+    if (!tb && i<3)
+      outside=true;
+  }
+  if (outside)
+    addHull();
+  for (i=0;i<queue.size();i++)
+  {
+    tb=queue[i];
+    poly=triangleIntersection(ta,tb);
+    if (poly.empty())
+      continue;
+    for (j=2;j<poly.size();j++)
+      if (area3(poly[0],poly[j-1],poly[j])>0)
+	pieces.push_back(differencePiece(ta,tb,poly[0],poly[j-1],poly[j]));
+    neigh[0]=tb->aneigh;
+    neigh[1]=tb->bneigh;
+    neigh[2]=tb->cneigh;
+    ends[0]=*tb->a;
+    ends[1]=*tb->b;
+    ends[2]=*tb->c;
+    for (j=0;j<3;j++)
+      if (neigh[j] && !seen.count(neigh[j]))
+      {
+	seen.insert(neigh[j]);
+	queue.push_back(neigh[j]);
+      }
+      else if (!neigh[j] && !hullAdded)
+      { // The edge opposite corner j is on the design's boundary.
+	if (inTriangle(ta,ends[(j+1)%3]) || inTriangle(ta,ends[(j+2)%3]) ||
+	    crossTriangle(ends[(j+1)%3],ends[(j+2)%3],corners[0],corners[1],corners[2]))
+	  addHull();
+      }
+  }
+}
+
+void tinDifference(pointlist &diff,pointlist &existing,pointlist &design,int nthreads)
+/* Makes diff a TIN of the area covered by both existing and design, whose
+ * elevation is design's minus existing's. Positive is fill, negative is
+ * cut. The existing triangles are sorted into tiles by their centroids;
+ * the pieces of each tile are made in one thread and put together in tile
+ * order, so the result is the same for any number of threads. Existing
+ * triangles entirely outside the design's bounding rectangle are skipped.
+ * diff is ready for roughcontours.
+ */
+{
+  HullIndex hull;
+  vector<pair<int,triangle *> > tiled;
+  vector<xy> centroids;
+  vector<size_t> tileStart;
+  vector<vector<OverlayPiece> > tilePieces(OVERLAY_TILES*OVERLAY_TILES);
+  vector<array<xyz,3> > bare;
+  vector<array<double,7> > ctrls;
+  map<int,triangle>::iterator k;
+  double west=INFINITY,south=INFINITY,east=-INFINITY,north=-INFINITY;
+  int i,j,col,row;
+  hull.build(design);
+  for (k=existing.triangles.begin();k!=existing.triangles.end();++k)
+  {
+    centroids.push_back(k->second.centroid());
+    west=fmin(west,centroids.back().getx());
+    south=fmin(south,centroids.back().gety());
+    east=fmax(east,centroids.back().getx());
+    north=fmax(north,centroids.back().gety());
+  }
+  for (i=0,k=existing.triangles.begin();k!=existing.triangles.end();++k,++i)
+  {
+    col=(east>west)?floor((centroids[i].getx()-west)/(east-west)*OVERLAY_TILES):0;
+    row=(north>south)?floor((centroids[i].gety()-south)/(north-south)*OVERLAY_TILES):0;
+    if (col>=OVERLAY_TILES)
+      col=OVERLAY_TILES-1;
+    if (row>=OVERLAY_TILES)
+      row=OVERLAY_TILES-1;
+    if (boxesOverlap(triangleBox(&k->second),hull.bound))
+      tiled.push_back(make_pair(row*OVERLAY_TILES+col,&k->second));
+  }
+  stable_sort(tiled.begin(),tiled.end(),
+	      [](const pair<int,triangle *> &l,const pair<int,triangle *> &r){return l.first<r.first;});
+  for (i=j=0;i<=tilePieces.size();i++)
+  {
+    while (j<tiled.size() && tiled[j].first<i)
+      j++;
+    tileStart.push_back(j);
+  }
+  parallelRanges(tilePieces.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    size_t t,m;
+    for (t=begin;t<end;t++)
+      for (m=tileStart[t];m<tileStart[t+1];m++)
+	overlayTriangle(design,hull,tiled[m].second,tilePieces[t]);
+  });
+  for (i=0;i<tilePieces.size();i++)
+    for (j=0;j<tilePieces[i].size();j++)
+    {
+      bare.push_back(tilePieces[i][j].corners);
+      ctrls.push_back(tilePieces[i][j].ctrl);
+    }
+  diff.clear();
+  if (bare.empty())
+    return;
+  diff.makeBareTriangles(bare);
+  for (i=0;i<ctrls.size();i++)
+    for (j=0;j<7;j++)
+      diff.triangles[i].ctrl[j]=ctrls[i][j];
+  diff.makeEdges();
+  diff.updateqindex();
+  diff.findcriticalpts(nthreads);
+  diff.addperimeter();
+}
@@ -0,0 +1,34 @@
+/******************************************************/
+/*                                                    */
+/* overlay.h - overlay of two TINs                    */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef OVERLAY_H
+#define OVERLAY_H
+#include "pointlist.h"
+
+#define OVERLAY_TILES 8
+/* The triangles of the existing surface are sorted into OVERLAY_TILES
+ * tiles on a side, which are divided among the threads.
+ */
+
+void tinDifference(pointlist &diff,pointlist &existing,pointlist &design,int nthreads=1);
+#endif
@@ -110,9 +110,12 @@ int writepnezd(document *doc,string fname,Measure ms)
       z=i->second.elev();
       d=i->second.note;
       pstr=to_string(p);
-      nstr=ldecimal(ms.fromCoherent(n,LENGTH));
-      estr=ldecimal(ms.fromCoherent(e,LENGTH));
-      zstr=ldecimal(ms.fromCoherent(z,LENGTH));
+      nstr.clear();
+      appendLdecimal(nstr,ms.fromCoherent(n,LENGTH));
+      estr.clear();
+      appendLdecimal(estr,ms.fromCoherent(e,LENGTH));
+      zstr.clear();
+      appendLdecimal(zstr,ms.fromCoherent(z,LENGTH));
       words.clear();
       words.push_back(pstr);
       words.push_back(nstr);
@@ -198,9 +201,12 @@ int writepenzd(document *doc,string fname,Measure ms)
       z=i->second.elev();
       d=i->second.note;
       pstr=to_string(p);
-      nstr=ldecimal(ms.fromCoherent(n,LENGTH));
-      estr=ldecimal(ms.fromCoherent(e,LENGTH));
-      zstr=ldecimal(ms.fromCoherent(z,LENGTH));
+      nstr.clear();
+      appendLdecimal(nstr,ms.fromCoherent(n,LENGTH));
+      estr.clear();
+      appendLdecimal(estr,ms.fromCoherent(e,LENGTH));
+      zstr.clear();
+      appendLdecimal(zstr,ms.fromCoherent(z,LENGTH));
       words.clear();
       words.push_back(pstr);
       words.push_back(estr);
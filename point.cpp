@@ -125,7 +125,12 @@ void xy::roscat(xy tfrom,int ro,double sca,xy tto)
 
 void xy::writeXml(ofstream &ofile)
 {
-  ofile<<"<xy>"<<ldecimal(x)<<' '<<ldecimal(y)<<"</xy>";
+  string buf("<xy>");
+  appendLdecimal(buf,x);
+  buf+=' ';
+  appendLdecimal(buf,y);
+  buf+="</xy>";
+  ofile<<buf;
 }
 
 xy operator+(const xy &l,const xy &r)
@@ -358,7 +363,14 @@ void xyz::roscat(xy tfrom,int ro,double sca,xy tto)
 
 void xyz::writeXml(ofstream &ofile)
 {
-  ofile<<"<xyz>"<<ldecimal(x)<<' '<<ldecimal(y)<<' '<<ldecimal(z)<<"</xyz>";
+  string buf("<xyz>");
+  appendLdecimal(buf,x);
+  buf+=' ';
+  appendLdecimal(buf,y);
+  buf+=' ';
+  appendLdecimal(buf,z);
+  buf+="</xyz>";
+  ofile<<buf;
 }
 
 bool operator==(const xyz &l,const xyz &r)
@@ -515,7 +527,13 @@ bool point::hasProperty(int prop)
 
 void point::writeXml(ofstream &ofile,pointlist &pl)
 {
-  ofile<<"<point n=\""<<pl.revpoints[this]<<"\" d=\""<<xmlEscape(note)<<"\">"<<ldecimal(x)<<' '<<ldecimal(y)<<' '<<ldecimal(z);
+  string buf;
+  appendLdecimal(buf,x);
+  buf+=' ';
+  appendLdecimal(buf,y);
+  buf+=' ';
+  appendLdecimal(buf,z);
+  ofile<<"<point n=\""<<pl.revpoints[this]<<"\" d=\""<<xmlEscape(note)<<"\">"<<buf;
   ofile<<"<grad>";
   gradient.writeXml(ofile);
   ofile<<"</grad>";
@@ -619,14 +637,17 @@ void point::insertEdge(edge *edg)
 }
 
 edge *point::edg(triangle *tri)
+/* Doesn't move line, so that triangles sharing this point can be
+ * subdivided in parallel.
+ */
 {
   int i;
-  edge *oldline,*ret;
-  for (i=0,oldline=line,ret=NULL;!ret && (!i || oldline!=line);i++)
+  edge *e,*ret;
+  for (i=0,e=line,ret=NULL;!ret && (!i || e!=line);i++)
   {
-    if (line->tri(this)==tri)
-      ret=line;
-    line=line->next(this);
+    if (e->tri(this)==tri)
+      ret=e;
+    e=e->next(this);
   }
   return ret;
 }
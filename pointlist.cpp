@@ -23,6 +23,9 @@
  */
 
 #include <cmath>
+#include <chrono>
+#include <future>
+#include <exception>
 #include "angle.h"
 #include "globals.h"
 #include "pointlist.h"
@@ -67,6 +70,8 @@ void criterion::writeXml(ostream &ofile)
 pointlist::pointlist()
 {
   initStlTable();
+  surfaceTimes.makegrad=surfaceTimes.maketriangles=surfaceTimes.setgradient=0;
+  surfaceTimes.edgeCrit=surfaceTimes.triangleCrit=0;
 }
 
 void pointlist::clear()
@@ -74,6 +79,7 @@ void pointlist::clear()
   contours.clear();
   triangles.clear();
   edges.clear();
+  edgeIndex.clear();
   points.clear();
   revpoints.clear();
   triPolyLog.clear();
@@ -83,6 +89,7 @@ void pointlist::clearTin()
 {
   triangles.clear();
   edges.clear();
+  edgeIndex.clear();
 }
 
 int pointlist::size()
@@ -90,13 +97,6 @@ int pointlist::size()
   return points.size();
 }
 
-void pointlist::clearmarks()
-{
-  map<int,edge>::iterator e;
-  for (e=edges.begin();e!=edges.end();e++)
-    e->second.clearmarks();
-}
-
 int symhash(int a,int b)
 /* symhash(a,b)=symhash(b,a). Otherwise similar to skewsym.
  */
@@ -487,6 +487,12 @@ void pointlist::makeqindex()
   qinx.split(plist);
   if (triangles.size())
     qinx.settri(&triangles[0]);
+  makeEdgeIndex();
+}
+
+void pointlist::makeEdgeIndex()
+{
+  edgeIndex.build(edges);
 }
 
 void pointlist::updateqindex()
@@ -497,6 +503,7 @@ void pointlist::updateqindex()
 {
   if (triangles.size())
     qinx.settri(&triangles[0]);
+  makeEdgeIndex();
 }
 
 double pointlist::elevation(xy location)
@@ -509,19 +516,68 @@ double pointlist::elevation(xy location)
     return nan("");
 }
 
-void pointlist::setgradient(bool flat)
+void parallelRanges(size_t n,int nthreads,function<void(size_t,size_t)> body)
+/* Divides 0..n into nthreads contiguous ranges and calls body on each in its
+ * own thread. Each item must depend only on data that no other item in the
+ * same call writes, so that the result is the same for any number of threads.
+ * If body throws, the exception is rethrown after all threads have finished.
+ */
 {
+  vector<future<void> > workers;
+  exception_ptr thrown;
   int i;
-  for (i=0;i<triangles.size();i++)
-    if (flat)
-      triangles[i].flatten();
-    else
+  if (nthreads<1)
+    nthreads=1;
+  if (nthreads>n)
+    nthreads=n;
+  if (nthreads<=1)
+  {
+    body(0,n);
+    return;
+  }
+  for (i=0;i<nthreads;i++)
+    workers.push_back(async(launch::async,body,n*i/nthreads,n*(i+1)/nthreads));
+  for (i=0;i<workers.size();i++)
+    try
     {
-      triangles[i].setgradient(*triangles[i].a,triangles[i].a->gradient);
-      triangles[i].setgradient(*triangles[i].b,triangles[i].b->gradient);
-      triangles[i].setgradient(*triangles[i].c,triangles[i].c->gradient);
-      triangles[i].setcentercp();
+      workers[i].get();
     }
+    catch (...)
+    {
+      if (!thrown)
+	thrown=current_exception();
+    }
+  if (thrown)
+    rethrow_exception(thrown);
+}
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
+void pointlist::setgradient(bool flat,int nthreads)
+{
+  vector<triangle *> tris;
+  map<int,triangle>::iterator t;
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
+  for (t=triangles.begin();t!=triangles.end();t++)
+    tris.push_back(&t->second);
+  parallelRanges(tris.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    size_t i;
+    for (i=begin;i<end;i++)
+      if (flat)
+	tris[i]->flatten();
+      else
+      {
+	tris[i]->setgradient(*tris[i]->a,tris[i]->a->gradient);
+	tris[i]->setgradient(*tris[i]->b,tris[i]->b->gradient);
+	tris[i]->setgradient(*tris[i]->c,tris[i]->c->gradient);
+	tris[i]->setcentercp();
+      }
+  });
+  surfaceTimes.setgradient=secondsSince(start);
 }
 
 double pointlist::dirbound(int angle)
@@ -542,22 +598,65 @@ double pointlist::dirbound(int angle)
   return bound;
 }
 
-void pointlist::findedgecriticalpts()
+void pointlist::findedgecriticalpts(int nthreads)
 {
+  vector<edge *> edgeptrs;
   map<int,edge>::iterator e;
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
   for (e=edges.begin();e!=edges.end();e++)
-    e->second.findextrema();
+    edgeptrs.push_back(&e->second);
+  parallelRanges(edgeptrs.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    size_t i;
+    for (i=begin;i<end;i++)
+      edgeptrs[i]->findextrema();
+  });
+  surfaceTimes.edgeCrit=secondsSince(start);
 }
 
-void pointlist::findcriticalpts()
+void pointlist::findcriticalpts(int begin,int end,int nthreads)
+/* Finds the critical points of triangles begin through end-1 and subdivides
+ * them. The edges' extrema must have been found already. This is separate
+ * so that the GUI can do a batch at a time and show progress.
+ */
 {
-  map<int,triangle>::iterator t;
-  findedgecriticalpts();
-  for (t=triangles.begin();t!=triangles.end();t++)
+  vector<triangle *> tris;
+  int i;
+  for (i=begin;i<end;i++)
+    tris.push_back(&triangles[i]);
+  parallelRanges(tris.size(),nthreads,[&](size_t b,size_t e)
   {
-    t->second.findcriticalpts();
-    t->second.subdivide();
-  }
+    size_t j;
+    for (j=b;j<e;j++)
+    {
+      tris[j]->findcriticalpts();
+      tris[j]->subdivide();
+    }
+  });
+}
+
+void pointlist::findcriticalpts(int nthreads)
+{
+  chrono::steady_clock::time_point start;
+  findedgecriticalpts(nthreads);
+  start=chrono::steady_clock::now();
+  findcriticalpts(0,triangles.size(),nthreads);
+  surfaceTimes.triangleCrit=secondsSince(start);
+}
+
+void pointlist::makeSurface(double corr,bool flat,int nthreads)
+/* Builds the smooth surface on a TIN which has points and edges. The times
+ * taken by the stages are left in surfaceTimes.
+ */
+{
+  chrono::steady_clock::time_point start;
+  solvegrad(corr,1e-12,200,nthreads);
+  start=chrono::steady_clock::now();
+  maketriangles();
+  surfaceTimes.maketriangles=secondsSince(start);
+  setgradient(flat,nthreads);
+  makeqindex();
+  findcriticalpts(nthreads);
 }
 
 void pointlist::addperimeter()
@@ -816,5 +915,7 @@ void pointlist::roscat(xy tfrom,int ro,double sca,xy tto)
     contours[i]._roscat(tfrom,ro,sca,cossin(ro)*sca,tto);
   for (j=points.begin();j!=points.end();j++)
     j->second._roscat(tfrom,ro,sca,cossin(ro)*sca,tto);
+  if (edgeIndex.size())
+    makeEdgeIndex();
 }
 
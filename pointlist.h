@@ -29,10 +29,13 @@
 #include <vector>
 #include <array>
 #include <set>
+#include <functional>
+#include <chrono>
 #include "point.h"
 #include "tin.h"
 #include "bezier.h"
 #include "qindex.h"
+#include "edgeindex.h"
 #include "polyline.h"
 #include "contour.h"
 #include "breakline.h"
@@ -69,6 +72,27 @@ struct TriPolyLogEntry
   std::array<int,3> tri; // indices to loop
 };
 
+struct SurfaceTimes
+/* Seconds taken by each stage of building the surface, the last time
+ * it was done.
+ */
+{
+  double makegrad,maketriangles,setgradient,edgeCrit,triangleCrit;
+};
+
+struct GradReport
+/* How solvegrad did. residual is the largest amount by which a point's
+ * gradient fails to satisfy its equation, in the same units as gradient.
+ */
+{
+  int iterations,colors,nonzeros;
+  double residual,seconds;
+  bool converged;
+};
+
+void parallelRanges(size_t n,int nthreads,std::function<void(size_t,size_t)> body);
+double secondsSince(std::chrono::steady_clock::time_point start);
+
 class pointlist
 {
 private:
@@ -101,13 +125,14 @@ public:
    * 3: both are valid (you just made a TIN, or you just saved breaklines to a file).
    */
   qindex qinx;
+  EdgeIndex edgeIndex; // rebuilt with qinx, for drawing edges
   std::vector<TriPolyLogEntry> triPolyLog;
+  SurfaceTimes surfaceTimes;
   pointlist();
   void addpoint(int numb,point pnt,bool overwrite=false);
   int addtriangle(int n=1);
   void clear();
   int size();
-  void clearmarks();
   void clearTin();
   bool checkTinConsistency();
   bool checkFlower();
@@ -116,9 +141,11 @@ public:
   std::vector<point *> fromInt1loop(int1loop intLoop);
   intloop boundary();
   int readCriteria(std::string fname,Measure ms);
-  void setgradient(bool flat=false);
-  void findedgecriticalpts();
-  void findcriticalpts();
+  void setgradient(bool flat=false,int nthreads=1);
+  void findedgecriticalpts(int nthreads=1);
+  void findcriticalpts(int nthreads=1);
+  void findcriticalpts(int begin,int end,int nthreads);
+  void makeSurface(double corr,bool flat,int nthreads=1);
   void addperimeter();
   void removeperimeter();
   triangle *findt(xy pnt,bool clip=false);
@@ -146,10 +173,12 @@ public:
   int1loop convexHull();
   int flipPass(PostScript &ps,bool colorfibaster);
   void maketin(std::string filename="",bool colorfibaster=false);
-  void makegrad(double corr);
+  void makegrad(double corr,int nthreads=1);
+  GradReport solvegrad(double corr,double toler=1e-12,int maxIter=200,int nthreads=1);
   void maketriangles();
   void makeqindex();
   void updateqindex();
+  void makeEdgeIndex();
   void makeBareTriangles(std::vector<std::array<xyz,3> > bareTriangles);
   void triangulatePolygon(std::vector<point *> poly);
   void makeEdges();
@@ -31,10 +31,10 @@
  */
 
 #include <cassert>
+#include <cfloat>
 #include <iostream>
 #include "polyline.h"
 #include "manysum.h"
-#include "relprime.h"
 #include "ldecimal.h"
 using namespace std;
 int bendlimit=DEG180;
@@ -50,6 +50,9 @@ int midarcdir(xy a,xy b,xy c)
 polyline::polyline()
 {
   elevation=0;
+  version=1;
+  hashedVersion=0;
+  treeVersion=0;
 }
 
 polyarc::polyarc(): polyline::polyline()
@@ -64,6 +67,9 @@ polyspiral::polyspiral(): polyarc::polyarc()
 polyline::polyline(double e)
 {
   elevation=e;
+  version=1;
+  hashedVersion=0;
+  treeVersion=0;
 }
 
 polyarc::polyarc(double e): polyline::polyline(e)
@@ -123,34 +129,47 @@ int polyline::size()
 }
 
 unsigned polyline::hash()
+/* Hashing a large polyspiral takes 1/20 as much time as rendering it,
+ * so the hash is kept until a mutator changes the version.
+ */
 {
-  return memHash(&lengths[0],lengths.size()*sizeof(double),
-         memHash(&cumLengths[0],cumLengths.size()*sizeof(double),
-         memHash(&endpoints[0],endpoints.size()*sizeof(xy),
+  if (hashedVersion!=version)
+  {
+    cachedHash=computeHash();
+    hashedVersion=version;
+  }
+  return cachedHash;
+}
+
+unsigned polyline::computeHash()
+{
+  return memHash(lengths.data(),lengths.size()*sizeof(double),
+         memHash(cumLengths.data(),cumLengths.size()*sizeof(double),
+         memHash(endpoints.data(),endpoints.size()*sizeof(xy),
          memHash(&elevation,sizeof(double)))));
 }
 
-unsigned polyarc::hash()
+unsigned polyarc::computeHash()
 {
-  return memHash(&deltas[0],deltas.size()*sizeof(int),
-         memHash(&lengths[0],lengths.size()*sizeof(double),
-         memHash(&cumLengths[0],cumLengths.size()*sizeof(double),
-         memHash(&endpoints[0],endpoints.size()*sizeof(xy),
+  return memHash(deltas.data(),deltas.size()*sizeof(int),
+         memHash(lengths.data(),lengths.size()*sizeof(double),
+         memHash(cumLengths.data(),cumLengths.size()*sizeof(double),
+         memHash(endpoints.data(),endpoints.size()*sizeof(xy),
          memHash(&elevation,sizeof(double))))));
 }
 
-unsigned polyspiral::hash()
+unsigned polyspiral::computeHash()
 {
-  return memHash(&bearings[0],bearings.size()*sizeof(int),
-         memHash(&delta2s[0],delta2s.size()*sizeof(int),
-         memHash(&midbearings[0],midbearings.size()*sizeof(int),
-         memHash(&midpoints[0],midpoints.size()*sizeof(xy),
-         memHash(&curvatures[0],curvatures.size()*sizeof(double),
-         memHash(&clothances[0],clothances.size()*sizeof(double),
-         memHash(&deltas[0],deltas.size()*sizeof(int),
-         memHash(&lengths[0],lengths.size()*sizeof(double),
-         memHash(&cumLengths[0],cumLengths.size()*sizeof(double),
-         memHash(&endpoints[0],endpoints.size()*sizeof(xy),
+  return memHash(bearings.data(),bearings.size()*sizeof(int),
+         memHash(delta2s.data(),delta2s.size()*sizeof(int),
+         memHash(midbearings.data(),midbearings.size()*sizeof(int),
+         memHash(midpoints.data(),midpoints.size()*sizeof(xy),
+         memHash(curvatures.data(),curvatures.size()*sizeof(double),
+         memHash(clothances.data(),clothances.size()*sizeof(double),
+         memHash(deltas.data(),deltas.size()*sizeof(int),
+         memHash(lengths.data(),lengths.size()*sizeof(double),
+         memHash(cumLengths.data(),cumLengths.size()*sizeof(double),
+         memHash(endpoints.data(),endpoints.size()*sizeof(xy),
          memHash(&elevation,sizeof(double))))))))))));
 }
 
@@ -180,6 +199,24 @@ spiralarc polyspiral::getspiralarc(int i)
 		   curvatures[i],clothances[i],lengths[i]);
 }
 
+spiralarc polyline::getPiece(int i)
+/* Returns piece i as a spiralarc, which can represent all three kinds,
+ * for code that works on any polyline.
+ */
+{
+  return spiralarc(getsegment(i));
+}
+
+spiralarc polyarc::getPiece(int i)
+{
+  return spiralarc(getarc(i));
+}
+
+spiralarc polyspiral::getPiece(int i)
+{
+  return getspiralarc(i);
+}
+
 xyz polyline::getEndpoint(int i)
 {
   i%=endpoints.size();
@@ -199,12 +236,304 @@ xyz polyline::getend()
   return getEndpoint(lengths.size());
 }
 
-bezier3d polyline::approx3d(double precision)
+bcir polyline::pieceCircle(int i)
+/* A piece of length L from p to q lies within the ellipse with foci p and q
+ * and major axis L, hence within L/2 of (p+q)/2. Unlike boundCircles,
+ * this is kept up to date by insert.
+ */
+{
+  bcir ret;
+  ret.center=(xy(getEndpoint(i))+xy(getEndpoint(i+1)))/2;
+  ret.radius=lengths[i]/2;
+  return ret;
+}
+
+bcir polyline::boundCircle()
+/* Returns a circle containing the whole polyline, not necessarily the
+ * smallest, made from the circles around the pieces.
+ */
 {
-  bezier3d ret;
   int i;
+  double minx=INFINITY,miny=INFINITY,maxx=-INFINITY,maxy=-INFINITY;
+  bcir ret,piece;
   for (i=0;i<size();i++)
-    ret+=getsegment(i).approx3d(precision);
+  {
+    piece=pieceCircle(i);
+    minx=fmin(minx,piece.center.getx()-piece.radius);
+    miny=fmin(miny,piece.center.gety()-piece.radius);
+    maxx=fmax(maxx,piece.center.getx()+piece.radius);
+    maxy=fmax(maxy,piece.center.gety()+piece.radius);
+  }
+  if (minx>maxx)
+  {
+    ret.center=endpoints.size()?endpoints[0]:xy(0,0);
+    ret.radius=0;
+  }
+  else
+  {
+    ret.center=xy((minx+maxx)/2,(miny+maxy)/2);
+    ret.radius=0;
+    for (i=0;i<size();i++)
+    {
+      piece=pieceCircle(i);
+      ret.radius=fmax(ret.radius,dist(ret.center,piece.center)+piece.radius);
+    }
+  }
+  return ret;
+}
+
+void polyline::updateBoundTree()
+/* Builds the tree if the polyline has changed since it was last built.
+ * This is not done in the mutators, because a run of insertions, as in
+ * smoothing a contour, would then take quadratic time.
+ */
+{
+  if (treeVersion!=version)
+  {
+    boundTree.resize(4*lengths.size());
+    if (lengths.size())
+      buildBoundTree(0,0,lengths.size());
+    treeVersion=version;
+  }
+}
+
+bcir polyline::buildBoundTree(int node,int begin,int end)
+/* A leaf's circle is enlarged a little, so that the ends of a piece, which
+ * are on its circle, test as inside it despite roundoff.
+ */
+{
+  bcir a,b,ret;
+  double d;
+  int mid=(begin+end)/2;
+  if (end-begin==1)
+  {
+    ret=pieceCircle(begin);
+    ret.radius+=ret.radius*1e-9+(fabs(ret.center.getx())+fabs(ret.center.gety()))*4*DBL_EPSILON;
+  }
+  else
+  {
+    a=buildBoundTree(2*node+1,begin,mid);
+    b=buildBoundTree(2*node+2,mid,end);
+    d=dist(a.center,b.center);
+    if (d+b.radius<=a.radius)
+      ret=a;
+    else if (d+a.radius<=b.radius)
+      ret=b;
+    else
+    {
+      ret.radius=(d+a.radius+b.radius)/2;
+      ret.center=a.center+(b.center-a.center)*((ret.radius-a.radius)/d);
+    }
+  }
+  boundTree[node]=ret;
+  return ret;
+}
+
+void polyline::nearestPieces(int node,int begin,int end,xy topoint,double &closesofar,
+                             function<double(int,double)> &pieceClose)
+{
+  int mid=(begin+end)/2;
+  double d;
+  if (dist(boundTree[node].center,topoint)-boundTree[node].radius>=closesofar)
+    return;
+  if (end-begin==1)
+  {
+    d=pieceClose(begin,closesofar);
+    if (d<closesofar)
+      closesofar=d;
+  }
+  else if (dist(boundTree[2*node+1].center,topoint)-boundTree[2*node+1].radius<=
+           dist(boundTree[2*node+2].center,topoint)-boundTree[2*node+2].radius)
+  {
+    nearestPieces(2*node+1,begin,mid,topoint,closesofar,pieceClose);
+    nearestPieces(2*node+2,mid,end,topoint,closesofar,pieceClose);
+  }
+  else
+  {
+    nearestPieces(2*node+2,mid,end,topoint,closesofar,pieceClose);
+    nearestPieces(2*node+1,begin,mid,topoint,closesofar,pieceClose);
+  }
+}
+
+void polyline::closestPiece(xy topoint,function<double(int,double)> pieceClose)
+/* Calls pieceClose(i,closesofar), which returns the distance from topoint
+ * to piece i, on the pieces that can be closer than any found so far,
+ * nearest circles first.
+ */
+{
+  double closesofar=INFINITY;
+  updateBoundTree();
+  if (lengths.size())
+    nearestPieces(0,0,lengths.size(),topoint,closesofar,pieceClose);
+}
+
+void polyline::rayPieces(int node,int begin,int end,xy point,vector<int> &pieces)
+// Finds the pieces whose circles may cross the ray from point eastward.
+{
+  int mid=(begin+end)/2;
+  if (fabs(boundTree[node].center.gety()-point.gety())>boundTree[node].radius ||
+      boundTree[node].center.getx()+boundTree[node].radius<point.getx())
+    return;
+  if (end-begin==1)
+    pieces.push_back(begin);
+  else
+  {
+    rayPieces(2*node+1,begin,mid,point,pieces);
+    rayPieces(2*node+2,mid,end,point,pieces);
+  }
+}
+
+void polyline::coveringPieces(int node,int begin,int end,xy point,vector<int> &pieces)
+{
+  int mid=(begin+end)/2;
+  if (dist(boundTree[node].center,point)>boundTree[node].radius)
+    return;
+  if (end-begin==1)
+    pieces.push_back(begin);
+  else
+  {
+    coveringPieces(2*node+1,begin,mid,point,pieces);
+    coveringPieces(2*node+2,mid,end,point,pieces);
+  }
+}
+
+void polyline::overlapPieces(int node,int begin,int end,bcir c,vector<int> &pieces)
+{
+  int mid=(begin+end)/2;
+  if (dist(boundTree[node].center,c.center)>boundTree[node].radius+c.radius)
+    return;
+  if (end-begin==1)
+    pieces.push_back(begin);
+  else
+  {
+    overlapPieces(2*node+1,begin,mid,c,pieces);
+    overlapPieces(2*node+2,mid,end,c,pieces);
+  }
+}
+
+vector<int> polyline::overlappingPieces(bcir c)
+/* Returns the pieces whose circles overlap c. To query from several threads
+ * at once, call updateBoundTree first.
+ */
+{
+  vector<int> ret;
+  updateBoundTree();
+  if (lengths.size())
+    overlapPieces(0,0,lengths.size(),c,ret);
+  return ret;
+}
+
+vector<int> polyline::piecesAround(xy point)
+/* Returns the pieces whose circles contain point. Only these can bulge
+ * around it.
+ */
+{
+  vector<int> ret;
+  updateBoundTree();
+  if (lengths.size())
+    coveringPieces(0,0,lengths.size(),point,ret);
+  return ret;
+}
+
+void polyline::boundPieces(int node,int begin,int end,xy dir,double &boundsofar,
+                           function<double(int,double)> &pieceBound)
+{
+  int mid=(begin+end)/2;
+  double bound;
+  if (dot(boundTree[node].center,dir)-boundTree[node].radius>=boundsofar)
+    return;
+  if (end-begin==1)
+  {
+    bound=pieceBound(begin,boundsofar);
+    if (bound<boundsofar)
+      boundsofar=bound;
+  }
+  else if (dot(boundTree[2*node+1].center,dir)-boundTree[2*node+1].radius<=
+           dot(boundTree[2*node+2].center,dir)-boundTree[2*node+2].radius)
+  {
+    boundPieces(2*node+1,begin,mid,dir,boundsofar,pieceBound);
+    boundPieces(2*node+2,mid,end,dir,boundsofar,pieceBound);
+  }
+  else
+  {
+    boundPieces(2*node+2,mid,end,dir,boundsofar,pieceBound);
+    boundPieces(2*node+1,begin,mid,dir,boundsofar,pieceBound);
+  }
+}
+
+double polyline::dirboundPieces(int angle,double boundsofar,function<double(int,double)> pieceBound)
+/* Calls pieceBound(i,boundsofar), which returns piece i's dirbound, on the
+ * pieces whose circles reach past boundsofar in direction angle.
+ */
+{
+  updateBoundTree();
+  if (lengths.size())
+    boundPieces(0,0,lengths.size(),cossin(angle),boundsofar,pieceBound);
+  return boundsofar;
+}
+
+bool polyline::runFits(int start,int end,double precision)
+/* Returns true if pieces start through end-1 are all within precision of
+ * the chord from endpoint start to endpoint end.
+ */
+{
+  int i;
+  bcir piece;
+  xy a=getEndpoint(start),b=getEndpoint(end);
+  for (i=start;i<end;i++)
+  {
+    piece=pieceCircle(i);
+    if (psdist(piece.center,a,b)+piece.radius>precision)
+      return false;
+  }
+  return true;
+}
+
+int polyline::simplifiedRun(int start,double precision)
+/* Returns the end of the longest run of pieces, beginning at start, which
+ * can be drawn as one straight spline. The run length is found by doubling,
+ * then bisecting, so that a polyline made of many pieces smaller than
+ * precision is simplified in O(n log n) time.
+ */
+{
+  int lo=1,hi,mid,n=size()-start;
+  while (lo*2<=n && runFits(start,start+lo*2,precision))
+    lo*=2;
+  hi=(lo*2<=n)?lo*2:n+1;
+  while (hi-lo>1)
+  {
+    mid=(lo+hi)/2;
+    if (runFits(start,start+mid,precision))
+      lo=mid;
+    else
+      hi=mid;
+  }
+  return start+lo;
+}
+
+bezier3d polyline::chordBezier(int start,int end)
+{
+  xyz a=getEndpoint(start),b=getEndpoint(end);
+  return bezier3d(a,a+(b-a)/3,b-(b-a)/3,b);
+}
+
+/* The approx3d methods draw runs of pieces that lie within precision of
+ * their chord as one straight spline. Zoomed out, a contour made of
+ * thousands of pieces smaller than a pixel costs only as much as its
+ * visible detail.
+ */
+bezier3d polyline::approx3d(double precision)
+{
+  bezier3d ret;
+  int i,end;
+  for (i=0;i<size();i=end)
+  {
+    end=simplifiedRun(i,precision);
+    if (end>i+1)
+      ret+=chordBezier(i,end);
+    else
+      ret+=getsegment(i).approx3d(precision);
+  }
   if (!isopen())
     ret.close();
   return ret;
@@ -213,9 +542,15 @@ bezier3d polyline::approx3d(double precision)
 bezier3d polyarc::approx3d(double precision)
 {
   bezier3d ret;
-  int i;
-  for (i=0;i<size();i++)
-    ret+=getarc(i).approx3d(precision);
+  int i,end;
+  for (i=0;i<size();i=end)
+  {
+    end=simplifiedRun(i,precision);
+    if (end>i+1)
+      ret+=chordBezier(i,end);
+    else
+      ret+=getarc(i).approx3d(precision);
+  }
   if (!isopen())
     ret.close();
   return ret;
@@ -224,9 +559,15 @@ bezier3d polyarc::approx3d(double precision)
 bezier3d polyspiral::approx3d(double precision)
 {
   bezier3d ret;
-  int i;
-  for (i=0;i<size();i++)
-    ret+=getspiralarc(i).approx3d(precision);
+  int i,end;
+  for (i=0;i<size();i=end)
+  {
+    end=simplifiedRun(i,precision);
+    if (end>i+1)
+      ret+=chordBezier(i,end);
+    else
+      ret+=getspiralarc(i).approx3d(precision);
+  }
   if (!isopen())
     ret.close();
   return ret;
@@ -247,10 +588,8 @@ void polyline::dedup()
  */
 {
   int h,i,j,k;
-  vector<xy>::iterator ptit;
-  vector<double>::iterator lenit;
-  vector<bcir>::iterator bcit;
   xy avg;
+  modified();
   //if (dist(endpoints[0],xy(999992.534,1499993.823))<0.001)
   //  cout<<"Debug contour\r";
   for (i=0;i<endpoints.size() && endpoints.size()>2;i++)
@@ -276,14 +615,10 @@ void polyline::dedup()
     if (i!=j && (dist(endpoints[i],endpoints[j])*16777216<=dist(endpoints[h],endpoints[i]) || dist(endpoints[i],endpoints[j])*16777216<=dist(endpoints[j],endpoints[k]) || dist(endpoints[i],endpoints[j])*281474976710656.<=dist(endpoints[i],-endpoints[j]) || endpoints[j].isnan()))
     {
       avg=(endpoints[i]+endpoints[j])/2;
-      ptit=endpoints.begin()+i;
-      lenit=lengths.begin()+i;
-      endpoints.erase(ptit);
-      lengths.erase(lenit);
-      lenit=cumLengths.begin()+i;
-      cumLengths.erase(lenit);
-      bcit=boundCircles.begin()+i;
-      boundCircles.erase(bcit);
+      endpoints.erase(i);
+      lengths.erase(i);
+      cumLengths.erase(i);
+      boundCircles.erase(i);
       if (h>i)
 	h--;
       if (k>i)
@@ -316,25 +651,19 @@ void polyline::insert(xy newpoint,int pos)
 {
   bool wasopen;
   int i;
-  vector<xy>::iterator ptit;
-  vector<double>::iterator lenit;
-  vector<bcir>::iterator bcit;
+  modified();
   if (newpoint.isnan())
     cerr<<"Inserting NaN"<<endl;
   wasopen=isopen();
   if (pos<0 || pos>endpoints.size())
     pos=endpoints.size();
-  ptit=endpoints.begin()+pos;
-  lenit=lengths.begin()+pos;
-  endpoints.insert(ptit,newpoint);
-  lengths.insert(lenit,0);
-  bcit=boundCircles.begin()+pos;
-  boundCircles.insert(bcit,{xy(0,0),0});
-  lenit=cumLengths.begin()+pos;
+  endpoints.insert(pos,newpoint);
+  lengths.insert(pos,0);
+  boundCircles.insert(pos,{xy(0,0),0});
   if (pos<cumLengths.size())
-    cumLengths.insert(lenit,cumLengths[pos]);
+    cumLengths.insert(pos,cumLengths[pos]);
   else
-    cumLengths.insert(lenit,0);
+    cumLengths.insert(pos,0);
   pos--;
   if (pos<0)
     if (wasopen)
@@ -362,26 +691,18 @@ void polyarc::insert(xy newpoint,int pos)
   bool wasopen;
   double totdist=0,totdelta=0;
   int i,savepos,newdelta[2];
-  vector<xy>::iterator ptit;
-  vector<int>::iterator arcit;
-  vector<double>::iterator lenit;
-  vector<bcir>::iterator bcit;
+  modified();
   wasopen=isopen();
   if (pos<0 || pos>endpoints.size())
     pos=endpoints.size();
-  ptit=endpoints.begin()+pos;
-  lenit=lengths.begin()+pos;
-  arcit=deltas.begin()+pos;
-  endpoints.insert(ptit,newpoint);
-  deltas.insert(arcit,0);
-  lengths.insert(lenit,0);
-  bcit=boundCircles.begin()+pos;
-  boundCircles.insert(bcit,{xy(0,0),0});
-  lenit=cumLengths.begin()+pos;
+  endpoints.insert(pos,newpoint);
+  deltas.insert(pos,0);
+  lengths.insert(pos,0);
+  boundCircles.insert(pos,{xy(0,0),0});
   if (pos<cumLengths.size())
-    cumLengths.insert(lenit,cumLengths[pos]);
+    cumLengths.insert(pos,cumLengths[pos]);
   else
-    cumLengths.insert(lenit,0);
+    cumLengths.insert(pos,0);
   pos--;
   if (pos<0)
     if (wasopen)
@@ -440,6 +761,7 @@ void polyline::setlengths()
   int i;
   manysum m;
   segment seg;
+  modified();
   assert(lengths.size()==cumLengths.size());
   for (i=0;i<lengths.size();i++)
   {
@@ -456,6 +778,7 @@ void polyarc::setlengths()
   int i;
   manysum m;
   arc seg;
+  modified();
   assert(lengths.size()==cumLengths.size());
   assert(lengths.size()==deltas.size());
   for (i=0;i<deltas.size();i++)
@@ -473,6 +796,7 @@ void polyspiral::setlengths()
   int i;
   manysum m;
   spiralarc seg;
+  modified();
   assert(lengths.size()==cumLengths.size());
   assert(lengths.size()==deltas.size());
   for (i=0;i<deltas.size();i++)
@@ -487,6 +811,7 @@ void polyspiral::setlengths()
 
 void polyarc::setdelta(int i,int delta)
 {
+  modified();
   i%=deltas.size();
   if (i<0)
     i+=deltas.size();
@@ -498,10 +823,41 @@ double polyline::in(xy point)
 /* Returns 1 if the polyline winds once counterclockwise around point.
  * Returns 1/2 or -1/2 if point is on polyline's boundary, unless it
  * is a corner, in which case it returns another fraction.
+ * If the polyline is closed, counts the signed crossings of a ray from
+ * point eastward, looking only at pieces whose circles the ray touches.
+ * If point is on the boundary, or the polyline is open, adds up the
+ * angles subtended by the pieces.
  */
 {
   double ret=0,subtarea;
-  int i,subtended,sz=endpoints.size();
+  int i,j,subtended,sz=endpoints.size(),winding=0;
+  bool onBoundary=isopen();
+  vector<int> pieces;
+  xy a,b;
+  if (!onBoundary && lengths.size())
+  {
+    updateBoundTree();
+    rayPieces(0,0,lengths.size(),point,pieces);
+  }
+  for (j=0;!onBoundary && j<pieces.size();j++)
+  {
+    a=endpoints[pieces[j]];
+    b=endpoints[(pieces[j]+1)%sz];
+    subtarea=area3(a,b,point);
+    if (point==a || point==b || (subtarea==0 &&
+        (point.getx()-a.getx())*(point.getx()-b.getx())<=0 &&
+        (point.gety()-a.gety())*(point.gety()-b.gety())<=0))
+      onBoundary=true;
+    else if (a.gety()<=point.gety())
+    {
+      if (b.gety()>point.gety() && subtarea>0)
+        winding++;
+    }
+    else if (b.gety()<=point.gety() && subtarea<0)
+      winding--;
+  }
+  if (!onBoundary)
+    return winding;
   for (i=0;i<lengths.size();i++)
   {
     if (point!=endpoints[i] && point!=endpoints[(i+1)%sz])
@@ -525,8 +881,9 @@ double polyarc::in(xy point)
 {
   double ret=polyline::in(point);
   int i;
-  for (i=0;i<lengths.size();i++)
-    ret+=getarc(i).in(point);
+  vector<int> pieces=piecesAround(point);
+  for (i=0;i<pieces.size();i++)
+    ret+=getarc(pieces[i]).in(point);
   return ret;
 }
 
@@ -534,8 +891,9 @@ double polyspiral::in(xy point)
 {
   double ret=polyline::in(point);
   int i;
-  for (i=0;i<lengths.size();i++)
-    ret+=getspiralarc(i).in(point);
+  vector<int> pieces=piecesAround(point);
+  for (i=0;i<pieces.size();i++)
+    ret+=getspiralarc(pieces[i]).in(point);
   return ret;
 }
 
@@ -616,82 +974,49 @@ double polyline::closest(xy topoint,bool offends)
  * because of angle points.
  */
 {
-  int i,n,step,sz;
-  double segclose,closesofar=INFINITY;
-  segment si;
-  xy sta;
-  double alo,ret;
-  sz=lengths.size();
-  step=relprime(sz);
-  for (i=n=0;i<sz;i++,n=(n+step)%sz)
+  double ret;
+  closestPiece(topoint,[&](int n,double closesofar)
   {
-    if (dist(boundCircles[n].center,topoint)-boundCircles[n].radius<closesofar)
-    {
-      si=getsegment(n);
-      alo=si.closest(topoint,closesofar,true);
-      sta=si.station(alo);
-      segclose=dist(sta,topoint);
-      if (segclose<closesofar)
-      {
-	closesofar=segclose;
-	ret=alo+(cumLengths[n]-lengths[n]);
-      }
-    }
-  }
+    segment si=getsegment(n);
+    double alo,segclose;
+    alo=si.closest(topoint,closesofar,true);
+    segclose=dist(si.station(alo),topoint);
+    if (segclose<closesofar)
+      ret=alo+(cumLengths[n]-lengths[n]);
+    return segclose;
+  });
   return ret;
 }
 
 double polyarc::closest(xy topoint,bool offends)
 {
-  int i,n,step,sz;
-  double segclose,closesofar=INFINITY;
-  arc si;
-  xy sta;
-  double alo,ret;
-  sz=lengths.size();
-  step=relprime(sz);
-  for (i=n=0;i<sz;i++,n=(n+step)%sz)
+  double ret;
+  closestPiece(topoint,[&](int n,double closesofar)
   {
-    if (dist(boundCircles[n].center,topoint)-boundCircles[n].radius<closesofar)
-    {
-      si=getarc(n);
-      alo=si.closest(topoint,closesofar,true);
-      sta=si.station(alo);
-      segclose=dist(sta,topoint);
-      if (segclose<closesofar)
-      {
-	closesofar=segclose;
-	ret=alo+(cumLengths[n]-lengths[n]);
-      }
-    }
-  }
+    arc si=getarc(n);
+    double alo,segclose;
+    alo=si.closest(topoint,closesofar,true);
+    segclose=dist(si.station(alo),topoint);
+    if (segclose<closesofar)
+      ret=alo+(cumLengths[n]-lengths[n]);
+    return segclose;
+  });
   return ret;
 }
 
 double polyspiral::closest(xy topoint,bool offends)
 {
-  int i,n,step,sz;
-  double segclose,closesofar=INFINITY;
-  spiralarc si;
-  xy sta;
-  double alo,ret;
-  sz=lengths.size();
-  step=relprime(sz);
-  for (i=n=0;i<sz;i++,n=(n+step)%sz)
+  double ret;
+  closestPiece(topoint,[&](int n,double closesofar)
   {
-    if (dist(boundCircles[n].center,topoint)-boundCircles[n].radius<closesofar)
-    {
-      si=getspiralarc(n);
-      alo=si.closest(topoint,closesofar,true);
-      sta=si.station(alo);
-      segclose=dist(sta,topoint);
-      if (segclose<closesofar)
-      {
-	closesofar=segclose;
-	ret=alo+(cumLengths[n]-lengths[n]);
-      }
-    }
-  }
+    spiralarc si=getspiralarc(n);
+    double alo,segclose;
+    alo=si.closest(topoint,closesofar,true);
+    segclose=dist(si.station(alo),topoint);
+    if (segclose<closesofar)
+      ret=alo+(cumLengths[n]-lengths[n]);
+    return segclose;
+  });
   return ret;
 }
 
@@ -750,45 +1075,31 @@ double polyspiral::area()
 
 double polyline::dirbound(int angle,double boundsofar)
 {
-  int i;
-  double bound;
-  for (i=0;i<lengths.size();i++)
+  return dirboundPieces(angle,boundsofar,[&](int n,double boundsofar)
   {
-    bound=getsegment(i).dirbound(angle,boundsofar);
-    if (bound<boundsofar)
-      boundsofar=bound;
-  }
-  return boundsofar;
+    return getsegment(n).dirbound(angle,boundsofar);
+  });
 }
 
 double polyarc::dirbound(int angle,double boundsofar)
 {
-  int i;
-  double bound;
-  for (i=0;i<lengths.size();i++)
+  return dirboundPieces(angle,boundsofar,[&](int n,double boundsofar)
   {
-    bound=getarc(i).dirbound(angle,boundsofar);
-    if (bound<boundsofar)
-      boundsofar=bound;
-  }
-  return boundsofar;
+    return getarc(n).dirbound(angle,boundsofar);
+  });
 }
 
 double polyspiral::dirbound(int angle,double boundsofar)
 {
-  int i;
-  double bound;
-  for (i=0;i<lengths.size();i++)
+  return dirboundPieces(angle,boundsofar,[&](int n,double boundsofar)
   {
-    bound=getspiralarc(i).dirbound(angle,boundsofar);
-    if (bound<boundsofar)
-      boundsofar=bound;
-  }
-  return boundsofar;
+    return getspiralarc(n).dirbound(angle,boundsofar);
+  });
 }
 
 void polyline::open()
 {
+  modified();
   lengths.resize(endpoints.size()-1);
   cumLengths.resize(endpoints.size()-1);
   boundCircles.resize(endpoints.size()-1);
@@ -796,6 +1107,7 @@ void polyline::open()
 
 void polyarc::open()
 {
+  modified();
   deltas.resize(endpoints.size()-1);
   lengths.resize(endpoints.size()-1);
   cumLengths.resize(endpoints.size()-1);
@@ -804,6 +1116,7 @@ void polyarc::open()
 
 void polyspiral::open()
 {
+  modified();
   curvatures.resize(endpoints.size()-1);
   clothances.resize(endpoints.size()-1);
   midpoints.resize(endpoints.size()-1);
@@ -817,6 +1130,7 @@ void polyspiral::open()
 
 void polyline::close()
 {
+  modified();
   lengths.resize(endpoints.size());
   cumLengths.resize(endpoints.size());
   boundCircles.resize(endpoints.size());
@@ -829,6 +1143,7 @@ void polyline::close()
 
 void polyarc::close()
 {
+  modified();
   deltas.resize(endpoints.size());
   lengths.resize(endpoints.size());
   cumLengths.resize(endpoints.size());
@@ -842,6 +1157,7 @@ void polyarc::close()
 
 void polyspiral::close()
 {
+  modified();
   curvatures.resize(endpoints.size());
   clothances.resize(endpoints.size());
   midpoints.resize(endpoints.size());
@@ -875,10 +1191,7 @@ void polyspiral::insert(xy newpoint,int pos)
 {
   bool wasopen;
   int i,savepos,newBearing=0;
-  vector<xy>::iterator ptit,midit;
-  vector<int>::iterator arcit,brgit,d2it,mbrit;
-  vector<double>::iterator lenit,cloit,crvit;
-  vector<bcir>::iterator bcit;
+  modified();
   wasopen=isopen();
   if (pos<0 || pos>endpoints.size())
     pos=endpoints.size();
@@ -887,8 +1200,6 @@ void polyspiral::insert(xy newpoint,int pos)
       newBearing=bearings[pos];
     else
       newBearing=bearings[pos-1];
-  ptit=endpoints.begin()+pos;
-  brgit=bearings.begin()+pos;
   savepos=pos;
   pos--;
   if (pos<0)
@@ -896,26 +1207,17 @@ void polyspiral::insert(xy newpoint,int pos)
       pos=0;
     else
       pos+=endpoints.size();
-  midit=midpoints.begin()+pos;
-  lenit=lengths.begin()+pos;
-  arcit=deltas.begin()+pos;
-  d2it=delta2s.begin()+pos;
-  mbrit=midbearings.begin()+pos;
-  cloit=clothances.begin()+pos;
-  crvit=curvatures.begin()+pos;
-  endpoints.insert(ptit,newpoint);
-  deltas.insert(arcit,0);
-  lengths.insert(lenit,1);
-  midpoints.insert(midit,newpoint);
-  bearings.insert(brgit,newBearing);
-  delta2s.insert(d2it,0);
-  midbearings.insert(mbrit,0);
-  curvatures.insert(crvit,0);
-  clothances.insert(cloit,0);
-  lenit=cumLengths.begin()+pos;
-  cumLengths.insert(lenit,0);
-  bcit=boundCircles.begin()+pos;
-  boundCircles.insert(bcit,{xy(0,0),0});
+  endpoints.insert(savepos,newpoint);
+  deltas.insert(pos,0);
+  lengths.insert(pos,1);
+  midpoints.insert(pos,newpoint);
+  bearings.insert(savepos,newBearing);
+  delta2s.insert(pos,0);
+  midbearings.insert(pos,0);
+  curvatures.insert(pos,0);
+  clothances.insert(pos,0);
+  cumLengths.insert(pos,0);
+  boundCircles.insert(pos,{xy(0,0),0});
   pos=savepos;
   for (i=-1;i<2;i++)
     setbear((pos+i+endpoints.size())%endpoints.size());
@@ -926,6 +1228,7 @@ void polyspiral::insert(xy newpoint,int pos)
 void polyline::_roscat(xy tfrom,int ro,double sca,xy cis,xy tto)
 {
   int i;
+  modified();
   for (i=0;i<endpoints.size();i++)
     endpoints[i]._roscat(tfrom,ro,sca,cis,tto);
   for (i=0;i<lengths.size();i++)
@@ -935,6 +1238,7 @@ void polyline::_roscat(xy tfrom,int ro,double sca,xy cis,xy tto)
 void polyspiral::_roscat(xy tfrom,int ro,double sca,xy cis,xy tto)
 {
   int i;
+  modified();
   for (i=0;i<endpoints.size();i++)
   {
     endpoints[i]._roscat(tfrom,ro,sca,cis,tto);
@@ -953,6 +1257,7 @@ void polyspiral::_roscat(xy tfrom,int ro,double sca,xy cis,xy tto)
 void polyspiral::setbear(int i)
 {
   int h,j,prevbear,nextbear,avgbear;
+  modified();
   i%=endpoints.size();
   if (i<0)
     i+=endpoints.size();
@@ -995,6 +1300,7 @@ void polyspiral::setbear(int i)
 
 void polyspiral::setbear(int i,int bear)
 {
+  modified();
   i%=endpoints.size();
   if (i<0)
     i+=endpoints.size();
@@ -1005,6 +1311,7 @@ void polyspiral::setspiral(int i)
 {
   int j,d1,d2;
   spiralarc s;
+  modified();
   j=i+1;
   if (j>=endpoints.size())
     j=0;
@@ -1032,6 +1339,7 @@ void polyspiral::setspiral(int i)
 void polyspiral::smooth()
 {
   int i;
+  modified();
   curvy=true;
   for (i=0;i<endpoints.size();i++)
     setbear(i);
@@ -1240,6 +1548,8 @@ void alignment::appendPoint(xy pnt)
   {
     deltas.push_back(0);
     delta2s.push_back(0);
+    curvatures.push_back(0);
+    clothances.push_back(0);
     midbearings.push_back(dir(last,pnt));
     midpoints.push_back((last+pnt)/2);
     hLengths.push_back(dist(last,pnt));
@@ -1264,6 +1574,8 @@ void alignment::prependPoint(xy pnt)
   {
     deltas.insert(deltas.begin(),0);
     delta2s.insert(delta2s.begin(),0);
+    curvatures.insert(curvatures.begin(),0);
+    clothances.insert(clothances.begin(),0);
     midbearings.insert(midbearings.begin(),dir(pnt,first));
     midpoints.insert(midpoints.begin(),(pnt+first)/2);
     hLengths.insert(hLengths.begin(),dist(pnt,first));
@@ -1286,6 +1598,8 @@ void alignment::appendTangentCurve(double startCurvature,double length,double en
   appendPoint(newSpiral.getend());
   deltas.back()=newSpiral.getdelta();
   delta2s.back()=newSpiral.getdelta2();
+  curvatures.back()=newSpiral.curvature(length/2);
+  clothances.back()=newSpiral.clothance();
   midbearings.back()=newSpiral.bearing(length/2);
   midpoints.back()=newSpiral.station(length/2);
   hLengths.back()=length;
@@ -1307,6 +1621,8 @@ void alignment::prependTangentCurve(double startCurvature,double length,double e
   prependPoint(newSpiral.getend());
   deltas[0]=-newSpiral.getdelta();
   delta2s[0]=newSpiral.getdelta2();
+  curvatures[0]=-newSpiral.curvature(length/2);
+  clothances[0]=newSpiral.clothance();
   midbearings[0]=newSpiral.bearing(length/2)-DEG180;
   midpoints[0]=newSpiral.station(length/2);
   hLengths[0]=length;
@@ -1415,7 +1731,7 @@ void alignment::setHLengths()
 int alignment::xyStationSegment(double along)
 {
   int before=-1,after=hCumLengths.size();
-  int middle,i;
+  int middle,i=0;
   double midalong;
   while (before<after-1)
   {
@@ -1432,13 +1748,15 @@ int alignment::xyStationSegment(double along)
       before=middle;
     ++i;
   }
+  if (before>=hLengths.size() && hLengths.size() && along==endStation())
+    before=hLengths.size()-1; // The end station is on the last curve.
   return before; // Unlike polylines, hCumLengths and vCumLengths have an extra number at the beginning.
 }
 
 int alignment::zStationSegment(double along)
 {
   int before=-1,after=vCumLengths.size();
-  int middle,i;
+  int middle,i=0;
   double midalong;
   while (before<after-1)
   {
@@ -1455,6 +1773,8 @@ int alignment::zStationSegment(double along)
       before=middle;
     ++i;
   }
+  if (before>=vLengths.size() && vLengths.size() && along==endStation())
+    before=vLengths.size()-1;
   return before;
 }
 
@@ -1464,16 +1784,16 @@ xy alignment::xyStation(double along)
   if (seg<0 || seg>=hLengths.size())
     return xy(NAN,NAN);
   else
-    return getHorizontalCurve(seg).station(along-cumLengths[seg]);
+    return getHorizontalCurve(seg).station(along-hCumLengths[seg]);
 }
 
 double alignment::zStation(double along)
 {
   int seg=zStationSegment(along);
-  if (seg<0 || seg>=hLengths.size())
+  if (seg<0 || seg>=vLengths.size())
     return NAN;
   else
-    return getVerticalCurve(seg).station(along-cumLengths[seg]).elev();
+    return getVerticalCurve(seg).station(along-vCumLengths[seg]).elev();
 }
 
 xyz alignment::station(double along)
@@ -1487,16 +1807,16 @@ int alignment::bearing(double along)
   if (seg<0 || seg>=hLengths.size())
     return 0;
   else
-    return getHorizontalCurve(seg).bearing(along-cumLengths[seg]);
+    return getHorizontalCurve(seg).bearing(along-hCumLengths[seg]);
 }
 
 double alignment::slope(double along)
 {
   int seg=zStationSegment(along);
-  if (seg<0 || seg>=hLengths.size())
+  if (seg<0 || seg>=vLengths.size())
     return NAN;
   else
-    return getVerticalCurve(seg).slope(along-cumLengths[seg]);
+    return getVerticalCurve(seg).slope(along-vCumLengths[seg]);
 }
 
 double alignment::curvature(double along)
@@ -1505,16 +1825,16 @@ double alignment::curvature(double along)
   if (seg<0 || seg>=hLengths.size())
     return NAN;
   else
-    return getHorizontalCurve(seg).curvature(along-cumLengths[seg]);
+    return getHorizontalCurve(seg).curvature(along-hCumLengths[seg]);
 }
 
 double alignment::accel(double along)
 {
   int seg=zStationSegment(along);
-  if (seg<0 || seg>=hLengths.size())
+  if (seg<0 || seg>=vLengths.size())
     return NAN;
   else
-    return getVerticalCurve(seg).accel(along-cumLengths[seg]);
+    return getVerticalCurve(seg).accel(along-vCumLengths[seg]);
 }
 
 double alignment::clothance(double along)
@@ -1529,8 +1849,153 @@ double alignment::clothance(double along)
 double alignment::jerk(double along)
 {
   int seg=zStationSegment(along);
-  if (seg<0 || seg>=hLengths.size())
+  if (seg<0 || seg>=vLengths.size())
     return NAN;
   else
     return getVerticalCurve(seg).jerk();
 }
+
+vector<xyz> alignment::stations(double from,double to,double step)
+/* Returns the stations from from to to, step apart, in time proportional
+ * to the number of stations plus the number of curves they pass through.
+ * Any station outside the alignment is NaN.
+ */
+{
+  vector<xyz> ret;
+  AlignmentCursor cur(*this);
+  double along;
+  int i,n;
+  if (step>0 && to>=from)
+  {
+    n=floor((to-from)/step+1e-9)+1;
+    ret.reserve(n);
+    for (i=0;i<n;i++)
+    {
+      along=from+i*step;
+      cur.seek(along);
+      ret.push_back(cur.station());
+    }
+  }
+  return ret;
+}
+
+AlignmentCursor::AlignmentCursor(alignment &a)
+{
+  al=&a;
+  hseg=vseg=-1;
+  along=NAN;
+  xypos=xy(NAN,NAN);
+  nchords=0;
+}
+
+bool AlignmentCursor::findSegment(const vector<double> &cumLengths,int n,int &seg,double along)
+/* Moves seg forward or backward until it is the curve containing along.
+ * Returns true if seg changed. If along is off the alignment, seg is -1.
+ */
+{
+  int oldseg=seg;
+  if (n==0 || !(along>=cumLengths[0] && along<=cumLengths[n]))
+    seg=-1;
+  else
+  {
+    if (seg<0)
+      seg=0;
+    while (seg<n-1 && along>=cumLengths[seg+1])
+      seg++;
+    while (seg>0 && along<cumLengths[seg])
+      seg--;
+  }
+  return seg!=oldseg;
+}
+
+void AlignmentCursor::seek(double newAlong,bool exact)
+/* If exact is true, computes the station exactly instead of adding a chord.
+ * Two cursors that seek exactly to the same station, then step through the
+ * same stations, get the same positions to the last bit.
+ */
+{
+  double step=newAlong-along,s0,s1,midcur,clo,fromMid;
+  xy chord,rot;
+  int midbear;
+  bool newCurve=findSegment(al->hCumLengths,al->hLengths.size(),hseg,newAlong);
+  if (findSegment(al->vCumLengths,al->vLengths.size(),vseg,newAlong) && vseg>=0)
+    vcurve=al->getVerticalCurve(vseg);
+  if (newCurve && hseg>=0)
+    hcurve=al->getHorizontalCurve(hseg);
+  if (hseg<0)
+    xypos=xy(NAN,NAN);
+  else
+  {
+    s1=newAlong-al->hCumLengths[hseg];
+    s0=s1-step;
+    midcur=hcurve.curvature((s0+s1)/2);
+    clo=hcurve.clothance();
+    if (!exact && !newCurve && nchords<ALIGN_RESYNC && std::isfinite(step) &&
+        fabs(midcur*step)<ALIGN_CHORD_ANGLE && fabs(clo*sqr(step))<ALIGN_CHORD_ANGLE)
+    {
+      /* The chord of a piece of spiral of length h, in the direction of the
+       * bearing at its middle, is h(1-c²h²/24, kh²/24) to the fourth order,
+       * where c is the curvature at the middle and k is the clothance.
+       */
+      midbear=hcurve.bearing(hcurve.length()/2);
+      fromMid=(s0+s1-hcurve.length())/2;
+      rot=cossin(hcurve.curvature(hcurve.length()/2)*fromMid+clo*sqr(fromMid)/2);
+      chord=xy(step*(1-sqr(midcur*step)/24),step*clo*sqr(step)/24);
+      chord=xy(chord.getx()*rot.getx()-chord.gety()*rot.gety(),
+	       chord.getx()*rot.gety()+chord.gety()*rot.getx());
+      xypos+=turn(chord,midbear);
+      nchords++;
+    }
+    else
+    {
+      xypos=hcurve.station(s1);
+      nchords=0;
+    }
+  }
+  along=newAlong;
+}
+
+double AlignmentCursor::zStation()
+{
+  if (vseg<0)
+    return NAN;
+  else
+    return vcurve.station(along-al->vCumLengths[vseg]).elev();
+}
+
+xyz AlignmentCursor::station()
+{
+  return xyz(xypos,zStation());
+}
+
+int AlignmentCursor::bearing()
+{
+  if (hseg<0)
+    return 0;
+  else
+    return hcurve.bearing(along-al->hCumLengths[hseg]);
+}
+
+double AlignmentCursor::curvature()
+{
+  if (hseg<0)
+    return NAN;
+  else
+    return hcurve.curvature(along-al->hCumLengths[hseg]);
+}
+
+double AlignmentCursor::clothance()
+{
+  if (hseg<0)
+    return NAN;
+  else
+    return hcurve.clothance();
+}
+
+double AlignmentCursor::slope()
+{
+  if (vseg<0)
+    return NAN;
+  else
+    return vcurve.slope(along-al->vCumLengths[vseg]);
+}
@@ -25,7 +25,9 @@
 #define POLYLINE_H
 
 #include <vector>
+#include <functional>
 #include "point.h"
+#include "gapvector.h"
 #include "xyz.h"
 #include "arc.h"
 #include "bezier3d.h"
@@ -50,9 +52,36 @@ class polyline: public drawobj
 {
 protected:
   double elevation;
-  std::vector<xy> endpoints;
-  std::vector<double> lengths,cumLengths;
-  std::vector<bcir> boundCircles;
+  gapvector<xy> endpoints;
+  gapvector<double> lengths,cumLengths;
+  gapvector<bcir> boundCircles;
+  unsigned version,hashedVersion,cachedHash;
+  std::vector<bcir> boundTree;
+  /* Circles around ranges of pieces, made from pieceCircle, built when first
+   * needed after a change. Node 0 covers all pieces; the children of node k
+   * covering [b,e) are 2k+1 covering [b,(b+e)/2) and 2k+2 covering the rest.
+   */
+  unsigned treeVersion;
+  void modified()
+  {
+    version++;
+  }
+  virtual unsigned computeHash();
+  bcir pieceCircle(int i);
+  bcir buildBoundTree(int node,int begin,int end);
+  void nearestPieces(int node,int begin,int end,xy topoint,double &closesofar,
+                     std::function<double(int,double)> &pieceClose);
+  void closestPiece(xy topoint,std::function<double(int,double)> pieceClose);
+  void rayPieces(int node,int begin,int end,xy point,std::vector<int> &pieces);
+  void coveringPieces(int node,int begin,int end,xy point,std::vector<int> &pieces);
+  void overlapPieces(int node,int begin,int end,bcir c,std::vector<int> &pieces);
+  std::vector<int> piecesAround(xy point);
+  void boundPieces(int node,int begin,int end,xy dir,double &boundsofar,
+                   std::function<double(int,double)> &pieceBound);
+  double dirboundPieces(int angle,double boundsofar,std::function<double(int,double)> pieceBound);
+  bool runFits(int start,int end,double precision);
+  int simplifiedRun(int start,double precision);
+  bezier3d chordBezier(int start,int end);
 public:
   friend class polyarc;
   friend class polyspiral;
@@ -63,13 +92,27 @@ public:
     return elevation;
   }
   virtual unsigned hash();
+  unsigned getVersion()
+  {
+    return version;
+  }
   bool isopen();
   int size();
   segment getsegment(int i);
+  virtual spiralarc getPiece(int i);
   xyz getEndpoint(int i);
   xyz getstart();
   xyz getend();
   void dedup();
+  bcir boundCircle();
+  void updateBoundTree();
+  /* The queries that use the tree (in, closest, dirbound, overlappingPieces,
+   * and the like) rebuild it first if the polyline has changed, which writes
+   * to the polyline. Before querying one polyline from several threads, call
+   * updateBoundTree on one thread; the queries then only read it until the
+   * polyline is next changed.
+   */
+  std::vector<int> overlappingPieces(bcir c);
   virtual bezier3d approx3d(double precision);
   virtual std::vector<drawingElement> render3d(double precision,int layer,int color,int width,int linetype);
   virtual void insert(xy newpoint,int pos=-1);
@@ -92,14 +135,15 @@ public:
 class polyarc: public polyline
 {
 protected:
-  std::vector<int> deltas;
+  gapvector<int> deltas;
+  virtual unsigned computeHash();
 public:
   friend class polyspiral;
   polyarc();
   polyarc(double e);
   polyarc(polyline &p);
-  virtual unsigned hash();
   arc getarc(int i);
+  virtual spiralarc getPiece(int i);
   virtual bezier3d approx3d(double precision);
   virtual void insert(xy newpoint,int pos=-1);
   void setdelta(int i,int delta);
@@ -117,18 +161,19 @@ public:
 class polyspiral: public polyarc
 {
 protected:
-  std::vector<int> bearings; // correspond to endpoints
-  std::vector<int> delta2s;
-  std::vector<int> midbearings;
-  std::vector<xy> midpoints;
-  std::vector<double> clothances,curvatures;
+  gapvector<int> bearings; // correspond to endpoints
+  gapvector<int> delta2s;
+  gapvector<int> midbearings;
+  gapvector<xy> midpoints;
+  gapvector<double> clothances,curvatures;
   bool curvy;
+  virtual unsigned computeHash();
 public:
   polyspiral();
   polyspiral(double e);
   polyspiral(polyline &p);
-  virtual unsigned hash();
   spiralarc getspiralarc(int i);
+  virtual spiralarc getPiece(int i);
   virtual bezier3d approx3d(double precision);
   virtual void insert(xy newpoint,int pos=-1);
   void setbear(int i);
@@ -177,6 +222,7 @@ protected:
   void setlengths();
   int xyStationSegment(double along);
   int zStationSegment(double along);
+  friend class AlignmentCursor;
 public:
   alignment();
   void clear();
@@ -202,6 +248,53 @@ public:
   double accel(double along);
   double clothance(double along);
   double jerk(double along);
+  std::vector<xyz> stations(double from,double to,double step);
+};
+
+#define ALIGN_CHORD_ANGLE 1e-3
+/* Largest angle, in radians, through which the bearing may turn in one step
+ * for AlignmentCursor to add a chord instead of computing the spiral.
+ */
+#define ALIGN_RESYNC 64
+// Number of chords added in a row before computing the spiral again
+
+class AlignmentCursor
+/* Evaluates an alignment at a sequence of stations, usually a constant step
+ * apart. It keeps the horizontal and vertical curves that it is on, so
+ * moving to a nearby station takes constant time instead of a search.
+ * When the step is small compared to the radius of curvature, the next
+ * station is found by adding the chord of the step to the last station,
+ * which is much faster than computing the Cornu spiral. Every ALIGN_RESYNC
+ * steps, at the start of every curve, and when asked, the station is computed
+ * exactly.
+ */
+{
+public:
+  AlignmentCursor(alignment &a);
+  void seek(double along,bool exact=false);
+  double getAlong()
+  {
+    return along;
+  }
+  xy xyStation()
+  {
+    return xypos;
+  }
+  double zStation();
+  xyz station();
+  int bearing();
+  double curvature();
+  double clothance();
+  double slope();
+private:
+  alignment *al;
+  int hseg,vseg;
+  spiralarc hcurve;
+  segment vcurve;
+  double along;
+  xy xypos;
+  int nchords;
+  bool findSegment(const std::vector<double> &cumLengths,int n,int &seg,double along);
 };
 
 #endif
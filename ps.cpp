@@ -29,8 +29,12 @@
 #include <string>
 #include <cassert>
 #include <iomanip>
+#include <cctype>
 #include "ldecimal.h"
 #include "config.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "ps.h"
 #include "point.h"
 #include "pointlist.h"
@@ -39,6 +43,23 @@ using namespace std;
 
 #define PAPERRES 0.004
 
+// Recorded operations. Coordinates are already scaled to the paper.
+#define PS_COLOR 0
+#define PS_DOT 1
+#define PS_CIRCLE 2
+#define PS_ARROW 3
+#define PS_LINE 4
+#define PS_NEWPATH 5
+#define PS_MOVETO 6
+#define PS_LINETO 7
+#define PS_CURVETO 8
+#define PS_STROKE 9
+#define PS_FILL 10
+#define PS_WIDEN 11
+#define PS_WRITE 12
+#define PS_CENTERWRITE 13
+#define PS_COMMENT 14
+
 char rscales[]={10,12,15,20,25,30,40,50,60,80};
 const double PSPoint=25.4/72;
 map<string,papersize> papersizes=
@@ -83,14 +104,321 @@ bool isstraight(vector<xyz> seg)
   return ret;
 }
 
+const short helveticaWidths[]=
+// Widths of ASCII characters 32-126 in Helvetica, in thousandths of an em
+{
+  278,278,355,556,556,889,667,222,333,333,389,584,278,333,278,278,
+  556,556,556,556,556,556,556,556,556,556,278,278,584,584,584,556,
+  1015,667,667,722,722,667,611,778,722,278,500,667,556,833,722,778,
+  667,778,722,667,611,722,667,944,667,667,611,278,278,278,469,556,
+  222,556,556,500,556,556,278,556,556,222,222,500,222,833,556,556,
+  556,556,333,500,278,556,500,722,500,500,500,334,260,334,584
+};
+
+double textWidth(string text,double fontsize)
+{
+  int i,ch;
+  double ret=0;
+  for (i=0;i<text.length();i++)
+  {
+    ch=text[i]&255;
+    if (ch>=32 && ch<127)
+      ret+=helveticaWidths[ch-32];
+    else
+      ret+=556;
+  }
+  return ret*fontsize/1000;
+}
+
+void appendNums(string &buf,const double *nums,int n)
+{
+  int i;
+  for (i=0;i<n;i++)
+  {
+    appendLdecimal(buf,nums[i],PAPERRES);
+    buf+=' ';
+  }
+}
+
+void appendPdfCircle(string &buf,double x,double y,double r)
+// Four Bézier arcs, filled
+{
+  double k=r*0.5522847498307936;
+  double nums[26]=
+  {
+    x+r,y,
+    x+r,y+k,x+k,y+r,x,y+r,
+    x-k,y+r,x-r,y+k,x-r,y,
+    x-r,y-k,x-k,y-r,x,y-r,
+    x+k,y-r,x+r,y-k,x+r,y
+  };
+  appendNums(buf,nums,2);
+  buf+="m ";
+  appendNums(buf,nums+2,6);
+  buf+="c ";
+  appendNums(buf,nums+8,6);
+  buf+="c ";
+  appendNums(buf,nums+14,6);
+  buf+="c ";
+  appendNums(buf,nums+20,6);
+  buf+="c f\n";
+}
+
+void formatPsOps(const PsPage &page,size_t start,size_t end,string &buf)
+{
+  size_t i;
+  for (i=start;i<end;i++)
+  {
+    const PsOp &o=page.ops[i];
+    switch (o.op)
+    {
+      case PS_COLOR:
+	appendLdecimal(buf,o.num[0],0.0005);
+	buf+=' ';
+	appendLdecimal(buf,o.num[1],0.0005);
+	buf+=' ';
+	appendLdecimal(buf,o.num[2],0.0005);
+	buf+=" col\n";
+	break;
+      case PS_DOT:
+	appendNums(buf,o.num,2);
+	buf+='.';
+	if (o.text.length())
+	  buf+=" %"+o.text;
+	buf+='\n';
+	break;
+      case PS_CIRCLE:
+	appendNums(buf,o.num,2);
+	buf+="n ";
+	appendNums(buf,o.num+2,1);
+	buf+="0 360 af %"+o.text+'\n';
+	break;
+      case PS_ARROW:
+	buf+="n ";
+	appendNums(buf,o.num,2);
+	buf+="m ";
+	appendNums(buf,o.num+2,2);
+	buf+="l ";
+	appendNums(buf,o.num+4,2);
+	buf+="l closepath fill\n";
+	break;
+      case PS_LINE:
+	appendNums(buf,o.num,4);
+	buf+="-\n";
+	break;
+      case PS_NEWPATH:
+	buf+="n\n";
+	break;
+      case PS_MOVETO:
+	appendNums(buf,o.num,2);
+	buf+="m\n";
+	break;
+      case PS_LINETO:
+	appendNums(buf,o.num,2);
+	buf+="l\n";
+	break;
+      case PS_CURVETO:
+	appendNums(buf,o.num,6);
+	buf+="c\n";
+	break;
+      case PS_STROKE:
+	buf+=o.num[0]?"closepath s\n":"s\n";
+	break;
+      case PS_FILL:
+	buf+="fill\n";
+	break;
+      case PS_WIDEN:
+	buf+="currentlinewidth ";
+	appendLdecimal(buf,o.num[0]);
+	buf+=" mul setlinewidth\n";
+	break;
+      case PS_WRITE:
+	appendNums(buf,o.num,2);
+	buf+="m ("+o.text+") show\n";
+	break;
+      case PS_CENTERWRITE:
+	appendNums(buf,o.num,2);
+	buf+="m ("+o.text+") c.\n";
+	break;
+      case PS_COMMENT:
+	buf+='%'+o.text+'\n';
+	break;
+    }
+  }
+}
+
+void formatPdfOps(const PsPage &page,size_t start,size_t end,string &buf)
+/* PDF has no procedures, so dots and circles are drawn with Bézier arcs
+ * and centered text uses the Helvetica character widths. Operations
+ * before the page starts, other than comments, are dropped.
+ */
+{
+  size_t i;
+  double linewidth=0.1;
+  for (i=start;i<end;i++)
+  {
+    const PsOp &o=page.ops[i];
+    if (i<page.startOp && o.op!=PS_COMMENT)
+      continue;
+    switch (o.op)
+    {
+      case PS_COLOR:
+	appendNums(buf,o.num,3);
+	buf+="RG ";
+	appendNums(buf,o.num,3);
+	buf+="rg\n";
+	break;
+      case PS_DOT:
+	appendPdfCircle(buf,o.num[0],o.num[1],0.1);
+	break;
+      case PS_CIRCLE:
+	appendPdfCircle(buf,o.num[0],o.num[1],o.num[2]);
+	break;
+      case PS_ARROW:
+	appendNums(buf,o.num,2);
+	buf+="m ";
+	appendNums(buf,o.num+2,2);
+	buf+="l ";
+	appendNums(buf,o.num+4,2);
+	buf+="l h f\n";
+	break;
+      case PS_LINE:
+	appendNums(buf,o.num,2);
+	buf+="m ";
+	appendNums(buf,o.num+2,2);
+	buf+="l S\n";
+	break;
+      case PS_NEWPATH:
+	break;
+      case PS_MOVETO:
+	appendNums(buf,o.num,2);
+	buf+="m\n";
+	break;
+      case PS_LINETO:
+	appendNums(buf,o.num,2);
+	buf+="l\n";
+	break;
+      case PS_CURVETO:
+	appendNums(buf,o.num,6);
+	buf+="c\n";
+	break;
+      case PS_STROKE:
+	buf+=o.num[0]?"h S\n":"S\n";
+	break;
+      case PS_FILL:
+	buf+="f\n";
+	break;
+      case PS_WIDEN:
+	linewidth*=o.num[0];
+	appendLdecimal(buf,linewidth);
+	buf+=" w\n";
+	break;
+      case PS_WRITE:
+      case PS_CENTERWRITE:
+	buf+="BT /F1 3 Tf ";
+	appendLdecimal(buf,o.num[0]-((o.op==PS_CENTERWRITE)?textWidth(o.text,3)/2:0),PAPERRES);
+	buf+=' ';
+	appendLdecimal(buf,o.num[1],PAPERRES);
+	buf+=" Td ("+o.text+") Tj ET\n";
+	break;
+      case PS_COMMENT:
+	buf+='%'+o.text+'\n';
+	break;
+    }
+  }
+}
+
+FormattedPage formatPage(PsPage page,bool pdf)
+/* Runs in a worker thread if the PostScript object has threads. It reads
+ * nothing but page.
+ */
+{
+  FormattedPage ret;
+  string content,dictionary;
+  double cx,cy,c,s;
+  size_t i;
+  int obj=2*page.number+2;
+  ret.number=page.number;
+  ret.contentOffset=0;
+  ret.text.reserve(page.ops.size()*32+256);
+  if (pdf)
+  {
+    if (page.number)
+    {
+      content.reserve(page.ops.size()*32+256);
+      cx=page.paper.getx()/2;
+      cy=page.paper.gety()/2;
+      c=(page.orientation&1)?0:((page.orientation&2)?-1:1);
+      s=(page.orientation&1)?((page.orientation&2)?-1:1):0;
+      content="q ";
+      appendLdecimal(content,720/254.);
+      content+=" 0 0 ";
+      appendLdecimal(content,720/254.);
+      content+=" 0 0 cm\n";
+      content+=ldecimal(c)+' '+ldecimal(s)+' '+ldecimal(0-s)+' '+ldecimal(c)+' ';
+      appendLdecimal(content,cx-c*cx+s*cy,PAPERRES);
+      content+=' ';
+      appendLdecimal(content,cy-s*cx-c*cy,PAPERRES);
+      content+=" cm 0.1 w\n";
+      formatPdfOps(page,0,page.ops.size(),content);
+      content+="Q\n";
+#ifdef HAVE_ZLIB
+      uLongf zlen=compressBound(content.length());
+      string zcontent(zlen,'\0');
+      if (compress((Bytef *)&zcontent[0],&zlen,(const Bytef *)content.data(),content.length())==Z_OK)
+      {
+	zcontent.resize(zlen);
+	content.swap(zcontent);
+	dictionary=" /Filter /FlateDecode";
+      }
+#endif
+      ret.text=to_string(obj)+" 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 ";
+      appendLdecimal(ret.text,page.paper.getx()*36e1/127,PAPERRES);
+      ret.text+=' ';
+      appendLdecimal(ret.text,page.paper.gety()*36e1/127,PAPERRES);
+      ret.text+="] /Resources << /Font << /F1 3 0 R >> >> /Contents "+to_string(obj+1)+" 0 R >>\nendobj\n";
+      ret.contentOffset=ret.text.length();
+      ret.text+=to_string(obj+1)+" 0 obj\n<< /Length "+to_string(content.length())+dictionary+" >>\nstream\n";
+      ret.text+=content;
+      ret.text+="\nendstream\nendobj\n";
+    }
+    else // after the last page, there is no content stream; keep only comments
+      for (i=0;i<page.ops.size();i++)
+	if (page.ops[i].op==PS_COMMENT)
+	  ret.text+='%'+page.ops[i].text+'\n';
+  }
+  else
+  {
+    formatPsOps(page,0,page.startOp,ret.text);
+    if (page.number)
+    {
+      ret.text+="%%Page: "+to_string(page.number)+' '+to_string(page.number)+"\n<< /PageSize [";
+      appendLdecimal(ret.text,page.paper.getx()*36e1/127,PAPERRES);
+      ret.text+=' ';
+      appendLdecimal(ret.text,page.paper.gety()*36e1/127,PAPERRES);
+      ret.text+="] >> setpagedevice\ngsave mmscale 0.1 setlinewidth\n";
+      ret.text+=ldecimal(page.paper.getx()/2)+' '+ldecimal(page.paper.gety()/2)+" translate ";
+      ret.text+=to_string((page.orientation&3)*90)+" rotate ";
+      ret.text+=ldecimal(page.paper.getx()/-2)+' '+ldecimal(page.paper.gety()/-2)+" translate\n";
+      ret.text+="/Helvetica findfont 3 scalefont setfont\n";
+      formatPsOps(page,page.startOp,page.ops.size(),ret.text);
+      ret.text+="grestore showpage\n";
+    }
+  }
+  return ret;
+}
+
 PostScript::PostScript()
 {
   oldr=oldg=oldb=NAN;
   paper=xy(210,297);
   scale=1;
   orientation=pages=0;
-  indocument=inpage=inlin=false;
+  indocument=inpage=inlin=pdf=false;
   psfile=nullptr;
+  nthreads=0;
+  written=0;
+  curpage.startOp=0;
 }
 
 PostScript::~PostScript()
@@ -120,9 +448,20 @@ double PostScript::aspectRatio()
 
 void PostScript::open(string psfname)
 {
+  int i;
+  string ext;
   if (psfile)
     close();
-  psfile=new ofstream(psfname);
+  psfile=new ofstream(psfname,ios::binary);
+  if (psfname.length()>4)
+    ext=psfname.substr(psfname.length()-4);
+  for (i=0;i<ext.length();i++)
+    ext[i]=tolower(ext[i]);
+  pdf=ext==".pdf";
+  written=0;
+  pdfOffsets.clear();
+  curpage=PsPage();
+  curpage.startOp=0;
 }
 
 bool PostScript::isOpen()
@@ -130,25 +469,125 @@ bool PostScript::isOpen()
   return psfile!=nullptr;
 }
 
+bool PostScript::isPdf()
+{
+  return pdf;
+}
+
+void PostScript::setThreads(int n)
+/* Sets the number of pages that can be formatted at once in other threads.
+ * If n is 0, each page is formatted and written when it ends.
+ */
+{
+  nthreads=n;
+  if (nthreads<0)
+    nthreads=0;
+  flush(nthreads);
+}
+
+void PostScript::writeOut(const string &text)
+{
+  psfile->write(text.data(),text.length());
+  written+=text.length();
+}
+
+void PostScript::writePage(FormattedPage page)
+{
+  int obj=2*page.number+2;
+  if (pdf && page.number)
+  {
+    if (pdfOffsets.size()<obj+2)
+      pdfOffsets.resize(obj+2,0);
+    pdfOffsets[obj]=written;
+    pdfOffsets[obj+1]=written+page.contentOffset;
+  }
+  writeOut(page.text);
+  psfile->flush();
+}
+
+void PostScript::flush(int n)
+// Writes formatted pages until at most n are pending.
+{
+  while (pending.size()>n)
+  {
+    writePage(pending.front().get());
+    pending.pop_front();
+  }
+}
+
+void PostScript::queuePage(int number)
+{
+  curpage.number=number;
+  if (nthreads)
+  {
+    pending.push_back(async(launch::async,formatPage,std::move(curpage),pdf));
+    flush(nthreads);
+  }
+  else
+  {
+    flush(0);
+    writePage(formatPage(std::move(curpage),pdf));
+  }
+  curpage=PsPage();
+  curpage.startOp=0;
+}
+
+void PostScript::addOp(int op,double n0,double n1,double n2,double n3,double n4,double n5)
+{
+  PsOp o;
+  if (psfile)
+  {
+    o.op=op;
+    o.num[0]=n0;
+    o.num[1]=n1;
+    o.num[2]=n2;
+    o.num[3]=n3;
+    o.num[4]=n4;
+    o.num[5]=n5;
+    curpage.ops.push_back(o);
+  }
+}
+
+void PostScript::addOp(int op,xy pnt,string text)
+{
+  addOp(op,pnt.getx(),pnt.gety());
+  if (psfile)
+    curpage.ops.back().text=text;
+}
+
 void PostScript::prolog()
 {
+  string text;
   if (psfile && !indocument)
   {
-    *psfile<<"%!PS-Adobe-3.0\n%%BeginProlog\n%%%%Pages: (atend)"<<endl;
-    *psfile<<"%%BoundingBox: 0 0 "<<rint(paper.getx()/PSPoint)<<' '<<rint(paper.gety()/PSPoint)<<endl;
-    *psfile<<"\n/. % ( x y )\n{ newpath 0.1 0 360 arc fill } bind def\n\n";
-    *psfile<<"/- % ( x1 y1 x2 y2 )\n\n{ newpath moveto lineto stroke } bind def\n\n";
-    *psfile<<"/c. % ( str )\n{ dup stringwidth -2 div exch -2 div exch\n"<<
-            "3 2 roll 2 index 2 index rmoveto show rmoveto } bind def\n\n";
-    *psfile<<"/mmscale { 720 254 div dup scale } bind def\n";
-    *psfile<<"/col { setrgbcolor } def\n";
-    *psfile<<"/n { newpath } def\n";
-    *psfile<<"/m { moveto } def\n";
-    *psfile<<"/l { lineto } def\n";
-    *psfile<<"/c { curveto } def\n";
-    *psfile<<"/s { stroke } def\n";
-    *psfile<<"/af { arc fill } def\n";
-    *psfile<<"%%EndProlog"<<endl;
+    if (pdf)
+    {
+      text="%PDF-1.4\n%\xe2\xe3\xcf\xd3\n";
+      pdfOffsets.resize(4,0);
+      pdfOffsets[1]=text.length();
+      text+="1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n";
+      pdfOffsets[3]=text.length();
+      text+="3 0 obj\n<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>\nendobj\n";
+    }
+    else
+    {
+      text="%!PS-Adobe-3.0\n%%BeginProlog\n%%%%Pages: (atend)\n";
+      text+="%%BoundingBox: 0 0 "+ldecimal(rint(paper.getx()/PSPoint))+' '+ldecimal(rint(paper.gety()/PSPoint))+'\n';
+      text+="\n/. % ( x y )\n{ newpath 0.1 0 360 arc fill } bind def\n\n";
+      text+="/- % ( x1 y1 x2 y2 )\n\n{ newpath moveto lineto stroke } bind def\n\n";
+      text+="/c. % ( str )\n{ dup stringwidth -2 div exch -2 div exch\n"
+	    "3 2 roll 2 index 2 index rmoveto show rmoveto } bind def\n\n";
+      text+="/mmscale { 720 254 div dup scale } bind def\n";
+      text+="/col { setrgbcolor } def\n";
+      text+="/n { newpath } def\n";
+      text+="/m { moveto } def\n";
+      text+="/l { lineto } def\n";
+      text+="/c { curveto } def\n";
+      text+="/s { stroke } def\n";
+      text+="/af { arc fill } def\n";
+      text+="%%EndProlog\n";
+    }
+    writeOut(text);
     indocument=true;
     pages=0;
   }
@@ -159,13 +598,9 @@ void PostScript::startpage()
   if (psfile && indocument && !inpage)
   {
     ++pages;
-    *psfile<<"%%Page: "<<pages<<' '<<pages<<"\n<< /PageSize [";
-    *psfile<<paper.getx()*36e1/127<<' '<<paper.gety()*36e1/127<<"] >> setpagedevice\n";
-    *psfile<<"gsave mmscale 0.1 setlinewidth\n";
-    *psfile<<paper.getx()/2<<' '<<paper.gety()/2<<' '<<"translate ";
-    *psfile<<(pageorientation&3)*90<<" rotate ";
-    *psfile<<paper.getx()/-2<<' '<<paper.gety()/-2<<' '<<"translate"<<endl;
-    *psfile<<"/Helvetica findfont 3 scalefont setfont"<<endl;
+    curpage.startOp=curpage.ops.size();
+    curpage.paper=paper;
+    curpage.orientation=pageorientation;
     oldr=oldg=oldb=NAN;
     inpage=true;
   }
@@ -175,18 +610,48 @@ void PostScript::endpage()
 {
   if (psfile && indocument && inpage)
   {
-    *psfile<<"grestore showpage"<<endl;
+    queuePage(pages);
     inpage=false;
   }
 }
 
 void PostScript::trailer()
 {
+  int i;
+  char xrefline[24];
+  string text;
   if (inpage)
     endpage();
   if (psfile && indocument)
   {
-    *psfile<<"%%BeginTrailer\n%%Pages: "<<pages<<"\n%%EndTrailer"<<endl;
+    if (curpage.ops.size())
+    {
+      curpage.startOp=curpage.ops.size();
+      queuePage(0);
+    }
+    flush(0);
+    if (pdf)
+    {
+      pdfOffsets[2]=written;
+      text="2 0 obj\n<< /Type /Pages /Count "+to_string(pages)+" /Kids [";
+      for (i=1;i<=pages;i++)
+	text+=(i>1?" ":"")+to_string(2*i+2)+" 0 R";
+      text+="] >>\nendobj\n";
+      pdfOffsets.resize(2*pages+4,0);
+      writeOut(text);
+      text="xref\n0 "+to_string(pdfOffsets.size())+"\n0000000000 65535 f \n";
+      for (i=1;i<pdfOffsets.size();i++)
+      {
+	snprintf(xrefline,sizeof(xrefline),"%010lld 00000 n \n",pdfOffsets[i]);
+	text+=xrefline;
+      }
+      text+="trailer\n<< /Size "+to_string(pdfOffsets.size())+" /Root 1 0 R >>\nstartxref\n";
+      text+=to_string(written)+"\n%%EOF\n";
+    }
+    else
+      text="%%BeginTrailer\n%%Pages: "+to_string(pages)+"\n%%EndTrailer\n";
+    writeOut(text);
+    psfile->flush();
     indocument=false;
   }
 }
@@ -195,6 +660,7 @@ void PostScript::close()
 {
   if (indocument)
     trailer();
+  flush(0);
   delete(psfile);
   psfile=nullptr;
 }
@@ -227,14 +693,13 @@ double PostScript::yscale(double y)
 string PostScript::escape(string text)
 {
   string ret;
-  int ch;
-  while (text.length())
+  int i,ch;
+  for (i=0;i<text.length();i++)
   {
-    ch=text[0];
+    ch=text[i];
     if (ch=='(' || ch==')')
       ret+='\\';
     ret+=ch;
-    text.erase(0,1);
   }
   return ret;
 }
@@ -243,7 +708,7 @@ void PostScript::setcolor(double r,double g,double b)
 {
   if (r!=oldr || g!=oldg || b!=oldb)
   {
-    *psfile<<fixed<<setprecision(3)<<r<<' '<<g<<' '<<b<<" col"<<endl;
+    addOp(PS_COLOR,r,g,b);
     oldr=r;
     oldg=g;
     oldb=b;
@@ -272,7 +737,7 @@ void PostScript::setscale(double minx,double miny,double maxx,double maxy,int or
   for (;scale*xsize/80>papx*0.9 || scale*ysize/80>papy*0.9;scale/=10);
   for (i=0;i<9 && (scale*xsize/rscales[i]>papx*0.9 || scale*ysize/rscales[i]>papy*0.9);i++);
   scale/=rscales[i];
-  *psfile<<"% minx="<<minx<<" miny="<<miny<<" maxx="<<maxx<<" maxy="<<maxy<<" scale="<<scale<<endl;
+  comment(" minx="+ldecimal(minx)+" miny="+ldecimal(miny)+" maxx="+ldecimal(maxx)+" maxy="+ldecimal(maxy)+" scale="+ldecimal(scale));
 }
 
 void PostScript::setscale(BoundRect br)
@@ -290,12 +755,7 @@ void PostScript::dot(xy pnt,string comment)
   assert(psfile);
   pnt=turn(pnt,orientation);
   if (isfinite(pnt.east()) && isfinite(pnt.north()))
-  {
-    *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)<<" .";
-    if (comment.length())
-      *psfile<<" %"<<comment;
-    *psfile<<endl;
-  }
+    addOp(PS_DOT,xy(xscale(pnt.east()),yscale(pnt.north())),comment);
 }
 
 void PostScript::circle(xy pnt,double radius)
@@ -303,9 +763,10 @@ void PostScript::circle(xy pnt,double radius)
   assert(psfile);
   pnt=turn(pnt,orientation);
   if (isfinite(pnt.east()) && isfinite(pnt.north()))
-    *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)
-    <<" n "<<ldecimal(scale*radius,PAPERRES)<<" 0 360 af %"
-    <<ldecimal(radius*radius,radius*radius/1000)<<endl;
+  {
+    addOp(PS_CIRCLE,xscale(pnt.east()),yscale(pnt.north()),scale*radius);
+    curpage.ops.back().text=ldecimal(radius*radius,radius*radius/1000);
+  }
 }
 
 void PostScript::line(edge lin,int num,int colorwhat,bool directed)
@@ -353,10 +814,11 @@ void PostScript::line(edge lin,int num,int colorwhat,bool directed)
     base=xy(disp.north()/40,disp.east()/-40);
     ab1=a+base;
     ab2=a-base;
-    *psfile<<"n "<<xscale(b.east())<<' '<<yscale(b.north())<<" m "<<xscale(ab1.east())<<' '<<yscale(ab1.north())<<" l "<<xscale(ab2.east())<<' '<<yscale(ab2.north())<<" l closepath fill"<<endl;
+    addOp(PS_ARROW,xscale(b.east()),yscale(b.north()),xscale(ab1.east()),yscale(ab1.north()),
+	  xscale(ab2.east()),yscale(ab2.north()));
   }
   else
-    *psfile<<xscale(a.east())<<' '<<yscale(a.north())<<' '<<xscale(b.east())<<' '<<yscale(b.north())<<" -"<<endl;
+    addOp(PS_LINE,xscale(a.east()),yscale(a.north()),xscale(b.east()),yscale(b.north()));
   mid=(a+b)/2;
   //fprintf(psfile,"%7.3f %7.3f m (%d) show\n",xscale(mid.east()),yscale(mid.north()),num);
 }
@@ -366,31 +828,27 @@ void PostScript::line2p(xy pnt1,xy pnt2)
   pnt1=turn(pnt1,orientation);
   pnt2=turn(pnt2,orientation);
   if (isfinite(pnt1.east()) && isfinite(pnt1.north()) && isfinite(pnt2.east()) && isfinite(pnt2.north()))
-    *psfile<<ldecimal(xscale(pnt1.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt1.north()),PAPERRES)
-    <<' '<<ldecimal(xscale(pnt2.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt2.north()),PAPERRES)<<" -"<<endl;
+    addOp(PS_LINE,xscale(pnt1.east()),yscale(pnt1.north()),xscale(pnt2.east()),yscale(pnt2.north()));
 }
 
 void PostScript::startline()
 {
   assert(psfile);
-  *psfile<<"n"<<endl;
+  addOp(PS_NEWPATH);
 }
 
 void PostScript::lineto(xy pnt)
 {
   assert(psfile);
   pnt=turn(pnt,orientation);
-  *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)<<(inlin?" l":" m");
-  *psfile<<endl;
+  addOp(inlin?PS_LINETO:PS_MOVETO,xscale(pnt.east()),yscale(pnt.north()));
   inlin=true;
 }
 
 void PostScript::endline(bool closed)
 {
   assert(psfile);
-  if (closed)
-    *psfile<<"closepath ";
-  *psfile<<"s"<<endl;
+  addOp(PS_STROKE,closed);
   inlin=false;
 }
 
@@ -399,16 +857,17 @@ void PostScript::spline(bezier3d spl,bool fill)
   int i,j,n;
   vector<xyz> seg;
   xy pnt;
+  double nums[6];
   n=spl.size();
   pnt=turn(xy(spl[0][0]),orientation);
-  *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)<<" m\n";
+  addOp(PS_MOVETO,xscale(pnt.east()),yscale(pnt.north()));
   for (i=0;i<n;i++)
   {
     seg=spl[i];
     if (isstraight(seg))
     {
       pnt=turn(xy(seg[3]),orientation);
-      *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)<<' '<<"l\n";
+      addOp(PS_LINETO,xscale(pnt.east()),yscale(pnt.north()));
     }
     else
     {
@@ -417,34 +876,35 @@ void PostScript::spline(bezier3d spl,bool fill)
         pnt=turn(xy(seg[j]),orientation);
         if (pnt.isnan())
           cerr<<"NaN point"<<endl;
-        *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)<<' ';
+        nums[2*j-2]=xscale(pnt.east());
+        nums[2*j-1]=yscale(pnt.north());
       }
-      *psfile<<"c\n";
+      addOp(PS_CURVETO,nums[0],nums[1],nums[2],nums[3],nums[4],nums[5]);
     }
   }
-  *psfile<<(fill?"fill":"s")<<endl;
+  addOp(fill?PS_FILL:PS_STROKE);
 }
 
 void PostScript::widen(double factor)
 {
-  *psfile<<"currentlinewidth "<<ldecimal(factor)<<" mul setlinewidth"<<endl;
+  addOp(PS_WIDEN,factor);
 }
 
 void PostScript::write(xy pnt,string text)
 {
   pnt=turn(pnt,orientation);
-  *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)
-  <<" m ("<<escape(text)<<") show"<<endl;
+  addOp(PS_WRITE,xy(xscale(pnt.east()),yscale(pnt.north())),escape(text));
 }
 
 void PostScript::centerWrite(xy pnt,string text)
 {
   pnt=turn(pnt,orientation);
-  *psfile<<ldecimal(xscale(pnt.east()),PAPERRES)<<' '<<ldecimal(yscale(pnt.north()),PAPERRES)
-  <<" m ("<<escape(text)<<") c."<<endl;
+  addOp(PS_CENTERWRITE,xy(xscale(pnt.east()),yscale(pnt.north())),escape(text));
 }
 
 void PostScript::comment(string text)
 {
-  *psfile<<'%'<<text<<endl;
+  addOp(PS_COMMENT,0);
+  if (psfile)
+    curpage.ops.back().text=text;
 }
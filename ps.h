@@ -26,6 +26,9 @@
 #include <string>
 #include <iostream>
 #include <map>
+#include <vector>
+#include <deque>
+#include <future>
 #include "bezier3d.h"
 #include "document.h"
 #include "tin.h"
@@ -38,17 +41,58 @@ struct papersize
 };
 extern std::map<std::string,papersize> papersizes;
 
+struct PsOp
+/* One drawing operation in paper coordinates. Operations are recorded
+ * and formatted a page at a time, so that pages can be formatted in
+ * other threads and as either PostScript or PDF.
+ */
+{
+  int op;
+  double num[6];
+  std::string text;
+};
+
+struct PsPage
+{
+  int number,orientation; // number is 0 for comments after the last page
+  xy paper;
+  size_t startOp; // operations before startOp come before the page starts
+  std::vector<PsOp> ops;
+};
+
+struct FormattedPage
+{
+  int number;
+  std::string text;
+  size_t contentOffset; // PDF only: where the content stream object starts
+};
+
 class PostScript
+/* Writes PostScript, or PDF if the filename ends in .pdf. If setThreads
+ * is called with n>0, each page is formatted in its own thread, up to n
+ * at a time, and the pages are written in order.
+ */
 {
 protected:
   std::ostream *psfile;
   int pages;
-  bool indocument,inpage,inlin;
+  bool indocument,inpage,inlin,pdf;
   double scale; // paper size is in millimeters, but model space is in meters
   int orientation,pageorientation;
   double oldr,oldg,oldb;
   xy paper,modelcenter;
   pointlist *pl;
+  int nthreads;
+  long long written; // bytes written, for the PDF cross-reference table
+  std::vector<long long> pdfOffsets;
+  PsPage curpage;
+  std::deque<std::future<FormattedPage> > pending;
+  void addOp(int op,double n0=0,double n1=0,double n2=0,double n3=0,double n4=0,double n5=0);
+  void addOp(int op,xy pnt,std::string text="");
+  void queuePage(int number);
+  void writePage(FormattedPage page);
+  void flush(int n);
+  void writeOut(const std::string &text);
 public:
   PostScript();
   ~PostScript();
@@ -56,6 +100,8 @@ public:
   double aspectRatio();
   void open(std::string psfname);
   bool isOpen();
+  bool isPdf();
+  void setThreads(int n);
   void prolog();
   void startpage();
   void endpage();
@@ -43,7 +43,7 @@ int readTinFile(pointlist &pl,string fileName,double unit)
   PtinHeader ptinHeader;
   if (status==0)
   {
-    bareTriangles=extractTriangles(readDxfGroups(fileName));
+    bareTriangles=readDxfTriangles(fileName);
     status=bareTriangles.size()>0;
     if (status)
       anytin=true;
@@ -21,73 +21,474 @@
  * and Lesser General Public License along with Bezitopo. If not, see
  * <http://www.gnu.org/licenses/>.
  */
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
 #include "rendercache.h"
 using namespace std;
 
-void RenderCache::clear()
+bool TileKey::operator<(const TileKey &b) const
 {
-  renderMap.clear();
+  if (level!=b.level)
+    return level<b.level;
+  if (x!=b.x)
+    return x<b.x;
+  return y<b.y;
 }
 
-void RenderCache::clearPresent()
+Tile::Tile(TileKey k)
 {
-  map<drawobj *,RenderItem>::iterator i;
-  int j,nsteps;
-  for (i=renderMap.begin();i!=renderMap.end();i++)
-    i->second.present=false;
-  nsteps=rng.ucrandom();
-  for (j=0;j<nsteps;j++)
-    subrand.scalar(1);
+  key=k;
+  ready=false;
+  lastUse=0;
 }
 
-void RenderCache::deleteAbsent()
+QRectF Tile::rect() const
 {
-  map<drawobj *,RenderItem>::iterator i;
-  int j;
-  vector<drawobj *> delenda;
-  for (i=renderMap.begin();i!=renderMap.end();i++)
-    if (!i->second.present)
-      delenda.push_back(i->first);
-  for (j=0;j<delenda.size();j++)
-    renderMap.erase(delenda[j]);
-  next=renderMap.begin();
+  double size=TileCache::tileSize(key.level);
+  return QRectF(key.x*size,key.y*size,size,size);
 }
 
-bool RenderCache::shouldRerender(double oldScale,double newScale)
+ContourSnapshot::ContourSnapshot()
 {
-  double ratio=oldScale/newScale;
-  double prob=ratio*exp(1-ratio);
-  return prob<1 && subrand.scalar(1)>=prob;
+  stale=false;
 }
 
-void RenderCache::checkInObject(drawobj *obj,double pixelScale,int layr,int colr,int thik,int ltype)
+LevelRender::LevelRender(int lev,shared_ptr<ContourSnapshot> snap)
 {
-  unsigned objHash;
-  if (!renderMap.count(obj))
-    renderMap[obj].pixelScale=INFINITY;
-  renderMap[obj].colr=colr;
-  renderMap[obj].thik=thik;
-  renderMap[obj].ltype=ltype;
-  renderMap[obj].present=true;
-  objHash=obj->hash(); // Computing the hash of a large polyspiral takes 1/20 as much time as rendering it.
-  if (shouldRerender(renderMap[obj].pixelScale,pixelScale) ||
-      objHash!=renderMap[obj].hash)
+  level=lev;
+  ready=false;
+  snapshot=snap;
+}
+
+WorkerPool::WorkerPool(int nthreads)
+{
+  int i;
+  if (nthreads<1)
+    nthreads=thread::hardware_concurrency()-1; // leave one for the GUI
+  if (nthreads<1)
+    nthreads=1;
+  stopping=false;
+  for (i=0;i<nthreads;i++)
+    threads.push_back(thread(&WorkerPool::run,this));
+}
+
+WorkerPool::~WorkerPool()
+{
+  int i;
+  {
+    lock_guard<mutex> lock(mtx);
+    stopping=true;
+    jobs.clear();
+  }
+  cv.notify_all();
+  for (i=0;i<threads.size();i++)
+    threads[i].join();
+}
+
+void WorkerPool::push(function<void()> job)
+{
+  {
+    lock_guard<mutex> lock(mtx);
+    jobs.push_back(job);
+  }
+  cv.notify_one();
+}
+
+void WorkerPool::clear()
+// Drops the jobs not yet started. Jobs already running finish.
+{
+  lock_guard<mutex> lock(mtx);
+  jobs.clear();
+}
+
+void WorkerPool::run()
+{
+  function<void()> job;
+  while (true)
+  {
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait(lock,[this]{return stopping || jobs.size();});
+      if (stopping)
+	return;
+      job=jobs.front();
+      jobs.pop_front();
+    }
+    try
+    {
+      job();
+    }
+    catch (...)
+    {
+      lock_guard<mutex> lock(mtx);
+      if (!error)
+	error=current_exception();
+    }
+  }
+}
+
+exception_ptr WorkerPool::takeError()
+{
+  exception_ptr ret;
+  lock_guard<mutex> lock(mtx);
+  swap(ret,error);
+  return ret;
+}
+
+void renderLevel(shared_ptr<LevelRender> lr,shared_ptr<LevelRender> old)
+/* Renders all contours in the snapshot at the level's precision, reusing
+ * the renderings of unchanged contours from the previous rendering of the
+ * same level, then sorts the Bézier segments into tiles by bounding box.
+ * The contours are rendered one after another; the pool already renders
+ * several levels at once. If rendering a contour throws, the level is
+ * finished without it, and the exception is rethrown for the pool to report.
+ */
+{
+  ContourSnapshot &snap=*lr->snapshot;
+  double precision=ldexp(1,lr->level);
+  double size=TileCache::tileSize(lr->level),margin=TILE_MARGIN*precision;
+  double minx,miny,maxx,maxy;
+  int i,j,k,m,ix,iy;
+  vector<xyz> beziseg;
+  map<unsigned,ContourRendering>::const_iterator found;
+  exception_ptr thrown;
+  lr->renderings.resize(snap.contours.size());
+  if (old && old->ready)
+    for (i=0;i<snap.contours.size();i++)
+    {
+      found=old->byHash.find(snap.hashes[i]);
+      if (found!=old->byHash.end())
+	lr->renderings[i]=found->second;
+    }
+  for (i=0;i<snap.contours.size() && !snap.stale;i++)
+    try
+    {
+      if (lr->renderings[i])
+	continue;
+      else if (snap.contours[i]->boundCircle().radius*2<precision)
+	lr->renderings[i]=make_shared<vector<drawingElement> >(); // smaller than a pixel
+      else
+	lr->renderings[i]=make_shared<vector<drawingElement> >(snap.contours[i]->render3d
+	  (precision,-1,snap.style[i][0],snap.style[i][1],snap.style[i][2]));
+    }
+    catch (...)
+    {
+      if (!thrown)
+	thrown=current_exception();
+    }
+  if (snap.stale)
+    return;
+  for (i=0;i<snap.contours.size();i++)
+    if (lr->renderings[i])
+    {
+      lr->byHash[snap.hashes[i]]=lr->renderings[i];
+      for (j=0;j<lr->renderings[i]->size();j++)
+      {
+	bezier3d &path=(*lr->renderings[i])[j].path;
+	for (k=0;k<path.size();k++)
+	{
+	  beziseg=path[k];
+	  minx=maxx=beziseg[0].getx();
+	  miny=maxy=beziseg[0].gety();
+	  for (m=1;m<4;m++)
+	  {
+	    minx=fmin(minx,beziseg[m].getx());
+	    maxx=fmax(maxx,beziseg[m].getx());
+	    miny=fmin(miny,beziseg[m].gety());
+	    maxy=fmax(maxy,beziseg[m].gety());
+	  }
+	  for (ix=floor((minx-margin)/size);ix<=floor((maxx+margin)/size);ix++)
+	    for (iy=floor((miny-margin)/size);iy<=floor((maxy+margin)/size);iy++)
+	      lr->buckets[make_pair(ix,iy)].push_back(array<int,3>{i,j,k});
+	}
+      }
+    }
+  lr->ready=true;
+  if (thrown)
+    rethrow_exception(thrown);
+}
+
+void buildTile(shared_ptr<LevelRender> lr,shared_ptr<Tile> tile)
+/* Makes one path per drawing element that passes through the tile, in
+ * world coordinates. Consecutive segments are joined; a closed element
+ * entirely within the tile is closed.
+ */
+{
+  map<pair<int,int>,vector<array<int,3> > >::const_iterator b;
+  int i,lastK=-2,nsegs=0;
+  drawingElement *de=nullptr;
+  vector<xyz> beziseg;
+  TilePath tp;
+  if (lr->snapshot->stale)
+    return;
+  b=lr->buckets.find(make_pair(tile->key.x,tile->key.y));
+  for (i=0;b!=lr->buckets.end() && i<b->second.size();i++)
   {
-    renderMap[obj].rendering=obj->render3d(pixelScale,layr,colr,thik,ltype);
-    renderMap[obj].pixelScale=pixelScale;
-    renderMap[obj].hash=objHash;
+    const array<int,3> &s=b->second[i];
+    if (i==0 || s[0]!=b->second[i-1][0] || s[1]!=b->second[i-1][1])
+    {
+      if (de && nsegs==de->path.size() && !de->path.isopen())
+	tile->paths.back().path.closeSubpath();
+      de=&(*lr->renderings[s[0]])[s[1]];
+      tp.colr=de->color;
+      tp.thik=de->width;
+      tp.ltype=de->linetype;
+      tile->paths.push_back(tp);
+      lastK=-2;
+      nsegs=0;
+    }
+    beziseg=de->path[s[2]];
+    if (s[2]!=lastK+1)
+      tile->paths.back().path.moveTo(beziseg[0].getx(),beziseg[0].gety());
+    tile->paths.back().path.cubicTo(beziseg[1].getx(),beziseg[1].gety(),
+				    beziseg[2].getx(),beziseg[2].gety(),
+				    beziseg[3].getx(),beziseg[3].gety());
+    lastK=s[2];
+    nsegs++;
   }
+  if (de && nsegs==de->path.size() && !de->path.isopen())
+    tile->paths.back().path.closeSubpath();
+  tile->ready=true;
+}
+
+TileCache::TileCache()
+{
+  useCount=0;
+  pending=false;
+}
+
+void TileCache::clear()
+{
+  pool.clear();
+  if (snapshot)
+    snapshot->stale=true;
+  snapshot.reset();
+  levels.clear();
+  tiles.clear();
+  staleTiles.clear();
+  pending=false;
+}
+
+int TileCache::levelFor(double pixelScale)
+{
+  return floor(log2(pixelScale));
 }
 
-RenderItem RenderCache::nextRenderItem()
+double TileCache::tileSize(int level)
 {
-  RenderItem ret;
-  if (next==renderMap.end())
-    ret.present=false;
+  return ldexp(TILE_PIXELS,level);
+}
+
+void TileCache::beginFrame()
+{
+  frameContours.clear();
+  frameStyle.clear();
+  frameHashes.clear();
+}
+
+void TileCache::checkInContour(polyspiral &contour,int colr,int thik,int ltype)
+{
+  unsigned h=contour.hash();
+  h=(h^(colr<<16)^(thik<<8)^ltype)*0x9e3779b1;
+  frameContours.push_back(&contour);
+  frameStyle.push_back(ContourStyle{colr,thik,ltype});
+  frameHashes.push_back(h);
+}
+
+void TileCache::endFrame()
+/* If any contour checked in since beginFrame differs from the snapshot,
+ * makes a new snapshot, sharing the copies of the unchanged contours.
+ * The tiles of the old snapshot are kept to be shown until the new ones
+ * are ready.
+ */
+{
+  int i;
+  map<unsigned,shared_ptr<polyspiral> > oldContours;
+  map<unsigned,shared_ptr<polyspiral> >::iterator found;
+  map<TileKey,shared_ptr<Tile> >::iterator j;
+  shared_ptr<ContourSnapshot> snap;
+  if (snapshot && snapshot->hashes==frameHashes)
+    return;
+  snap=make_shared<ContourSnapshot>();
+  if (snapshot)
+  {
+    for (i=0;i<snapshot->contours.size();i++)
+      oldContours[snapshot->hashes[i]]=snapshot->contours[i];
+    snapshot->stale=true;
+  }
+  for (i=0;i<frameContours.size();i++)
+  {
+    found=oldContours.find(frameHashes[i]);
+    if (found!=oldContours.end())
+      snap->contours.push_back(found->second);
+    else
+      snap->contours.push_back(make_shared<polyspiral>(*frameContours[i]));
+  }
+  snap->style=frameStyle;
+  snap->hashes=frameHashes;
+  snapshot=snap;
+  pool.clear();
+  for (j=tiles.begin();j!=tiles.end();++j)
+    if (j->second->ready)
+      staleTiles[j->first]=j->second;
+  tiles.clear();
+}
+
+shared_ptr<LevelRender> TileCache::levelRender(int level)
+{
+  map<int,shared_ptr<LevelRender> >::iterator i=levels.find(level);
+  shared_ptr<LevelRender> lr,old;
+  if (i!=levels.end())
+  {
+    if (i->second->snapshot==snapshot)
+      return i->second;
+    old=i->second;
+  }
+  lr=make_shared<LevelRender>(level,snapshot);
+  levels[level]=lr;
+  pool.push([lr,old]{renderLevel(lr,old);});
+  return lr;
+}
+
+shared_ptr<Tile> TileCache::tile(shared_ptr<LevelRender> lr,TileKey key)
+{
+  map<TileKey,shared_ptr<Tile> >::iterator i=tiles.find(key);
+  shared_ptr<Tile> ret;
+  if (i!=tiles.end())
+    ret=i->second;
   else
   {
-    ret=next->second;
-    ++next;
+    ret=make_shared<Tile>(key);
+    tiles[key]=ret;
+    pool.push([lr,ret]{buildTile(lr,ret);});
+  }
+  ret->lastUse=useCount;
+  return ret;
+}
+
+const Tile *TileCache::fallback(TileKey key)
+/* Returns the previous version of the tile, or else a coarser tile,
+ * current or previous, that covers it, or else nullptr.
+ */
+{
+  int up;
+  TileKey pk;
+  map<TileKey,shared_ptr<Tile> >::iterator i;
+  i=staleTiles.find(key);
+  if (i!=staleTiles.end())
+  {
+    i->second->lastUse=useCount;
+    return i->second.get();
+  }
+  for (up=1;up<=TILE_FALLBACK;up++)
+  {
+    pk.level=key.level+up;
+    pk.x=key.x>>up;
+    pk.y=key.y>>up;
+    i=tiles.find(pk);
+    if (i!=tiles.end() && i->second->ready)
+    {
+      i->second->lastUse=useCount;
+      return i->second.get();
+    }
+    i=staleTiles.find(pk);
+    if (i!=staleTiles.end())
+    {
+      i->second->lastUse=useCount;
+      return i->second.get();
+    }
   }
+  return nullptr;
+}
+
+vector<TileDraw> TileCache::visibleTiles(xy center,double radius,double pixelScale)
+/* Returns the tiles to composite for a view of the given radius, and
+ * starts rendering those that aren't ready. Each tile comes with the
+ * rectangle it should be clipped to, which is smaller than a coarse tile
+ * standing in for a finer one.
+ */
+{
+  vector<TileDraw> ret;
+  TileDraw td;
+  TileKey key;
+  shared_ptr<LevelRender> lr;
+  shared_ptr<Tile> t;
+  int x0,x1,y0,y1;
+  double size;
+  pending=false;
+  if (!snapshot)
+    return ret;
+  useCount++;
+  key.level=levelFor(pixelScale);
+  size=tileSize(key.level);
+  lr=levelRender(key.level);
+  x0=floor((center.getx()-radius)/size);
+  x1=floor((center.getx()+radius)/size);
+  y0=floor((center.gety()-radius)/size);
+  y1=floor((center.gety()+radius)/size);
+  for (key.x=x0;key.x<=x1;key.x++)
+    for (key.y=y0;key.y<=y1;key.y++)
+    {
+      td.tile=nullptr;
+      td.clip=QRectF(key.x*size,key.y*size,size,size);
+      if (lr->ready)
+      {
+	if (!lr->buckets.count(make_pair(key.x,key.y)))
+	{
+	  staleTiles.erase(key);
+	  continue;
+	}
+	t=tile(lr,key);
+	if (t->ready)
+	{
+	  td.tile=t.get();
+	  staleTiles.erase(key);
+	}
+      }
+      if (!td.tile)
+      {
+	pending=true;
+	td.tile=fallback(key);
+      }
+      if (td.tile)
+	ret.push_back(td);
+    }
+  evict(key.level);
   return ret;
 }
+
+void TileCache::evict(int level)
+/* Forgets the renderings of levels other than the current one and its
+ * neighbors, and the least recently used tiles above TILE_LIMIT.
+ */
+{
+  map<int,shared_ptr<LevelRender> >::iterator i;
+  map<TileKey,shared_ptr<Tile> >::iterator j;
+  vector<pair<unsigned,TileKey> > lru;
+  int k,excess;
+  for (i=levels.begin();i!=levels.end();)
+    if (abs(i->first-level)>1)
+      i=levels.erase(i);
+    else
+      ++i;
+  excess=tiles.size()+staleTiles.size()-TILE_LIMIT;
+  for (j=staleTiles.begin();excess>0 && j!=staleTiles.end();)
+    if (j->second->lastUse<useCount)
+    {
+      j=staleTiles.erase(j);
+      excess--;
+    }
+    else
+      ++j;
+  if (excess>0)
+  {
+    for (j=tiles.begin();j!=tiles.end();++j)
+      if (j->second->lastUse<useCount)
+	lru.push_back(make_pair(j->second->lastUse,j->first));
+    sort(lru.begin(),lru.end(),[](const pair<unsigned,TileKey> &a,const pair<unsigned,TileKey> &b)
+	 {return a.first<b.first;});
+    for (k=0;k<excess && k<lru.size();k++)
+      tiles.erase(lru[k].second);
+  }
+}
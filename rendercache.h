@@ -24,48 +24,155 @@
 #ifndef RENDERCACHE_H
 #define RENDERCACHE_H
 #include <map>
+#include <memory>
+#include <array>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <QPainterPath>
+#include <QRectF>
 #include "drawobj.h"
-#include "halton.h"
-#include "random.h"
+#include "polyline.h"
 
-/* The RenderCache is used for all objects visible in a canvas EXCEPT:
- * • points, which are drawn as three concentric circles sized in pixels;
- * • edges, which are not drawing objects and which are drawn as just one (sp)line.
- * If an object hasn't changed (as shown by its hash), and the pixel scale
- * is the same as when it was last rendered, the rendering is left alone.
- * If the scale has changed, it is rerendered with a probability depending
- * on the ratio. If the object has changed, it is always rerendered.
- * 
- * This works well, except in some cases involving blocks. If a block in the
- * drawing layer has a line in the setback layer, and you hide the setback
- * layer, the line will remain visible until you rerender everything or the
- * block is rerendered because the scale changes.
+#define TILE_PIXELS 256
+// A tile is this many pixels across at the finest pixel scale of its level.
+#define TILE_MARGIN 4
+// Segments this many pixels outside a tile are put in it, so that strokes aren't cut.
+#define TILE_FALLBACK 2
+// How many levels coarser to look for a tile to show while one is rendered
+#define TILE_LIMIT 1024
+
+/* The TileCache holds renderings of contours cut into square tiles in world
+ * coordinates. The tiles of level n are TILE_PIXELS*2^n meters across and
+ * are rendered at a precision of 2^n meters per pixel, so they serve any
+ * pixel scale from 2^n to 2^(n+1); zooming within a level and panning
+ * merely composite tiles already made. Rendering is done by a pool of
+ * background threads on a snapshot of the contours, so the paint event
+ * never waits: a tile not yet ready is replaced by the previous version of
+ * the same tile or by a coarser tile, and the caller should repaint while
+ * busy() is true.
+ *
+ * When a contour changes, only that contour is rerendered; the renderings
+ * of the others are shared between the old and new snapshots.
  */
 
-class RenderItem
+struct TileKey
+{
+  int level,x,y;
+  bool operator<(const TileKey &b) const;
+};
+
+struct TilePath
 {
-public:
   unsigned short colr;
   short thik;
   unsigned short ltype;
-  bool present;
-  unsigned hash;
-  double pixelScale;
-  std::vector<drawingElement> rendering;
+  QPainterPath path;
+};
+
+class Tile
+{
+public:
+  TileKey key;
+  std::atomic<bool> ready;
+  unsigned lastUse;
+  std::vector<TilePath> paths;
+  Tile(TileKey k);
+  QRectF rect() const;
+};
+
+struct TileDraw
+{
+  const Tile *tile;
+  QRectF clip;
+};
+
+typedef std::array<int,3> ContourStyle; // color, thickness, line type
+typedef std::shared_ptr<std::vector<drawingElement> > ContourRendering;
+
+class ContourSnapshot
+{
+public:
+  std::vector<std::shared_ptr<polyspiral> > contours;
+  std::vector<ContourStyle> style;
+  std::vector<unsigned> hashes; // of contour and style together
+  std::atomic<bool> stale;
+  ContourSnapshot();
 };
 
-class RenderCache
+class LevelRender
+/* All the contours rendered at one level, and the segments of the
+ * renderings sorted into tiles. buckets maps a tile's x and y to a list of
+ * (contour, drawing element, segment).
+ */
 {
+public:
+  int level;
+  std::atomic<bool> ready;
+  std::shared_ptr<ContourSnapshot> snapshot;
+  std::vector<ContourRendering> renderings;
+  std::map<unsigned,ContourRendering> byHash;
+  std::map<std::pair<int,int>,std::vector<std::array<int,3> > > buckets;
+  LevelRender(int lev,std::shared_ptr<ContourSnapshot> snap);
+};
+
+class WorkerPool
+/* If a job throws, the first exception is kept until takeError is called,
+ * so that the GUI thread can report it.
+ */
+{
+public:
+  WorkerPool(int nthreads=0);
+  ~WorkerPool();
+  void push(std::function<void()> job);
+  void clear();
+  std::exception_ptr takeError();
 private:
-  halton subrand;
-  std::map<drawobj *,RenderItem> renderMap;
-  bool shouldRerender(double oldScale,double newScale);
-  std::map<drawobj *,RenderItem>::iterator next;
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()> > jobs;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::exception_ptr error;
+  bool stopping;
+  void run();
+};
+
+class TileCache
+{
 public:
+  TileCache();
   void clear();
-  void clearPresent();
-  void deleteAbsent();
-  void checkInObject(drawobj *obj,double pixelScale,int layr,int colr,int thik,int ltype);
-  RenderItem nextRenderItem();
+  void beginFrame();
+  void checkInContour(polyspiral &contour,int colr,int thik,int ltype);
+  void endFrame();
+  std::vector<TileDraw> visibleTiles(xy center,double radius,double pixelScale);
+  bool busy()
+  {
+    return pending;
+  }
+  std::exception_ptr takeError()
+  {
+    return pool.takeError();
+  }
+  static int levelFor(double pixelScale);
+  static double tileSize(int level);
+private:
+  std::vector<polyspiral *> frameContours;
+  std::vector<ContourStyle> frameStyle;
+  std::vector<unsigned> frameHashes;
+  std::shared_ptr<ContourSnapshot> snapshot;
+  std::map<int,std::shared_ptr<LevelRender> > levels;
+  std::map<TileKey,std::shared_ptr<Tile> > tiles,staleTiles;
+  unsigned useCount;
+  bool pending;
+  std::shared_ptr<LevelRender> levelRender(int level);
+  std::shared_ptr<Tile> tile(std::shared_ptr<LevelRender> lr,TileKey key);
+  const Tile *fallback(TileKey key);
+  void evict(int level);
+  WorkerPool pool; // last, so that its threads are joined first
 };
 #endif
@@ -155,6 +155,16 @@ xyz segment::station(double along) const
 	     elev(along));
 }
 
+vector<xyz> segment::stations(vector<double> along) const
+// Same as station, but for many stations at once.
+{
+  vector<xyz> ret;
+  int i;
+  for (i=0;i<along.size();i++)
+    ret.push_back(station(along[i]));
+  return ret;
+}
+
 double segment::contourcept(double e)
 /* Finds ret such that elev(ret)=e. Used for tracing a contour from one subedge
  * to the next within a triangle.
@@ -371,6 +381,7 @@ double segment::closest(xy topoint,double closesofar,bool offends)
 {
   int nstartpoints,i,angerr,angtoler,endangle;
   double closest,closedist,lastclosedist,fardist,len,len2,vertex;
+  vector<xyz> stas;
   map<double,double> stdist;
   set<double> inserenda,delenda;
   set<double>::iterator j;
@@ -394,14 +405,15 @@ double segment::closest(xy topoint,double closesofar,bool offends)
     lastclosedist=closedist;
     for (j=delenda.begin();j!=delenda.end();++j)
       stdist.erase(*j);
-    for (j=inserenda.begin();j!=inserenda.end();++j)
+    stas=stations(vector<double>(inserenda.begin(),inserenda.end()));
+    for (i=0,j=inserenda.begin();j!=inserenda.end();++i,++j)
     {
-      len2=sqr(dist((xy)station(*j),topoint));
+      len2=sqr(dist((xy)stas[i],topoint));
       if (len2<closedist)
       {
 	closest=*j;
 	closedist=len2;
-	angerr=((bearing(*j)-atan2i((xy)station(*j)-topoint))&(DEG180-1))-DEG90;
+	angerr=((bearing(*j)-atan2i((xy)stas[i]-topoint))&(DEG180-1))-DEG90;
       }
       if (len2>fardist)
 	fardist=len2;
@@ -452,6 +464,7 @@ double segment::dirbound(int angle,double boundsofar)
   double s=sin(angle),c=cos(angle);
   double closest,closedist,lastclosedist,fardist,len,len2,vertex;
   xy sta;
+  vector<xyz> stas;
   map<double,double> stdist;
   set<double> inserenda,delenda;
   set<double>::iterator j;
@@ -473,9 +486,10 @@ double segment::dirbound(int angle,double boundsofar)
       lastclosedist=closedist;
       for (j=delenda.begin();j!=delenda.end();++j)
 	stdist.erase(*j);
-      for (j=inserenda.begin();j!=inserenda.end();++j)
+      stas=stations(vector<double>(inserenda.begin(),inserenda.end()));
+      for (i=0,j=inserenda.begin();j!=inserenda.end();++i,++j)
       {
-	sta=station(*j);
+	sta=stas[i];
 	len2=sta.east()*c+sta.north()*s;
 	if (len2<closedist)
 	{
@@ -81,6 +81,7 @@ public:
     return (end.elev()<e)^(start.elev()<e);
   }
   virtual xyz station(double along) const;
+  virtual std::vector<xyz> stations(std::vector<double> along) const;
   double avgslope()
   {
     return (end.elev()-start.elev())/length();
@@ -57,6 +57,7 @@
 #include <cstdio>
 #include <iostream>
 #include <cfloat>
+#include <algorithm>
 #include "spiral.h"
 #include "angle.h"
 #include "vcurve.h"
@@ -67,6 +68,10 @@ using namespace std;
 /* The most iterations without losing precision in an actual run is 138.
  * This occurs at the ends of the bendiest curves in testcurly.
  */
+#define CORNU_FASTBEND 16
+/* If the bearing changes by more than this from t=0, or t is huge, cornu
+ * uses the series, which decides whether the result has any precision.
+ */
 #define MAXTOTCUR 0.05
 #define MAXTOTCLO 0.01
 // When computing area, if the curve exceeds either of these, it will split it.
@@ -112,7 +117,7 @@ xy cornu(double t)
   return xy(rsum,isum);
 }
 
-xy cornu(double t,double curvature,double clothance)
+xy cornuSeries(double t,double curvature,double clothance)
 /* Evaluates the integral of cis(clothance×t²/2+curvature×t).
  * 1+(cl×t²/2+cu×t)i-(cl×t²/2+cu×t)²/2-(cl×t²/2+cu×t)³i/6+(cl×t²/2+cu×t)⁴/24+...
  * 1+cl×t²×i/2  +cu×t×i   -cl²×t⁴/8  -cl×cu×t³×2/4  -cu²×t²/2  -cl³×t⁶×i/6/8  -cl²×cu×t⁵×3i/6/4  -cl×cu²×t⁴×3i/6/2  -cu³×t³i/6  +cl⁴×t⁸/24/16  +cl³×cu×t⁷×4/24/8  +cl²×cu²×t⁶6/24/4  +cl×cu³×t⁵×4/24/2  +cu⁴×t⁴/24+...
@@ -175,6 +180,97 @@ xy cornu(double t,double curvature,double clothance)
   return xy(rsum,isum);
 }
 
+/* Nodes and weights of 8-point Gauss-Legendre quadrature on [-1,1].
+ * cis of a quadratic is entire, and on a panel over which the bearing turns
+ * less than a radian or so, the rule is accurate to roundoff.
+ */
+const double glnode[4]=
+{
+  0.183434642495649804939476142360184,0.525532409916328985817739049189246,
+  0.796666477413626739591553936475830,0.960289856497536231683560868569473
+};
+const double glweight[4]=
+{
+  0.362683783378361982965150449277196,0.313706645877887287337962201986601,
+  0.222381034453374470544355994426241,0.101228536290376259152531354309962
+};
+
+xy cornuPanels(double a,double b,double curvature,double clothance)
+/* Integrates cis(clothance×s²/2+curvature×s) from a to b, split into panels
+ * short enough that the Gauss-Legendre rule is exact to roundoff.
+ */
+{
+  int i,j,npanels;
+  double h,mid,s,phase,rsum=0,isum=0;
+  double turn=fmax(fabs(clothance*a+curvature),fabs(clothance*b+curvature))+sqrt(fabs(clothance));
+  npanels=ceil(fabs(b-a)*turn/1.5);
+  if (npanels<1)
+    npanels=1;
+  h=(b-a)/npanels/2;
+  for (i=0;i<npanels;i++)
+  {
+    mid=a+(2*i+1)*h;
+    for (j=0;j<4;j++)
+    {
+      s=mid-h*glnode[j];
+      phase=(clothance*s/2+curvature)*s;
+      rsum+=glweight[j]*cos(phase);
+      isum+=glweight[j]*sin(phase);
+      s=mid+h*glnode[j];
+      phase=(clothance*s/2+curvature)*s;
+      rsum+=glweight[j]*cos(phase);
+      isum+=glweight[j]*sin(phase);
+    }
+  }
+  return xy(rsum*h,isum*h);
+}
+
+bool cornuFast(double t,double curvature,double clothance)
+{
+  return fabs(curvature*t)+fabs(clothance*t*t/2)<=CORNU_FASTBEND && fabs(t)<1e12;
+}
+
+xy cornu(double t,double curvature,double clothance)
+/* Same as cornuSeries, but by quadrature, which is much faster. Falls back
+ * to the series when the spiral is so bendy that it may have no precision.
+ */
+{
+  if (cornuFast(t,curvature,clothance))
+    return cornuPanels(0,t,curvature,clothance);
+  else
+    return cornuSeries(t,curvature,clothance);
+}
+
+vector<xy> cornu(vector<double> t,double curvature,double clothance)
+/* Evaluates cornu at many values of t along the same spiral. Works outward
+ * from 0 in both directions, integrating only from one t to the next.
+ */
+{
+  vector<xy> ret(t.size());
+  vector<int> order;
+  int i,j,dir;
+  double last;
+  xy sum;
+  for (i=0;i<t.size();i++)
+    if (cornuFast(t[i],curvature,clothance))
+      order.push_back(i);
+    else
+      ret[i]=cornuSeries(t[i],curvature,clothance);
+  sort(order.begin(),order.end(),[&](int a,int b){return fabs(t[a])<fabs(t[b]);});
+  for (dir=-1;dir<2;dir+=2)
+    for (sum=xy(0,0),last=i=0;i<order.size();i++)
+    {
+      j=order[i];
+      if (t[j]*dir>=0)
+      {
+	sum+=cornuPanels(last,t[j],curvature,clothance);
+	last=t[j];
+	ret[j]=sum;
+      }
+    }
+  return ret;
+}
+
 void cornustats()
 {
   int i;
@@ -371,6 +467,20 @@ xyz spiralarc::station(double along) const
   return xyz(turn(relpos,midbear)+mid,elev(along));
 }
 
+vector<xyz> spiralarc::stations(vector<double> along) const
+{
+  vector<double> midlong;
+  vector<xy> relpos;
+  vector<xyz> ret;
+  int i;
+  for (i=0;i<along.size();i++)
+    midlong.push_back(along[i]-len/2);
+  relpos=cornu(midlong,cur,clo);
+  for (i=0;i<along.size();i++)
+    ret.push_back(xyz(turn(relpos[i],midbear)+mid,elev(along[i])));
+  return ret;
+}
+
 double spiralarc::sthrow()
 {
   Circle startCircle=osculatingCircle(0),endCircle=osculatingCircle(len);
@@ -34,7 +34,9 @@
  * along the curve.
  */
 xy cornu(double t); //clothance=2
+xy cornuSeries(double t,double curvature,double clothance);
 xy cornu(double t,double curvature,double clothance);
+std::vector<xy> cornu(std::vector<double> t,double curvature,double clothance);
 double spiralbearing(double t,double curvature,double clothance);
 int ispiralbearing(double t,double curvature,double clothance);
 double spiralcurvature(double t,double curvature,double clothance);
@@ -106,6 +108,7 @@ public:
     return clo;
   }
   virtual xyz station(double along) const;
+  virtual std::vector<xyz> stations(std::vector<double> along) const;
   virtual double sthrow();
   /* "throw" is a reserved word.
    * The throw is the minimum distance between the circles (one of which may be a line)
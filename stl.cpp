@@ -22,7 +22,14 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <cstring>
+#include <fstream>
+#include <deque>
+#include <map>
+#include <future>
 #include "stl.h"
+#include "tin.h"
+#include "pointlist.h"
 #include "smooth5.h"
 using namespace std;
 
@@ -101,21 +108,30 @@ bool stlValid(int i,int j,int k)
 }
 
 array<int,3> adjustStlSplit(array<int,3> stlSplit,array<int,3> stlMin)
+/* Finds the valid split with the fewest mesh faces, none of whose elements
+ * is less than stlMin. Ties go to the lexicographically smallest. For each
+ * choice of long side and each split of the short sides, only the least
+ * split of the long side which is a multiple of it need be considered.
+ */
 {
   array<int,3> ret,inx;
   int64_t meshFaces,leastMeshFaces=64000000000000;
-  for (inx[0]=stlMin[0];inx[0]<216;inx[0]++)
-    for (inx[1]=stlMin[1];inx[1]<216;inx[1]++)
-      for (inx[2]=max(min(inx[0],inx[1]),stlMin[2]);inx[2]<((inx[0]==inx[1])?216:max(inx[0],inx[1])+1);inx[2]++)
-	if (stlValid(inx[0],inx[1],inx[2]))
-	{
-	  meshFaces=stlProd(inx[0],inx[1],inx[2]);
-	  if (meshFaces<leastMeshFaces)
-	  {
-	    leastMeshFaces=meshFaces;
-	    ret=inx;
-	  }
-	}
+  int lng,i,j;
+  for (lng=0;lng<3;lng++)
+    for (j=max(stlMin[(lng+1)%3],stlMin[(lng+2)%3]);j<216;j++)
+    {
+      for (i=max(j,stlMin[lng]);i<216 && stltable[i]%stltable[j];i++);
+      if (i==216)
+	continue;
+      meshFaces=stlProd(i,j,j);
+      inx[lng]=i;
+      inx[(lng+1)%3]=inx[(lng+2)%3]=j;
+      if (meshFaces<leastMeshFaces || (meshFaces==leastMeshFaces && inx<ret))
+      {
+	leastMeshFaces=meshFaces;
+	ret=inx;
+      }
+    }
   return ret;
 }
 
@@ -130,3 +146,289 @@ stltriangle::stltriangle(xyz A,xyz B,xyz C)
   b=B;
   c=C;
 }
+
+void stlSplitRange(vector<edge *> *edges,size_t begin,size_t end,double maxError)
+{
+  size_t i;
+  for (i=begin;i<end;i++)
+    (*edges)[i]->stlSplit(maxError);
+}
+
+int stlPowerOfTwo(int inx)
+/* Returns the code of the least power of 2 which is at least stltable[inx],
+ * or of the greatest power of 2 in the table (256) if there is none.
+ */
+{
+  int i;
+  for (i=inx;i<216 && (stltable[i]&(stltable[i]-1));i++);
+  if (i==216)
+    for (i=215;stltable[i]&(stltable[i]-1);i--);
+  return i;
+}
+
+void setStlSplits(pointlist &pl,double maxError,int nthreads)
+/* Computes the minimum split of each edge in parallel, then raises the
+ * splits until every triangle has a valid combination. Raising one edge
+ * for one triangle can invalidate the triangle on the other side, so it
+ * keeps going until nothing changes. If the splits were any 5-smooth
+ * numbers, this would cascade across the TIN to splits in the hundreds
+ * of thousands; with powers of 2, no edge is raised above the greatest
+ * minimum split in the TIN.
+ */
+{
+  vector<edge *> edges;
+  vector<future<void> > workers;
+  map<int,edge>::iterator i;
+  map<int,triangle>::iterator j;
+  array<edge *,3> sides;
+  array<int,3> split,adjusted;
+  bool changed;
+  int k,n;
+  initStlTable();
+  for (i=pl.edges.begin();i!=pl.edges.end();i++)
+    edges.push_back(&i->second);
+  if (nthreads<1)
+    nthreads=1;
+  for (n=0;n<nthreads;n++)
+    workers.push_back(async(launch::async,stlSplitRange,&edges,
+			    edges.size()*n/nthreads,edges.size()*(n+1)/nthreads,maxError));
+  for (n=0;n<nthreads;n++)
+    workers[n].get();
+  for (n=0;n<edges.size();n++)
+    edges[n]->stlsplit=stlPowerOfTwo(edges[n]->stlmin);
+  do
+  {
+    changed=false;
+    for (j=pl.triangles.begin();j!=pl.triangles.end();j++)
+    {
+      sides[0]=j->second.b->isNeighbor(j->second.c);
+      sides[1]=j->second.c->isNeighbor(j->second.a);
+      sides[2]=j->second.a->isNeighbor(j->second.b);
+      for (k=0;k<3;k++)
+	split[k]=sides[k]->stlsplit;
+      adjusted=adjustStlSplit(split,split);
+      for (k=0;k<3;k++)
+	if (adjusted[k]!=split[k])
+	{
+	  sides[k]->stlsplit=adjusted[k];
+	  changed=true;
+	}
+    }
+  } while (changed);
+}
+
+xyz stlEdgePoint(edge *e,point *from,int i)
+/* Returns the ith of the points dividing the edge, counting from the end
+ * from. The point is computed from the edge's own direction, so that the
+ * two triangles on the edge get exactly the same point.
+ */
+{
+  int n=stltable[e->stlsplit];
+  if (from!=e->a)
+    i=n-i;
+  if (i==0)
+    return *e->a;
+  if (i==n)
+    return *e->b;
+  return e->getsegment().station(e->length()*i/n);
+}
+
+void addStlTriangle(vector<stltriangle> &facets,xyz a,xyz b,xyz c,xyz up)
+// Puts the corners in counterclockwise order as seen from the up side.
+{
+  if (dot(cross(b-a,c-a),up)<0)
+    swap(b,c);
+  facets.push_back(stltriangle(a,b,c));
+}
+
+vector<stltriangle> tessellate(StlTriangle &st,double base)
+/* Returns the top surface of the triangle, and the bottom and sides under
+ * any sides which are on the edge of the TIN. The triangle is divided into
+ * a lattice of n² triangles, where n is the split of sides bc and ca, and
+ * each lattice triangle against side ab, which is split into m*n pieces,
+ * is divided into m triangles.
+ */
+{
+  vector<stltriangle> ret;
+  int n=stltable[st.bc->stlsplit],mn=stltable[st.ab->stlsplit],m=mn/n;
+  int i,j,k;
+  vector<vector<xyz> > lattice(n+1);
+  vector<xyz> bottom;
+  xyz down(0,0,-1),outward,centroid;
+  edge *sides[3]={st.ab,st.bc,st.ca};
+  point *corners[3]={st.a,st.b,st.c};
+  // lattice[j][i] is i/n of the way from a to b and j/n of the way from a to c.
+  for (j=0;j<=n;j++)
+    for (i=0;i+j<=n;i++)
+      if (j==0)
+	lattice[j].push_back(stlEdgePoint(st.ab,st.a,i*m));
+      else if (i==0)
+	lattice[j].push_back(stlEdgePoint(st.ca,st.a,j));
+      else if (i+j==n)
+	lattice[j].push_back(stlEdgePoint(st.bc,st.b,j));
+      else
+      {
+	xy pnt=(xy(*st.a)*(n-i-j)+xy(*st.b)*i+xy(*st.c)*j)/n;
+	lattice[j].push_back(xyz(pnt,st.tri->elevation(pnt)));
+      }
+  for (j=0;j<n;j++)
+    for (i=0;i+j<n;i++)
+    {
+      if (j==0)
+	for (k=0;k<m;k++)
+	  addStlTriangle(ret,stlEdgePoint(st.ab,st.a,i*m+k),stlEdgePoint(st.ab,st.a,i*m+k+1),
+			 lattice[1][i],xyz(0,0,1));
+      else
+	addStlTriangle(ret,lattice[j][i],lattice[j][i+1],lattice[j+1][i],xyz(0,0,1));
+      if (i+j<n-1)
+	addStlTriangle(ret,lattice[j][i+1],lattice[j+1][i+1],lattice[j+1][i],xyz(0,0,1));
+    }
+  /* The bottom is the triangle, with the split points of the sides which
+   * are on the edge of the TIN, fanned from the centroid.
+   */
+  for (k=0;k<3;k++)
+  {
+    bottom.push_back(xyz(xy(*corners[k]),base));
+    if (!sides[k]->isinterior())
+    {
+      n=stltable[sides[k]->stlsplit];
+      outward=xyz(turn90(xy(*corners[(k+1)%3]-*corners[k])),0);
+      if (dot(outward,*corners[(k+2)%3]-*corners[k])>0)
+	outward=-outward;
+      for (i=0;i<n;i++)
+      {
+	xyz top0=stlEdgePoint(sides[k],corners[k],i);
+	xyz top1=stlEdgePoint(sides[k],corners[k],i+1);
+	xyz bot0(xy(top0),base),bot1(xy(top1),base);
+	addStlTriangle(ret,top0,bot0,bot1,outward);
+	addStlTriangle(ret,top0,bot1,top1,outward);
+	if (i<n-1)
+	  bottom.push_back(bot1);
+      }
+    }
+  }
+  if (bottom.size()==3)
+    addStlTriangle(ret,bottom[0],bottom[1],bottom[2],down);
+  else
+  {
+    centroid=xyz((xy(*st.a)+xy(*st.b)+xy(*st.c))/3,base);
+    for (k=0;k<bottom.size();k++)
+      addStlTriangle(ret,centroid,bottom[k],bottom[(k+1)%bottom.size()],down);
+  }
+  return ret;
+}
+
+void putFloat(string &buf,double x)
+{
+  float f=x;
+  char bytes[4];
+  memcpy(bytes,&f,4);
+#if __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+  swap(bytes[0],bytes[3]);
+  swap(bytes[1],bytes[2]);
+#endif
+  buf.append(bytes,4);
+}
+
+void putXyz(string &buf,xyz pnt)
+{
+  putFloat(buf,pnt.getx());
+  putFloat(buf,pnt.gety());
+  putFloat(buf,pnt.getz());
+}
+
+string stlFacets(vector<StlTriangle> *tris,size_t begin,size_t end,double base,int *count)
+/* Formats the facets of a range of triangles in binary STL. Runs in a
+ * worker thread, so it touches nothing but the triangles and their edges.
+ */
+{
+  size_t i,j;
+  string ret;
+  vector<stltriangle> facets;
+  xyz normal;
+  *count=0;
+  for (i=begin;i<end;i++)
+  {
+    facets=tessellate((*tris)[i],base);
+    for (j=0;j<facets.size();j++)
+    {
+      normal=cross(facets[j].b-facets[j].a,facets[j].c-facets[j].a);
+      if (normal.length()>0)
+	normal.normalize();
+      putXyz(ret,normal);
+      putXyz(ret,facets[j].a);
+      putXyz(ret,facets[j].b);
+      putXyz(ret,facets[j].c);
+      ret.append(2,'\0');
+    }
+    *count+=facets.size();
+  }
+  return ret;
+}
+
+long long writeStlBinary(pointlist &pl,string filename,double maxError,double base,int nthreads)
+/* Writes the TIN as a solid whose top is the surface and whose bottom is
+ * at elevation base, splitting edges finely enough that the facets are
+ * within maxError of the surface. Blocks of triangles are tessellated in
+ * parallel and written in order as they finish, so only a few blocks'
+ * facets are in memory at once. Returns the number of facets, or -1 if the
+ * file can't be opened.
+ */
+{
+  ofstream file(filename,ios::binary);
+  vector<StlTriangle> tris;
+  map<int,triangle>::iterator i;
+  StlTriangle st;
+  deque<future<string> > pending;
+  vector<int> counts;
+  long long total=0;
+  size_t block,nblocks,next=0;
+  int k;
+  char header[80];
+  if (!file.is_open())
+    return -1;
+  setStlSplits(pl,maxError,nthreads);
+  for (i=pl.triangles.begin();i!=pl.triangles.end();i++)
+  {
+    st.tri=&i->second;
+    st.a=i->second.a;
+    st.b=i->second.b;
+    st.c=i->second.c;
+    for (k=0;k<3;k++)
+    {
+      st.ab=st.a->isNeighbor(st.b);
+      if (st.ab->stlsplit>=st.b->isNeighbor(st.c)->stlsplit &&
+	  st.ab->stlsplit>=st.c->isNeighbor(st.a)->stlsplit)
+	break;
+      swap(st.a,st.b);
+      swap(st.b,st.c); // rotate, keeping them counterclockwise
+    }
+    st.bc=st.b->isNeighbor(st.c);
+    st.ca=st.c->isNeighbor(st.a);
+    tris.push_back(st);
+  }
+  memset(header,' ',80);
+  memcpy(header,"Bezitopo STL",12);
+  file.write(header,80);
+  file.write("\0\0\0\0",4); // facet count, filled in at the end
+  if (nthreads<1)
+    nthreads=1;
+  nblocks=(tris.size()+STL_BLOCK-1)/STL_BLOCK;
+  counts.resize(nblocks);
+  for (block=0;block<nblocks || pending.size();block++)
+  {
+    if (block<nblocks)
+      pending.push_back(async(nthreads>1?launch::async:launch::deferred,stlFacets,&tris,
+			      block*STL_BLOCK,min(tris.size(),(block+1)*STL_BLOCK),base,&counts[block]));
+    if (pending.size()>2*nthreads || block>=nblocks)
+    {
+      file<<pending.front().get();
+      pending.pop_front();
+      total+=counts[next++];
+    }
+  }
+  file.seekp(80);
+  for (k=0;k<4;k++)
+    file.put((total>>(8*k))&255);
+  return total;
+}
@@ -24,9 +24,17 @@
 
 #include <array>
 #include <vector>
+#include <string>
 #include "point.h"
 #include "config.h"
 
+#define STL_BLOCK 256
+// Number of TIN triangles tessellated at once by a worker thread
+
+class pointlist;
+class edge;
+class triangle;
+
 extern std::vector<int> stltable; // used in bezier.cpp
 void initStlTable();
 std::array<int,3> adjustStlSplit(std::array<int,3> stlSplit,std::array<int,3> stlMin);
@@ -38,3 +46,18 @@ struct stltriangle
   stltriangle();
   stltriangle(xyz A,xyz B,xyz C);
 };
+
+struct StlTriangle
+/* A TIN triangle ready to be tessellated. The corners are rotated so that
+ * the side from a to b is the one split into the most pieces; the other
+ * two sides are split into the same number of pieces.
+ */
+{
+  triangle *tri;
+  point *a,*b,*c;
+  edge *ab,*bc,*ca;
+};
+
+void setStlSplits(pointlist &pl,double maxError,int nthreads=1);
+std::vector<stltriangle> tessellate(StlTriangle &st,double base);
+long long writeStlBinary(pointlist &pl,std::string filename,double maxError,double base,int nthreads=1);
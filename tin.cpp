@@ -25,6 +25,10 @@
 #include <map>
 #include <cmath>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include "globals.h"
 #include "tin.h"
 #include "ps.h"
@@ -55,6 +59,7 @@ edge::edge()
   extrema[0]=extrema[1]=NAN;
   broken=contour=stlsplit=0;
   flipcnt=0;
+  num=-1;
 }
 
 edge* edge::next(point* end)
@@ -423,21 +428,6 @@ xyz edge::critpoint(int i)
   return getsegment().station(extrema[i]);
 }
 
-void edge::clearmarks()
-{
-  contour=0;
-}
-
-void edge::mark(int n)
-{
-  contour|=(1<<n);
-}
-
-bool edge::ismarked(int n)
-{
-  return (contour>>n)&1;
-}
-
 void edge::stlSplit(double maxError)
 {
   segment thisSeg=getsegment();
@@ -549,6 +539,7 @@ bool pointlist::tryStartPoint(PostScript &ps,xy &startpnt)
   bool fail;
   maxedges=3*points.size()-6;
   edges.clear();
+  edgeIndex.clear();
   convexhull.clear();
   for (m=0;m<100;m++)
   {
@@ -941,6 +932,7 @@ void pointlist::maketin(string filename,bool colorfibaster)
     startpnt+=i->second;
   startpnt/=points.size();
   edges.clear();
+  edgeIndex.clear();
   splitBreaklines();
   /* startpnt has to be within or out the side of the triangle formed
    * by the three nearest points. In a 100-point asteraceous pattern,
@@ -952,6 +944,7 @@ void pointlist::maketin(string filename,bool colorfibaster)
   {
     ps.open(filename);
     ps.setpaper(papersizes["A4 portrait"],0);
+    ps.setThreads(thread::hardware_concurrency());
     ps.prolog();
     ps.setPointlist(*this);
   }
@@ -1001,80 +994,341 @@ void pointlist::maketin(string filename,bool colorfibaster)
   }
 }
 
-void pointlist::makegrad(double corr)
+void pointlist::makegrad(double corr,int nthreads)
 // Compute the gradient at each point.
 // corr is a correlation factor which is how much the slope
 // at one end of an edge affects the slope at the other.
+// Each pass computes all the new gradients from the old ones, so the points
+// can be divided among threads.
 {
   ptlist::iterator i;
-  int n,m;
-  edge *e;
-  double zdiff,zxtrap,zthere;
-  xy gradthere,diff;
-  double sum1,sumx,sumy,sumz,sumxx,sumxy,sumxz,sumzz,sumyy,sumyz;
+  vector<point *> pts;
+  int n;
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
   for (i=points.begin();i!=points.end();i++)
+  {
     i->second.gradient=xy(0,0);
+    pts.push_back(&i->second);
+  }
   for (n=0;n<10;n++)
   {
+    parallelRanges(pts.size(),nthreads,[&](size_t begin,size_t end)
+    {
+      size_t j;
+      int m;
+      edge *e;
+      point *pnt;
+      double zdiff,zxtrap,zthere;
+      xy gradthere,diff;
+      double sum1,sumx,sumy,sumz,sumxx,sumxy,sumxz,sumzz,sumyy,sumyz;
+      for (j=begin;j<end;j++)
+      {
+	pnt=pts[j];
+	//pnt->gradient=xy(0,0);
+	sum1=sumx=sumy=sumz=sumxx=sumxy=sumxz=sumzz=sumyy=sumyz=0;
+	for (m=0,e=pnt->line;m==0 || e!=pnt->line;m++,e=e->next(pnt))
+	if (!(e->broken&8))
+	{
+	  gradthere=e->otherend(pnt)->gradient;
+	  diff=(xy)(*e->otherend(pnt))-(xy)*pnt;
+	  zdiff=e->otherend(pnt)->elev()-pnt->elev();
+	  zxtrap=zdiff-dot(gradthere,diff);
+	  zthere=zdiff+corr*zxtrap;
+	  sum1+=1;
+	  sumx+=diff.east();
+	  sumy+=diff.north();
+	  sumz+=zthere;
+	  sumxx+=diff.east()*diff.east();
+	  sumyy+=diff.north()*diff.north();
+	  sumzz+=zthere*zthere;
+	  sumxy+=diff.east()*diff.north();
+	  sumxz+=diff.east()*zthere;
+	  sumyz+=diff.north()*zthere;
+	}
+	if (sum1)
+	{
+	  sum1++; //add the point i to the set
+	  sumx/=sum1;
+	  sumy/=sum1;
+	  sumz/=sum1;
+	  sumxx/=sum1;
+	  sumyy/=sum1;
+	  sumzz/=sum1;
+	  sumxy/=sum1;
+	  sumxz/=sum1;
+	  sumyz/=sum1;
+	  sumxx-=sumx*sumx;
+	  sumyy-=sumy*sumy;
+	  sumzz-=sumz*sumz;
+	  sumxy-=sumx*sumy;
+	  sumxz-=sumx*sumz;
+	  sumyz-=sumy*sumz;
+	  /* Gradient is computed by this matrix equation:
+	  (xx xy)   (gradx)
+	  (     ) × (     ) = (xz yz)
+	  (xy yy)   (grady) */
+	  pnt->newgradient=xy(sumxz/sumxx,sumyz/sumyy);
+	}
+	else
+	  fprintf(stderr,"Warning: point at address %p has no edges that don't cross breaklines\n",pnt);
+      }
+    });
     for (i=points.begin();i!=points.end();i++)
     {
-      //i->second.gradient=xy(0,0);
-      sum1=sumx=sumy=sumz=sumxx=sumxy=sumxz=sumzz=sumyy=sumyz=0;
-      for (m=0,e=i->second.line;m==0 || e!=i->second.line;m++,e=e->next(&i->second))
+      i->second.oldgradient=i->second.gradient;
+      i->second.gradient=i->second.newgradient;
+    }
+  }
+  surfaceTimes.makegrad=secondsSince(start);
+}
+
+struct GradSystem
+/* The equations solved by makegrad, which are linear in the gradients, as a
+ * sparse matrix in compressed sparse row form. Each point's gradient is
+ * rhs[i] plus, for each j from rowStart[i] to rowStart[i+1]-1, the 2×2 block
+ * block[j] (row-major) times the gradient of point col[j].
+ */
+{
+  std::vector<int> rowStart,col,color;
+  std::vector<std::array<double,4> > block;
+  std::vector<xy> rhs;
+  std::vector<std::vector<int> > colorClass;
+};
+
+GradSystem assembleGrad(vector<point *> &pts,map<point *,int> &index,double corr)
+{
+  GradSystem ret;
+  int i,j,m,k;
+  edge *e;
+  point *pnt,*there;
+  double sum1,sumx,sumy,sumxx,sumyy,wx,wy;
+  xy diff,b;
+  vector<int> neighbors;
+  vector<xy> diffs;
+  vector<double> zdiffs;
+  vector<bool> used;
+  ret.rowStart.push_back(0);
+  for (i=0;i<pts.size();i++)
+  {
+    pnt=pts[i];
+    neighbors.clear();
+    diffs.clear();
+    zdiffs.clear();
+    sum1=sumx=sumy=sumxx=sumyy=0;
+    for (m=0,e=pnt->line;m==0 || e!=pnt->line;m++,e=e->next(pnt))
       if (!(e->broken&8))
       {
-	gradthere=e->otherend(&i->second)->gradient;
-	diff=(xy)(*e->otherend(&i->second))-(xy)i->second;
-	zdiff=e->otherend(&i->second)->elev()-i->second.elev();
-	zxtrap=zdiff-dot(gradthere,diff);
-	zthere=zdiff+corr*zxtrap;
+	there=e->otherend(pnt);
+	diff=(xy)*there-(xy)*pnt;
+	neighbors.push_back(index[there]);
+	diffs.push_back(diff);
+	zdiffs.push_back(there->elev()-pnt->elev());
 	sum1+=1;
 	sumx+=diff.east();
 	sumy+=diff.north();
-	sumz+=zthere;
 	sumxx+=diff.east()*diff.east();
 	sumyy+=diff.north()*diff.north();
-	sumzz+=zthere*zthere;
-	sumxy+=diff.east()*diff.north();
-	sumxz+=diff.east()*zthere;
-	sumyz+=diff.north()*zthere;
       }
-      //printf("point %d sum1=%f zdiff=%f zthere=%f\n",i->first,sum1,zdiff,zthere);
-      if (sum1)
+    b=xy(0,0);
+    if (sum1)
+    {
+      sum1++; // add the point i to the set
+      sumx/=sum1;
+      sumy/=sum1;
+      sumxx=sumxx/sum1-sumx*sumx;
+      sumyy=sumyy/sum1-sumy*sumy;
+      /* zthere=(1+corr)*zdiff-corr*dot(gradthere,diff), and the gradient is
+       * the covariance of zthere with x (or y) divided by the variance of x.
+       */
+      for (j=0;j<neighbors.size();j++)
       {
-	sum1++; //add the point i to the set
-	sumx/=sum1;
-	sumy/=sum1;
-	sumz/=sum1;
-	sumxx/=sum1;
-	sumyy/=sum1;
-	sumzz/=sum1;
-	sumxy/=sum1;
-	sumxz/=sum1;
-	sumyz/=sum1;
-	sumxx-=sumx*sumx;
-	sumyy-=sumy*sumy;
-	sumzz-=sumz*sumz;
-	sumxy-=sumx*sumy;
-	sumxz-=sumx*sumz;
-	sumyz-=sumy*sumz;
-	/* Gradient is computed by this matrix equation:
-	(xx xy)   (gradx)
-	(     ) × (     ) = (xz yz)
-	(xy yy)   (grady) */
-	i->second.newgradient=xy(sumxz/sumxx,sumyz/sumyy);
-	/*if (i->first==63)
-	printf("sumxz %f sumxx %f sumyz %f sumyy %f\n",sumxz,sumxx,sumyz,sumyy);*/
+	wx=(diffs[j].east()-sumx)/sum1/sumxx;
+	wy=(diffs[j].north()-sumy)/sum1/sumyy;
+	b+=xy(wx,wy)*((1+corr)*zdiffs[j]);
+	ret.col.push_back(neighbors[j]);
+	ret.block.push_back(array<double,4>{-corr*wx*diffs[j].east(),-corr*wx*diffs[j].north(),
+					    -corr*wy*diffs[j].east(),-corr*wy*diffs[j].north()});
       }
-      else
-	fprintf(stderr,"Warning: point at address %p has no edges that don't cross breaklines\n",&i->second);
     }
-    for (i=points.begin();i!=points.end();i++)
+    else
+      fprintf(stderr,"Warning: point at address %p has no edges that don't cross breaklines\n",pnt);
+    ret.rhs.push_back(b);
+    ret.rowStart.push_back(ret.col.size());
+  }
+  /* Color the points so that no two neighbors have the same color. Points of
+   * one color can then be relaxed at the same time, and the order within a
+   * color doesn't matter. A TIN has triangles, so two colors aren't enough.
+   */
+  ret.color.resize(pts.size());
+  for (i=0;i<pts.size();i++)
+  {
+    used.assign(used.size(),false);
+    pnt=pts[i];
+    for (m=0,e=pnt->line;m==0 || e!=pnt->line;m++,e=e->next(pnt))
     {
-      i->second.oldgradient=i->second.gradient;
-      i->second.gradient=i->second.newgradient;
+      j=index[e->otherend(pnt)];
+      if (j<i)
+      {
+	if (ret.color[j]>=used.size())
+	  used.resize(ret.color[j]+1,false);
+	used[ret.color[j]]=true;
+      }
     }
+    for (k=0;k<used.size() && used[k];k++);
+    ret.color[i]=k;
+    if (k>=ret.colorClass.size())
+      ret.colorClass.resize(k+1);
+    ret.colorClass[k].push_back(i);
   }
+  return ret;
+}
+
+xy gradRow(GradSystem &sys,vector<xy> &grad,int i)
+{
+  int j;
+  xy ret=sys.rhs[i],g;
+  for (j=sys.rowStart[i];j<sys.rowStart[i+1];j++)
+  {
+    g=grad[sys.col[j]];
+    ret+=xy(sys.block[j][0]*g.east()+sys.block[j][1]*g.north(),
+	    sys.block[j][2]*g.east()+sys.block[j][3]*g.north());
+  }
+  return ret;
+}
+
+class GradBarrier
+// Holds each of count threads at wait until all of them have reached it.
+{
+public:
+  GradBarrier(int n)
+  {
+    count=n;
+    waiting=generation=0;
+  }
+  void wait()
+  {
+    unique_lock<mutex> lock(mtx);
+    int gen=generation;
+    if (++waiting==count)
+    {
+      waiting=0;
+      generation++;
+      cv.notify_all();
+    }
+    else
+      cv.wait(lock,[&]{return gen!=generation;});
+  }
+private:
+  mutex mtx;
+  condition_variable cv;
+  int count,waiting,generation;
+};
+
+GradReport pointlist::solvegrad(double corr,double toler,int maxIter,int nthreads)
+/* Solves the same equations that makegrad relaxes, to convergence, by
+ * multicolor Gauss-Seidel. The matrix isn't symmetric, so conjugate
+ * gradients don't apply. Stops when no gradient changes by more than toler
+ * times the largest gradient. If the iteration diverges, which can happen
+ * when corr is near 1, falls back to makegrad.
+ *
+ * The threads are started once. Each relaxes its share of a color, then
+ * waits at a barrier for the others before going on to the next color;
+ * after the last color, thread 0 checks for convergence while the others
+ * wait.
+ */
+{
+  ptlist::iterator i;
+  vector<point *> pts;
+  map<point *,int> index;
+  GradSystem sys;
+  GradReport ret;
+  vector<xy> grad;
+  vector<double> change;
+  vector<thread> team;
+  double maxChange,maxGrad,lastChange=INFINITY;
+  int k,t,diverging=0;
+  bool done;
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
+  for (i=points.begin();i!=points.end();i++)
+  {
+    index[&i->second]=pts.size();
+    pts.push_back(&i->second);
+  }
+  sys=assembleGrad(pts,index,corr);
+  grad.assign(pts.size(),xy(0,0));
+  change.resize(pts.size());
+  ret.colors=sys.colorClass.size();
+  ret.nonzeros=sys.col.size();
+  ret.converged=pts.size()==0;
+  ret.iterations=0;
+  done=ret.converged || maxIter<=0;
+  if (nthreads<1)
+    nthreads=1;
+  if (nthreads>pts.size() && pts.size())
+    nthreads=pts.size();
+  GradBarrier barrier(nthreads);
+  auto worker=[&](int me)
+  {
+    size_t c,j,begin,end;
+    xy g;
+    while (!done)
+    {
+      for (c=0;c<sys.colorClass.size();c++)
+      {
+	vector<int> &cls=sys.colorClass[c];
+	begin=cls.size()*me/nthreads;
+	end=cls.size()*(me+1)/nthreads;
+	for (j=begin;j<end;j++)
+	{
+	  g=gradRow(sys,grad,cls[j]);
+	  change[cls[j]]=dist(g,grad[cls[j]]);
+	  grad[cls[j]]=g;
+	}
+	barrier.wait();
+      }
+      if (me==0)
+      {
+	for (maxChange=maxGrad=k=0;k<pts.size();k++)
+	{
+	  if (change[k]>maxChange)
+	    maxChange=change[k];
+	  if (grad[k].length()>maxGrad)
+	    maxGrad=grad[k].length();
+	}
+	ret.converged=maxChange<=toler*maxGrad;
+	if (maxChange>lastChange || !std::isfinite(maxChange))
+	  diverging++;
+	else
+	  diverging=0;
+	lastChange=maxChange;
+	ret.iterations++;
+	done=ret.iterations>=maxIter || ret.converged || diverging>=5;
+      }
+      barrier.wait();
+    }
+  };
+  for (t=1;t<nthreads;t++)
+    team.push_back(thread(worker,t));
+  worker(0);
+  for (t=0;t<team.size();t++)
+    team[t].join();
+  for (ret.residual=k=0;k<pts.size();k++)
+    if (dist(gradRow(sys,grad,k),grad[k])>ret.residual)
+      ret.residual=dist(gradRow(sys,grad,k),grad[k]);
+  if (diverging>=5 || !std::isfinite(ret.residual))
+  {
+    makegrad(corr,nthreads);
+    ret.converged=false;
+  }
+  else
+    for (k=0;k<pts.size();k++)
+    {
+      pts[k]->oldgradient=pts[k]->gradient;
+      pts[k]->gradient=pts[k]->newgradient=grad[k];
+    }
+  ret.seconds=secondsSince(start);
+  surfaceTimes.makegrad=ret.seconds;
+  return ret;
 }
 
 void pointlist::maketriangles()
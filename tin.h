@@ -55,10 +55,8 @@ public:
    * Bit 3 means that a type-1 breakline crosses the edge.
    */
   char contour;
-  /* When drawing a contour, set one of the low 3 bits of edge::contour to true
-   * for each edge that crosses the contour. Keep the flags set when you go to
-   * the next contour of the same elevation. When you go to the next elevation,
-   * clear the flags.
+  /* Visited flag when walking around the edges, as in pointlist::boundary.
+   * Contour tracing keeps its own marks in ContourEngine.
    */
   unsigned char stlmin;
   // Code for the minimum number of pieces this edge must be split into.
@@ -67,6 +65,7 @@ public:
    * when writing an STL file.
    */
   short flipcnt;
+  int num; // dense number assigned by ContourEngine, which indexes its marks by it
   edge();
   void flip(pointlist *topopoints);
   void reverse();
@@ -87,9 +86,6 @@ public:
   std::array<double,4> ctrlpts();
   xyz critpoint(int i);
   void findextrema();
-  void clearmarks();
-  void mark(int n);
-  bool ismarked(int n);
   void stlSplit(double maxError);
 };
 
@@ -23,6 +23,7 @@
  */
 #include <iostream>
 #include <cmath>
+#include <thread>
 #include "except.h"
 #include "topocanvas.h"
 #include "readtin.h"
@@ -83,6 +84,7 @@ TopoCanvas::TopoCanvas(QWidget *parent):QWidget(parent)
   timer=new QTimer(this);
   plnum=-1;
   goal=DONE;
+  contourEngine=nullptr;
   rotation=0;
   tipXyz=false;
   showDelaunay=true;
@@ -102,6 +104,17 @@ QPointF TopoCanvas::worldToWindow(xy pnt)
   return ret;
 }
 
+QTransform TopoCanvas::worldTransform()
+/* The same transformation as worldToWindow, for painting paths which are
+ * in world coordinates.
+ */
+{
+  xy cs=cossin(rotation)*zoomratio(scale)*windowSize;
+  return QTransform(cs.getx(),-cs.gety(),-cs.gety(),-cs.getx(),
+		    windowCenter.getx()-cs.getx()*worldCenter.getx()+cs.gety()*worldCenter.gety(),
+		    height()-windowCenter.gety()+cs.gety()*worldCenter.getx()+cs.getx()*worldCenter.gety());
+}
+
 xy TopoCanvas::windowToWorld(QPointF pnt)
 {
   xy ret(pnt.x(),height()-pnt.y());
@@ -679,11 +692,14 @@ void TopoCanvas::redoSurface()
   //cout<<"redoSurface"<<endl;
   if (tinValid)
   {
-    doc.pl[plnum].makegrad(0.15);
+    /* These five are all fast. It's finding the critical points of a
+     * triangle that's slow.
+     */
+    doc.pl[plnum].solvegrad(0.15,1e-12,200,thread::hardware_concurrency());
     doc.pl[plnum].maketriangles();
-    doc.pl[plnum].setgradient(!trianglesShouldBeCurvy);
-    doc.pl[plnum].makeqindex();           // These five are all fast. It's finding the
-    doc.pl[plnum].findedgecriticalpts();  // critical points of a triangle that's slow.
+    doc.pl[plnum].setgradient(!trianglesShouldBeCurvy,thread::hardware_concurrency());
+    doc.pl[plnum].makeqindex();
+    doc.pl[plnum].findedgecriticalpts(thread::hardware_concurrency());
     trianglesAreCurvy=trianglesShouldBeCurvy;
   }
   progressDialog->setRange(0,doc.pl[plnum].triangles.size());
@@ -699,7 +715,13 @@ void TopoCanvas::redoSurface()
 }
 
 void TopoCanvas::findCriticalPoints()
+/* Each tick of the timer does a batch of triangles for each thread, so that
+ * the progress dialog stays responsive.
+ */
 {
+  int nthreads=thread::hardware_concurrency(),batchEnd;
+  if (nthreads<1)
+    nthreads=1;
   //cout<<"findCriticalPoints"<<endl;
   if (tinerror)
   {
@@ -710,8 +732,11 @@ void TopoCanvas::findCriticalPoints()
   {
     try
     {
-      doc.pl[plnum].triangles[triCount].findcriticalpts();
-      doc.pl[plnum].triangles[triCount++].subdivide();
+      batchEnd=triCount+CRIT_BATCH*nthreads;
+      if (batchEnd>doc.pl[plnum].triangles.size())
+        batchEnd=doc.pl[plnum].triangles.size();
+      doc.pl[plnum].findcriticalpts(triCount,batchEnd,nthreads);
+      triCount=batchEnd;
       progressDialog->setValue(triCount);
       if (triCount==doc.pl[plnum].triangles.size())
       {
@@ -793,6 +818,8 @@ void TopoCanvas::roughContours()
   if (tinValid)
     tinlohi=doc.pl[plnum].lohi();
   doc.pl[plnum].contours.clear();
+  delete contourEngine; // the TIN may have changed since it was made
+  contourEngine=nullptr;
   elevLo=floor(tinlohi[0]/conterval);
   elevHi=ceil(tinlohi[1]/conterval);
   progInx=elevLo;
@@ -814,7 +841,9 @@ void TopoCanvas::roughContours()
 
 void TopoCanvas::rough1Contour()
 {
-  rough1contour(doc.pl[plnum],progInx*conterval);
+  if (!contourEngine)
+    contourEngine=new ContourEngine(doc.pl[plnum]);
+  contourEngine->rough1contour(progInx*conterval);
   if (++progInx>elevHi)
   {
     disconnect(timer,SIGNAL(timeout()),this,SLOT(rough1Contour()));
@@ -828,6 +857,8 @@ void TopoCanvas::rough1Contour()
 void TopoCanvas::roughContoursFinish()
 {
   disconnect(timer,SIGNAL(timeout()),this,SLOT(roughContoursFinish()));
+  delete contourEngine;
+  contourEngine=nullptr;
   switch (goal)
   {
     case ROUGH_CONTOURS:
@@ -846,6 +877,8 @@ void TopoCanvas::roughContoursFinish()
 
 void TopoCanvas::contoursCancel()
 {
+  delete contourEngine;
+  contourEngine=nullptr;
   goal=DONE;
   progressDialog->reset();
   timer->stop();
@@ -971,12 +1004,17 @@ void TopoCanvas::dump()
 
 void TopoCanvas::paintEvent(QPaintEvent *event)
 {
-  int i,k,contourType,renderTime=0,pathTime=0,strokeTime=0;
+  int i,k,n,contourType,renderTime=0,pathTime=0,strokeTime=0;
   double r;
+  bcir bc;
   bezier3d b3d;
   ptlist::iterator j;
   set<edge *>::iterator e;
-  RenderItem ri;
+  vector<TileDraw> tiles;
+  exception_ptr renderError;
+  vector<int> visibleEdges;
+  QVector<QLineF> edgeLines[3];
+  bool edgesIndexed;
   QTime paintTime,subTime;
   QPen itemPen;
   QPainter painter(this);
@@ -988,9 +1026,36 @@ void TopoCanvas::paintEvent(QPaintEvent *event)
   painter.setRenderHint(QPainter::Antialiasing,true);
   if (plnum<doc.pl.size() && plnum>=0)
   {
-    doc.pl[plnum].setLocalSets(worldCenter,viewableRadius());
+    edgesIndexed=doc.pl[plnum].edgeIndex.size()==doc.pl[plnum].edges.size();
+    if (!edgesIndexed)
+      doc.pl[plnum].setLocalSets(worldCenter,viewableRadius());
     if (doc.pl[plnum].triangles.size())
-      if (doc.pl[plnum].localEdges.count(nullptr))
+      if (edgesIndexed)
+      {
+        EdgeIndex &einx=doc.pl[plnum].edgeIndex;
+        einx.query(worldCenter,viewableRadius(),pixelScale(),visibleEdges);
+        for (i=0;i<visibleEdges.size();i++)
+        {
+          k=visibleEdges[i];
+          if (!showDelaunay || einx.edges[k]->delaunay())
+            n=einx.edges[k]->broken&1; // 0 normal, 1 breakline
+          else
+            n=2;
+          edgeLines[n].push_back(QLineF(einx.starts[k].getx(),einx.starts[k].gety(),
+                                        einx.ends[k].getx(),einx.ends[k].gety()));
+        }
+        painter.save();
+        painter.setTransform(worldTransform());
+        for (n=0;n<3;n++)
+        {
+          itemPen=(n==0)?normalEdgePen:(n==1)?breakEdgePen:flipEdgePen;
+          itemPen.setCosmetic(true);
+          painter.setPen(itemPen);
+          painter.drawLines(edgeLines[n]);
+        }
+        painter.restore();
+      }
+      else if (doc.pl[plnum].localEdges.count(nullptr))
 	for (i=0;plnum>=0 && i<doc.pl[plnum].edges.size();i++)
 	{
 	  seg=doc.pl[plnum].edges[i].getsegment();
@@ -1032,44 +1097,60 @@ void TopoCanvas::paintEvent(QPaintEvent *event)
           painter.drawEllipse(worldToWindow(j->second),r,r);
         }
 #ifdef CACHEDRAW
-    contourCache.clearPresent();
     subTime.start();
+    contourCache.beginFrame();
     for (i=0;i<doc.pl[plnum].contours.size();i++)
     {
       contourType=doc.pl[plnum].contourInterval.contourType(doc.pl[plnum].contours[i].getElevation());
-      contourCache.checkInObject(&doc.pl[plnum].contours[i],pixelScale(),
-                                 -1,contourColor[contourType&31],contourThickness[contourType>>8],contourLineType[contourType>>8]);
+      contourCache.checkInContour(doc.pl[plnum].contours[i],
+                                  contourColor[contourType&31],contourThickness[contourType>>8],contourLineType[contourType>>8]);
     }
-    contourCache.deleteAbsent();
-    renderTime+=subTime.elapsed();
-    do
+    contourCache.endFrame();
+    tiles=contourCache.visibleTiles(worldCenter,viewableRadius(),pixelScale());
+    renderTime+=subTime.restart();
+    painter.save();
+    painter.setTransform(worldTransform());
+    for (i=0;i<tiles.size();i++)
     {
-      ri=contourCache.nextRenderItem();
-      for (i=0;ri.present && i<ri.rendering.size();i++)
+      painter.setClipRect(tiles[i].clip);
+      for (k=0;k<tiles[i].tile->paths.size();k++)
       {
-        setColor(itemPen,ri.rendering[i].color);
-        setWidth(itemPen,ri.rendering[i].width);
-        setLineType(itemPen,ri.rendering[i].linetype);
-        b3d=ri.rendering[i].path;
-        subTime.start();
-        path=QPainterPath();
-        for (k=0;k<b3d.size();k++)
-        {
-          beziseg=b3d[k];
-          if (k==0)
-            path.moveTo(worldToWindow(beziseg[0]));
-          path.cubicTo(worldToWindow(beziseg[1]),worldToWindow(beziseg[2]),worldToWindow(beziseg[3]));
-        }
-        if (!b3d.isopen())
-          path.closeSubpath();
-        pathTime+=subTime.restart();
-        painter.strokePath(path,itemPen);
-        strokeTime+=subTime.elapsed();
+        const TilePath &tp=tiles[i].tile->paths[k];
+        setColor(itemPen,tp.colr);
+        setWidth(itemPen,tp.thik);
+        setLineType(itemPen,tp.ltype);
+        itemPen.setCosmetic(true); // the width is in pixels, not meters
+        painter.strokePath(tp.path,itemPen);
+      }
+    }
+    painter.restore();
+    strokeTime+=subTime.elapsed();
+    if (contourCache.busy())
+      QTimer::singleShot(TILE_REPAINT_MS,this,SLOT(update()));
+    renderError=contourCache.takeError();
+    if (renderError)
+      try
+      {
+        rethrow_exception(renderError);
+      }
+      catch (BeziExcept &e)
+      {
+        errorMessage->showMessage(tr("Can't render contours. Error: ")+e.message());
+      }
+      catch (exception &e)
+      {
+        errorMessage->showMessage(tr("Can't render contours. Error: ")+QString::fromStdString(e.what()));
+      }
+      catch (...)
+      {
+        errorMessage->showMessage(tr("Can't render contours."));
       }
-    } while (ri.present);
 #else
     for (i=0;i<doc.pl[plnum].contours.size();i++)
     {
+      bc=doc.pl[plnum].contours[i].boundCircle();
+      if (bc.radius*2<pixelScale() || dist(bc.center,worldCenter)-bc.radius>viewableRadius())
+        continue;
       b3d=doc.pl[plnum].contours[i].approx3d(pixelScale());
       path=QPainterPath();
       for (k=0;k<b3d.size();k++)
@@ -1200,6 +1281,7 @@ void TopoCanvas::mouseReleaseEvent(QMouseEvent *event)
         {
           hitRec.edg->flip(&doc.pl[plnum]);
           updateEdgeNeighbors(hitRec.edg);
+          doc.pl[plnum].makeEdgeIndex();
           roughContoursValid=false;
           surfaceValid=false;
           doc.pl[plnum].whichBreak0Valid=2;
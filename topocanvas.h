@@ -40,6 +40,10 @@
 #define MAKE_TIN 1
 #define ROUGH_CONTOURS 2
 #define SMOOTH_CONTOURS 3
+#define CRIT_BATCH 16
+// Triangles per thread whose critical points are found in one timer tick
+#define TILE_REPAINT_MS 20
+// How soon to repaint when contour tiles are still being rendered
 
 class TopoCanvas: public QWidget
 {
@@ -48,6 +52,7 @@ public:
   TopoCanvas(QWidget *parent=0);
   void setBrush(const QBrush &qbrush);
   QPointF worldToWindow(xy pnt);
+  QTransform worldTransform();
   xy windowToWorld(QPointF pnt);
   double pixelScale();
   double viewableRadius();
@@ -130,7 +135,7 @@ private:
   ContourIntervalDialog *ciDialog;
   double conterval;
   xy windowCenter,worldCenter,dragStart;
-  RenderCache contourCache;
+  TileCache contourCache;
   int scale;
   /* scale is the logarithm, in major thirds (see zoom), of the number of
    * windowSize lengths in a meter. It is thus usually negative.
@@ -144,6 +149,7 @@ private:
   xy startPoint;
   int goal;
   int progInx; // used in progress bar loops
+  ContourEngine *contourEngine; // kept from one rough contour elevation to the next
   int elevHi,elevLo; // in contour interval unit
   std::array<double,2> tinlohi;
   bool pointsValid; // If false, to make TIN, must first copy points.
@@ -0,0 +1,255 @@
+/******************************************************/
+/*                                                    */
+/* volume.cpp - cut and fill between two surfaces     */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <cmath>
+#include <array>
+#include "volume.h"
+#include "halton.h"
+#include "manysum.h"
+using namespace std;
+
+/* The volume is computed by a quadtree over the square around the boundary.
+ * A cell that the boundary doesn't come near, and that is inside one
+ * triangle of each surface, is integrated exactly: the difference between
+ * two Bézier triangles is a cubic, which is a bicubic on the square, and
+ * its Bernstein coefficients come from sampling it on a 4×4 grid. If they
+ * are all of one sign, the integral is the area times their mean. Other
+ * cells are divided until they are as small as the resolution, then
+ * sampled at Halton points. Every cell starts its own Halton generator,
+ * so the result doesn't depend on the order in which cells are done. The
+ * generators are copied from one made before the threads start, because
+ * making a halton fills the reversal tables if they aren't filled yet.
+ */
+
+struct CutFillSums
+{
+  pointlist *existing,*design;
+  polyline *boundary;
+  const halton *startHalton;
+  manysum cut,fill,area;
+  triangle *hintExisting,*hintDesign;
+};
+
+triangle *findTriangle(pointlist &pl,triangle *&hint,xy pnt)
+{
+  triangle *ret;
+  if (hint)
+    ret=hint->findt(pnt);
+  else
+    ret=pl.findt(pnt);
+  if (ret)
+    hint=ret;
+  return ret;
+}
+
+array<double,4> bernstein(const array<double,4> &z)
+/* Converts the values of a cubic at 0, 1/3, 2/3, and 1 to its Bernstein
+ * coefficients.
+ */
+{
+  array<double,4> ret;
+  ret[0]=z[0];
+  ret[1]=(-5*z[0]+18*z[1]-9*z[2]+2*z[3])/6;
+  ret[2]=(2*z[0]-9*z[1]+18*z[2]-5*z[3])/6;
+  ret[3]=z[3];
+  return ret;
+}
+
+bool exactCell(CutFillSums &sums,triangle *te,triangle *td,xy corner,double side)
+/* te and td contain the whole cell. Returns false if the difference
+ * may change sign in the cell.
+ */
+{
+  int i,j;
+  array<double,4> row,col;
+  array<array<double,4>,4> coeff;
+  vector<double> terms;
+  xy pnt;
+  bool pos=true,neg=true;
+  double vol;
+  for (i=0;i<4;i++)
+  {
+    for (j=0;j<4;j++)
+    {
+      pnt=corner+xy(side*i/3,side*j/3);
+      row[j]=td->elevation(pnt)-te->elevation(pnt);
+    }
+    coeff[i]=bernstein(row);
+  }
+  for (j=0;j<4;j++)
+  {
+    for (i=0;i<4;i++)
+      col[i]=coeff[i][j];
+    col=bernstein(col);
+    for (i=0;i<4;i++)
+    {
+      terms.push_back(col[i]);
+      if (col[i]>0)
+	neg=false;
+      if (col[i]<0)
+	pos=false;
+    }
+  }
+  if (pos || neg)
+  {
+    vol=pairwisesum(terms)*sqr(side)/16;
+    if (pos)
+      sums.fill+=vol;
+    else
+      sums.cut-=vol;
+    sums.area+=sqr(side);
+  }
+  return pos || neg;
+}
+
+void sampleCell(CutFillSums &sums,xy corner,double side,bool inside)
+{
+  int i;
+  halton hal(*sums.startHalton);
+  xy pnt;
+  triangle *te,*td;
+  double d,w=sqr(side)/VOL_SAMPLES;
+  for (i=0;i<VOL_SAMPLES;i++)
+  {
+    pnt=corner+hal.pnt()*side;
+    if (!inside && fabs(sums.boundary->in(pnt))<0.5)
+      continue;
+    te=findTriangle(*sums.existing,sums.hintExisting,pnt);
+    td=findTriangle(*sums.design,sums.hintDesign,pnt);
+    if (te && td)
+    {
+      d=td->elevation(pnt)-te->elevation(pnt);
+      if (d>0)
+	sums.fill+=d*w;
+      else
+	sums.cut-=d*w;
+      sums.area+=w;
+    }
+  }
+}
+
+bool boundaryNear(CutFillSums &sums,bcir circ)
+/* Returns true if the boundary comes within the circle. The pieces whose
+ * bounding circles overlap it are checked by finding their closest points.
+ */
+{
+  vector<int> pieces=sums.boundary->overlappingPieces(circ);
+  spiralarc piece;
+  int i;
+  bool ret=false;
+  for (i=0;!ret && i<pieces.size();i++)
+  {
+    piece=sums.boundary->getPiece(pieces[i]);
+    ret=dist(xy(piece.station(piece.closest(circ.center,INFINITY,true))),circ.center)<=circ.radius;
+  }
+  return ret;
+}
+
+void cutFillCell(CutFillSums &sums,xy corner,double side,int depth)
+{
+  bcir circ;
+  bool crosses;
+  int i;
+  triangle *te[4],*td[4];
+  circ.center=corner+xy(side/2,side/2);
+  circ.radius=side*M_SQRT1_2;
+  crosses=boundaryNear(sums,circ);
+  if (!crosses && fabs(sums.boundary->in(circ.center))<0.5)
+    return;
+  if (!crosses)
+  {
+    for (i=0;i<4;i++)
+    {
+      te[i]=findTriangle(*sums.existing,sums.hintExisting,corner+xy(side*(i&1),side*(i>>1)));
+      td[i]=findTriangle(*sums.design,sums.hintDesign,corner+xy(side*(i&1),side*(i>>1)));
+    }
+    if (te[0] && td[0] && te[0]==te[1] && te[0]==te[2] && te[0]==te[3] &&
+        td[0]==td[1] && td[0]==td[2] && td[0]==td[3] &&
+        exactCell(sums,te[0],td[0],corner,side))
+      return;
+  }
+  if (depth>0)
+  {
+    for (i=0;i<4;i++)
+      cutFillCell(sums,corner+xy(side/2*(i&1),side/2*(i>>1)),side/2,depth-1);
+  }
+  else
+    sampleCell(sums,corner,side,!crosses);
+}
+
+CutFill cutFill(pointlist &existing,pointlist &design,polyline &boundary,double resolution,int nthreads)
+/* Computes the cut and fill between existing and design inside boundary.
+ * Cells are divided down to about resolution. Each thread has its own
+ * manysums and triangle hints, which are cleared at every top-level cell;
+ * the totals of the top-level cells are added in order at the end, so the
+ * result is the same for any number of threads.
+ */
+{
+  int ncells=1<<VOL_TOP_LEVEL,depth;
+  double west,south,east,north,side,topside;
+  vector<array<double,3> > cellSums(ncells*ncells);
+  manysum cut,fill,area;
+  CutFill ret;
+  halton startHalton;
+  int i;
+  boundary.updateBoundTree();
+  west=boundary.dirbound(0);
+  south=boundary.dirbound(DEG90);
+  east=-boundary.dirbound(DEG180);
+  north=-boundary.dirbound(-DEG90);
+  side=fmax(east-west,north-south);
+  topside=side/ncells;
+  depth=0;
+  while (topside/(1<<depth)>resolution && depth<30)
+    depth++;
+  parallelRanges(cellSums.size(),nthreads,[&](size_t begin,size_t end)
+  {
+    CutFillSums sums;
+    size_t j;
+    sums.existing=&existing;
+    sums.design=&design;
+    sums.boundary=&boundary;
+    sums.startHalton=&startHalton;
+    for (j=begin;j<end;j++)
+    {
+      sums.hintExisting=sums.hintDesign=nullptr;
+      sums.cut.clear();
+      sums.fill.clear();
+      sums.area.clear();
+      cutFillCell(sums,xy(west+topside*(j%ncells),south+topside*(j/ncells)),topside,depth);
+      cellSums[j][0]=sums.cut.total();
+      cellSums[j][1]=sums.fill.total();
+      cellSums[j][2]=sums.area.total();
+    }
+  });
+  for (i=0;i<cellSums.size();i++)
+  {
+    cut+=cellSums[i][0];
+    fill+=cellSums[i][1];
+    area+=cellSums[i][2];
+  }
+  ret.cut=cut.total();
+  ret.fill=fill.total();
+  ret.area=area.total();
+  return ret;
+}
@@ -0,0 +1,46 @@
+/******************************************************/
+/*                                                    */
+/* volume.h - cut and fill between two surfaces       */
+/*                                                    */
+/******************************************************/
+/* Copyright 2019 Pierre Abbat.
+ * This file is part of Bezitopo.
+ *
+ * Bezitopo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Bezitopo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Bezitopo. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef VOLUME_H
+#define VOLUME_H
+#include "pointlist.h"
+#include "polyline.h"
+
+#define VOL_TOP_LEVEL 4
+/* The square around the boundary is first cut into 2^VOL_TOP_LEVEL cells
+ * on a side, which are divided among the threads.
+ */
+#define VOL_SAMPLES 64
+// Number of Halton points in each smallest cell that can't be done exactly
+
+struct CutFill
+/* cut is the volume where the design surface is below the existing surface;
+ * fill is where it's above. area is the area inside the boundary where both
+ * surfaces are defined.
+ */
+{
+  double cut,fill,area;
+};
+
+CutFill cutFill(pointlist &existing,pointlist &design,polyline &boundary,double resolution,int nthreads=1);
+#endif